@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "walk.h"
+#include "constants.h"
+
+/*
+ * Reads one wide directory again and again, through libc's readdir and
+ * through dir_reader_t with different buffer sizes. Every run prints one
+ * CSV row, reads stays empty for readdir since libc doesn't tell.
+ *
+ * Without a dirname a directory of the given number of empty files is made
+ * in /tmp and removed afterwards. The page cache is warm after the first
+ * pass, so this measures syscall and copy overhead, not the disk.
+ */
+
+#define DEFAULT_ENTRIES 200000
+#define REPETITIONS 5
+
+const size_t BUFFER_SIZES[] = {32 * 1024, 64 * 1024, 128 * 1024, 256 * 1024};
+
+typedef struct read_result_t
+{
+        unsigned long entries;
+        unsigned long directories;
+        unsigned long name_bytes;
+        unsigned long reads;
+} read_result_t;
+
+long bench_now_ns()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// Same work per entry for both readers, the name length and kind
+int read_with_readdir(const char *path, read_result_t *result)
+{
+        DIR *dir = opendir(path);
+        if (!dir)
+                return FATAL_ERROR;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL)
+        {
+                if (!strcmp(".", entry->d_name) || !strcmp("..", entry->d_name))
+                        continue;
+                result->entries++;
+                result->directories += entry->d_type == DT_DIR;
+                result->name_bytes += strlen(entry->d_name);
+        }
+        closedir(dir);
+        return 0;
+}
+
+int read_with_reader(dir_reader_t *reader, const char *path, read_result_t *result)
+{
+        int fd = open_directory_at(AT_FDCWD, path);
+        if (fd < 0)
+                return FATAL_ERROR;
+        if (start_dir_reader(reader, fd) != 0)
+        {
+                close(fd);
+                return FATAL_ERROR;
+        }
+        unsigned long reads = reader->reads;
+        const dir_entry_t *entry;
+        while ((entry = read_dir_entry(reader)) != NULL)
+        {
+                result->entries++;
+                result->directories += entry->kind == ENTRY_DIRECTORY;
+                result->name_bytes += entry->name_len;
+        }
+        result->reads += reader->reads - reads;
+        finish_dir_reader(reader);
+        close(fd);
+        return 0;
+}
+
+void print_row(const char *reader, size_t buffer_size, const read_result_t *result, double seconds, double baseline)
+{
+        double rate = seconds > 0 ? result->entries / seconds : 0;
+        printf("%s,", reader);
+        if (buffer_size)
+                printf("%zu", buffer_size / 1024);
+        printf(",%lu,%.6f,%.0f,", result->entries, seconds, rate);
+        if (buffer_size)
+                printf("%lu", result->reads);
+        printf(",%.3f\n", baseline > 0 ? rate / baseline : 1.0);
+        fflush(stdout);
+}
+
+int make_directory(char *path, unsigned long entries)
+{
+        if (!mkdtemp(path))
+                return FATAL_ERROR;
+        int dir_fd = open_directory_at(AT_FDCWD, path);
+        if (dir_fd < 0)
+                return FATAL_ERROR;
+        char name[32];
+        for (unsigned long i = 0; i < entries; i++)
+        {
+                // Long enough to look like build output, object-0000123.o
+                snprintf(name, sizeof(name), "object-%07lu.o", i);
+                int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+                if (fd < 0)
+                {
+                        close(dir_fd);
+                        return FATAL_ERROR;
+                }
+                close(fd);
+        }
+        close(dir_fd);
+        return 0;
+}
+
+void remove_directory(const char *path, unsigned long entries)
+{
+        int dir_fd = open_directory_at(AT_FDCWD, path);
+        if (dir_fd >= 0)
+        {
+                char name[32];
+                for (unsigned long i = 0; i < entries; i++)
+                {
+                        snprintf(name, sizeof(name), "object-%07lu.o", i);
+                        unlinkat(dir_fd, name, 0);
+                }
+                close(dir_fd);
+        }
+        rmdir(path);
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc > 3)
+        {
+                printf("Usage: dir_read_bench [entries] [dirname]\n");
+                return 1;
+        }
+        long entries = argc > 1 ? atol(argv[1]) : DEFAULT_ENTRIES;
+        if (entries < 1)
+        {
+                printf("entries has to be at least 1\n");
+                return 1;
+        }
+
+        char made[] = "/tmp/dir_read_bench.XXXXXX";
+        const char *path = argc > 2 ? argv[2] : made;
+        if (argc <= 2 && make_directory(made, entries) != 0)
+        {
+                printf("Could not create %ld files in %s\n", entries, made);
+                remove_directory(made, entries);
+                return 1;
+        }
+
+        printf("reader,buffer_kib,entries,seconds,entries_per_sec,reads,speedup\n");
+
+        // Once up front so every run finds the directory cached
+        read_result_t warmup = {0};
+        read_with_readdir(path, &warmup);
+
+        read_result_t result = {0};
+        long begin = bench_now_ns();
+        for (int i = 0; i < REPETITIONS; i++)
+                read_with_readdir(path, &result);
+        double seconds = (bench_now_ns() - begin) / 1e9;
+        double baseline = seconds > 0 ? result.entries / seconds : 0;
+        print_row("readdir", 0, &result, seconds, 0);
+
+        for (size_t i = 0; i < sizeof(BUFFER_SIZES) / sizeof(BUFFER_SIZES[0]); i++)
+        {
+                dir_reader_t reader;
+                if (init_dir_reader(&reader, BUFFER_SIZES[i]) != 0)
+                        break;
+                memset(&result, 0, sizeof(result));
+                begin = bench_now_ns();
+                for (int j = 0; j < REPETITIONS; j++)
+                        read_with_reader(&reader, path, &result);
+                seconds = (bench_now_ns() - begin) / 1e9;
+                print_row("dir_reader", BUFFER_SIZES[i], &result, seconds, baseline);
+                destroy_dir_reader(&reader);
+        }
+
+        if (argc <= 2)
+                remove_directory(made, entries);
+        return 0;
+}
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "walk.h"
+#include "stat_ring.h"
+#include "constants.h"
+
+/*
+ * Stats the files of a tree once per run, either with one blocking stat per
+ * entry from a number of threads, like SCAn without --io-uring, or through
+ * a stat_ring_t per thread with many statx calls in flight. Every run
+ * prints one CSV row, depth stays empty for the blocking runs.
+ *
+ * Without a dirname a tree of the given number of empty files spread over
+ * BENCH_DIRECTORIES directories is made in /tmp and removed afterwards. The
+ * page cache is warm after the first pass, so on its own this measures the
+ * overhead of either way. Drop the caches between runs (as root, echo 3 >
+ * /proc/sys/vm/drop_caches) to see what the device makes of it.
+ */
+
+#define DEFAULT_ENTRIES 100000
+#define BENCH_DIRECTORIES 100
+#define MAX_THREADS 64
+
+const int THREAD_COUNTS[] = {1, 2, 5, 16, 64};
+const int RING_THREAD_COUNTS[] = {1, 2};
+const unsigned int RING_DEPTHS[] = {32, 128, 256};
+
+// Files found below the root, names of one directory follow each other
+typedef struct bench_tree_t
+{
+        char **directories;
+        // First name of every directory, one past the last at the end
+        unsigned long *first_name;
+        unsigned long directory_count;
+        char **names;
+        unsigned long name_count;
+} bench_tree_t;
+
+bench_tree_t tree;
+atomic_ulong next_directory;
+atomic_ulong stated;
+unsigned int ring_depth;
+
+long bench_now_ns()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+int grow(void **array, unsigned long count, unsigned long *capacity, size_t size)
+{
+        if (count < *capacity)
+                return 0;
+        unsigned long next = *capacity ? *capacity * 2 : 1024;
+        void *grown = realloc(*array, next * size);
+        if (!grown)
+                return MEMORY_ERROR;
+        *array = grown;
+        *capacity = next;
+        return 0;
+}
+
+// Reads the tree below path into tree, directories are visited in order
+int collect_tree(const char *path, dir_reader_t *reader)
+{
+        unsigned long directory_capacity = 0, first_capacity = 0, name_capacity = 0;
+        if (grow((void **)&tree.directories, 0, &directory_capacity, sizeof(char *)) != 0)
+                return MEMORY_ERROR;
+        tree.directories[tree.directory_count++] = strdup(path);
+
+        char full[PATH_MAX];
+        for (unsigned long d = 0; d < tree.directory_count; d++)
+        {
+                if (grow((void **)&tree.first_name, d, &first_capacity, sizeof(unsigned long)) != 0)
+                        return MEMORY_ERROR;
+                tree.first_name[d] = tree.name_count;
+
+                int fd = open_directory_at(AT_FDCWD, tree.directories[d]);
+                if (fd < 0 || start_dir_reader(reader, fd) != 0)
+                {
+                        if (fd >= 0)
+                                close(fd);
+                        continue;
+                }
+                const dir_entry_t *entry;
+                while ((entry = read_dir_entry(reader)) != NULL)
+                {
+                        if (entry->kind == ENTRY_DIRECTORY)
+                        {
+                                snprintf(full, sizeof(full), "%s/%s", tree.directories[d], entry->name);
+                                if (grow((void **)&tree.directories, tree.directory_count, &directory_capacity, sizeof(char *)) != 0)
+                                        return MEMORY_ERROR;
+                                tree.directories[tree.directory_count++] = strdup(full);
+                        }
+                        else
+                        {
+                                // Unknown kinds are stat'ed like files
+                                if (grow((void **)&tree.names, tree.name_count, &name_capacity, sizeof(char *)) != 0)
+                                        return MEMORY_ERROR;
+                                tree.names[tree.name_count++] = strdup(entry->name);
+                        }
+                }
+                finish_dir_reader(reader);
+                close(fd);
+        }
+        if (grow((void **)&tree.first_name, tree.directory_count, &first_capacity, sizeof(unsigned long)) != 0)
+                return MEMORY_ERROR;
+        tree.first_name[tree.directory_count] = tree.name_count;
+        return 0;
+}
+
+void free_tree()
+{
+        for (unsigned long i = 0; i < tree.directory_count; i++)
+                free(tree.directories[i]);
+        for (unsigned long i = 0; i < tree.name_count; i++)
+                free(tree.names[i]);
+        free(tree.directories);
+        free(tree.first_name);
+        free(tree.names);
+}
+
+// One blocking stat after the other, directories are shared out one by one
+void *stat_blocking(void *arg)
+{
+        (void)arg;
+        unsigned long d;
+        while ((d = atomic_fetch_add(&next_directory, 1)) < tree.directory_count)
+        {
+                int fd = open_directory_at(AT_FDCWD, tree.directories[d]);
+                if (fd < 0)
+                        continue;
+                unsigned long done = 0;
+                for (unsigned long i = tree.first_name[d]; i < tree.first_name[d + 1]; i++)
+                {
+                        entry_stat_t stat;
+                        done += stat_entry_at(fd, tree.names[i], WALK_SIZE | WALK_MTIME, &stat) == 0;
+                }
+                atomic_fetch_add(&stated, done);
+                close(fd);
+        }
+        return NULL;
+}
+
+// Same work with up to ring_depth statx calls in flight per thread
+void *stat_ring(void *arg)
+{
+        (void)arg;
+        stat_ring_t *ring = create_stat_ring(ring_depth);
+        stat_request_t *requests = malloc(ring_depth * sizeof(stat_request_t));
+        if (!ring || !requests)
+        {
+                destroy_stat_ring(ring);
+                free(requests);
+                return NULL;
+        }
+        unsigned long d;
+        while ((d = atomic_fetch_add(&next_directory, 1)) < tree.directory_count)
+        {
+                int fd = open_directory_at(AT_FDCWD, tree.directories[d]);
+                if (fd < 0)
+                        continue;
+                unsigned long done = 0;
+                for (unsigned long i = tree.first_name[d]; i < tree.first_name[d + 1]; i += ring_depth)
+                {
+                        unsigned long count = tree.first_name[d + 1] - i;
+                        if (count > ring_depth)
+                                count = ring_depth;
+                        for (unsigned long j = 0; j < count; j++)
+                        {
+                                requests[j].name = tree.names[i + j];
+                                requests[j].fields = WALK_SIZE | WALK_MTIME;
+                        }
+                        if (stat_entries_at(ring, fd, requests, count) != 0)
+                                break;
+                        for (unsigned long j = 0; j < count; j++)
+                                done += requests[j].result == 0;
+                }
+                atomic_fetch_add(&stated, done);
+                close(fd);
+        }
+        destroy_stat_ring(ring);
+        free(requests);
+        return NULL;
+}
+
+// Seconds the given number of threads take for the whole tree
+double run(void *(*func)(void *), int threads)
+{
+        pthread_t workers[MAX_THREADS];
+        atomic_store(&next_directory, 0);
+        atomic_store(&stated, 0);
+        long begin = bench_now_ns();
+        int started = 0;
+        for (; started < threads; started++)
+        {
+                if (pthread_create(&workers[started], NULL, func, NULL) != 0)
+                        break;
+        }
+        for (int i = 0; i < started; i++)
+                pthread_join(workers[i], NULL);
+        return (bench_now_ns() - begin) / 1e9;
+}
+
+void print_row(const char *mode, int threads, unsigned int depth, double seconds, double baseline)
+{
+        unsigned long entries = atomic_load(&stated);
+        double rate = seconds > 0 ? entries / seconds : 0;
+        printf("%s,%d,", mode, threads);
+        if (depth)
+                printf("%u", depth);
+        printf(",%lu,%.6f,%.0f,%.3f\n", entries, seconds, rate, baseline > 0 ? rate / baseline : 1.0);
+        fflush(stdout);
+}
+
+int make_tree(char *path, unsigned long entries)
+{
+        if (!mkdtemp(path))
+                return FATAL_ERROR;
+        char name[PATH_MAX];
+        for (int d = 0; d < BENCH_DIRECTORIES; d++)
+        {
+                snprintf(name, sizeof(name), "%s/dir-%03d", path, d);
+                if (mkdir(name, 0755) != 0)
+                        return FATAL_ERROR;
+        }
+        for (unsigned long i = 0; i < entries; i++)
+        {
+                snprintf(name, sizeof(name), "%s/dir-%03lu/object-%07lu.o", path, i % BENCH_DIRECTORIES, i);
+                int fd = open(name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+                if (fd < 0)
+                        return FATAL_ERROR;
+                close(fd);
+        }
+        return 0;
+}
+
+void remove_tree(const char *path, unsigned long entries)
+{
+        char name[PATH_MAX];
+        for (unsigned long i = 0; i < entries; i++)
+        {
+                snprintf(name, sizeof(name), "%s/dir-%03lu/object-%07lu.o", path, i % BENCH_DIRECTORIES, i);
+                unlink(name);
+        }
+        for (int d = 0; d < BENCH_DIRECTORIES; d++)
+        {
+                snprintf(name, sizeof(name), "%s/dir-%03d", path, d);
+                rmdir(name);
+        }
+        rmdir(path);
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc > 3)
+        {
+                printf("Usage: metadata_bench [entries] [dirname]\n");
+                return 1;
+        }
+        long entries = argc > 1 ? atol(argv[1]) : DEFAULT_ENTRIES;
+        if (entries < 1)
+        {
+                printf("entries has to be at least 1\n");
+                return 1;
+        }
+
+        char made[] = "/tmp/metadata_bench.XXXXXX";
+        const char *path = argc > 2 ? argv[2] : made;
+        if (argc <= 2 && make_tree(made, entries) != 0)
+        {
+                printf("Could not create %ld files in %s\n", entries, made);
+                remove_tree(made, entries);
+                return 1;
+        }
+
+        dir_reader_t reader;
+        if (init_dir_reader(&reader, 0) != 0 || collect_tree(path, &reader) != 0)
+        {
+                printf("Could not read %s\n", path);
+                return 1;
+        }
+        destroy_dir_reader(&reader);
+
+        printf("mode,threads,depth,entries,seconds,entries_per_sec,speedup\n");
+
+        // Once up front so every run finds the inodes cached
+        run(stat_blocking, 1);
+
+        double baseline = 0;
+        for (size_t i = 0; i < sizeof(THREAD_COUNTS) / sizeof(THREAD_COUNTS[0]); i++)
+        {
+                double seconds = run(stat_blocking, THREAD_COUNTS[i]);
+                print_row("blocking", THREAD_COUNTS[i], 0, seconds, baseline);
+                if (i == 0)
+                        baseline = seconds > 0 ? atomic_load(&stated) / seconds : 0;
+        }
+
+        stat_ring_t *probe = create_stat_ring(1);
+        if (!probe)
+        {
+                printf("# io_uring is not available, skipping the ring runs\n");
+        }
+        destroy_stat_ring(probe);
+        for (size_t i = 0; probe && i < sizeof(RING_DEPTHS) / sizeof(RING_DEPTHS[0]); i++)
+        {
+                ring_depth = RING_DEPTHS[i];
+                for (size_t j = 0; j < sizeof(RING_THREAD_COUNTS) / sizeof(RING_THREAD_COUNTS[0]); j++)
+                {
+                        double seconds = run(stat_ring, RING_THREAD_COUNTS[j]);
+                        print_row("io_uring", RING_THREAD_COUNTS[j], ring_depth, seconds, baseline);
+                }
+        }
+
+        free_tree();
+        if (argc <= 2)
+                remove_tree(made, entries);
+        return 0;
+}
@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "thread_pool.h"
+#include "logger.h"
+#include "constants.h"
+
+/*
+ * Microbenchmarks of the pool itself. Every run prints one CSV row, columns
+ * that don't apply to a benchmark stay empty:
+ *
+ *   empty_external  tiny tasks submitted from outside the pool, per backend
+ *   fanout          tree of tasks spawning tasks, nothing else per task
+ *   fanout_stat     same tree with one stat per task, like traverse_directories
+ *   real            directories below the given root, one task each
+ *   latency_parked  enqueue to start of a single task once all workers parked
+ *   latency_hot     same, submitted right after the previous one finished
+ *
+ * The tree and directory runs go from 1 to max_workers, doubling each time.
+ */
+
+// Shape of the synthetic tree
+#define SYNTHETIC_FANOUT 6
+#define SYNTHETIC_DEPTH 7
+
+// Tiny tasks submitted from the main thread per queue backend
+#define EXTERNAL_TASKS 1000000
+#define EXTERNAL_WORKERS 4
+
+// Single task round trips per latency run, with a pause before each parked one
+// that is longer than the workers spin
+#define LATENCY_SAMPLES 2000
+#define LATENCY_WORKERS 4
+#define LATENCY_PARK_US 200
+
+const int DEFAULT_MAX_WORKERS = 48;
+
+thread_pool_t *bench_pool;
+atomic_long tasks_run;
+// Voluntary and involuntary context switches of the whole process in the last run
+long context_switches;
+
+typedef struct latency_sample_t
+{
+        long enqueued_ns;
+        long started_ns;
+} latency_sample_t;
+
+typedef struct bench_result_t
+{
+        const char *benchmark;
+        const char *backend;
+        int workers;
+        long tasks;
+        double seconds;
+        // Rate of the 1 worker run of the same benchmark, 0 if there is none
+        double baseline;
+        // Latency percentiles in microseconds, only for latency runs
+        int has_latency;
+        double p50_us;
+        double p99_us;
+        double max_us;
+} bench_result_t;
+
+long bench_now_ns()
+{
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+long process_context_switches()
+{
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+void print_header()
+{
+        printf("benchmark,backend,workers,tasks,seconds,tasks_per_sec,speedup,csw_per_task,p50_us,p99_us,max_us\n");
+}
+
+void print_result(const bench_result_t *result)
+{
+        double rate = result->seconds > 0 ? result->tasks / result->seconds : 0;
+        printf("%s,%s,%d,%ld,%.6f,%.0f,", result->benchmark, result->backend, result->workers, result->tasks, result->seconds, rate);
+        if (result->baseline > 0)
+                printf("%.3f", rate / result->baseline);
+        printf(",%.4f,", result->tasks ? (double)context_switches / result->tasks : 0);
+        if (result->has_latency)
+                printf("%.2f,%.2f,%.2f", result->p50_us, result->p99_us, result->max_us);
+        else
+                printf(",,");
+        printf("\n");
+        fflush(stdout);
+}
+
+int fanout_task(task_queue_entry_arg_t *task_arg);
+
+// arg holds the remaining depth, the sign whether to stat
+int spawn_children(task_queue_entry_arg_t *task_arg, int (*task_func)(task_queue_entry_arg_t *))
+{
+        long depth = (long)task_arg->arg;
+        free_task_arg(bench_pool, task_arg);
+        atomic_fetch_add_explicit(&tasks_run, 1, memory_order_relaxed);
+
+        long remaining = depth < 0 ? -depth : depth;
+        if (depth < 0)
+        {
+                // One metadata syscall per directory, like the real traversal
+                struct stat s;
+                stat("/", &s);
+        }
+        if (remaining == 0)
+                return 0;
+
+        for (int i = 0; i < SYNTHETIC_FANOUT; i++)
+        {
+                task_queue_entry_arg_t *next_arg = alloc_task_arg(bench_pool, 0);
+                next_arg->arg = (void *)(depth < 0 ? depth + 1 : depth - 1);
+                int err = enqueue_task(bench_pool, task_func, next_arg);
+                if (err)
+                {
+                        free_task_arg(bench_pool, next_arg);
+                        return err;
+                }
+        }
+        return 0;
+}
+
+int fanout_task(task_queue_entry_arg_t *task_arg)
+{
+        return spawn_children(task_arg, fanout_task);
+}
+
+int real_directory(task_queue_entry_arg_t *task_arg)
+{
+        char *path = (char *)task_arg->arg;
+
+        DIR *pDir = opendir(path);
+        if (pDir == NULL)
+        {
+                free_task_arg(bench_pool, task_arg);
+                return 0;
+        }
+        atomic_fetch_add_explicit(&tasks_run, 1, memory_order_relaxed);
+
+        size_t path_len = strlen(path);
+        struct dirent *pDirent;
+        while ((pDirent = readdir(pDir)) != NULL)
+        {
+                if (pDirent->d_type != DT_DIR ||
+                    !strcmp(".", pDirent->d_name) ||
+                    !strcmp("..", pDirent->d_name))
+                        continue;
+
+                task_queue_entry_arg_t *next_arg = alloc_task_arg(bench_pool, path_len + strlen(pDirent->d_name) + 2);
+                sprintf(next_arg->arg, "%s/%s", path, pDirent->d_name);
+                if (enqueue_task(bench_pool, real_directory, next_arg))
+                {
+                        free_task_arg(bench_pool, next_arg);
+                }
+        }
+        closedir(pDir);
+        free_task_arg(bench_pool, task_arg);
+        return 0;
+}
+
+int empty_task(task_queue_entry_arg_t *task_arg)
+{
+        (void)task_arg;
+        atomic_fetch_add_explicit(&tasks_run, 1, memory_order_relaxed);
+        return 0;
+}
+
+int latency_task(task_queue_entry_arg_t *task_arg)
+{
+        latency_sample_t *sample = task_arg->arg;
+        sample->started_ns = bench_now_ns();
+        return 0;
+}
+
+thread_pool_t *create_bench_pool(int workers, task_queue_backend_t backend)
+{
+        thread_pool_options_t options = {
+                .thread_count = workers,
+                .queue_backend = backend,
+                .queue_capacity = 0,
+        };
+        thread_pool_creation_status_t status;
+        thread_pool_t *pool = create_thread_pool_with_options(&options, &status);
+        if (status != CREATED)
+        {
+                fprintf(stderr, "Failed to create pool with %d workers and backend %d: %d\n", workers, backend, status);
+                return NULL;
+        }
+        atomic_store(&tasks_run, 0);
+        return pool;
+}
+
+double run_external(task_queue_backend_t backend)
+{
+        bench_pool = create_bench_pool(EXTERNAL_WORKERS, backend);
+        if (!bench_pool)
+                return -1;
+
+        task_queue_entry_arg_t *args = calloc(EXTERNAL_TASKS, sizeof(task_queue_entry_arg_t));
+        long switches = process_context_switches();
+        long begin = bench_now_ns();
+
+        for (int i = 0; i < EXTERNAL_TASKS; i++)
+        {
+                int err;
+                while ((err = enqueue_task(bench_pool, empty_task, &args[i])) == QUEUE_FULL)
+                        sched_yield();
+                if (err)
+                        break;
+        }
+        join(bench_pool);
+
+        long end = bench_now_ns();
+        context_switches = process_context_switches() - switches;
+        free(args);
+        return (end - begin) / 1e9;
+}
+
+// root NULL runs the synthetic tree, stat_per_task adds a syscall to each node
+double run_tree(int workers, const char *root, int stat_per_task)
+{
+        bench_pool = create_bench_pool(workers, TASK_QUEUE_LOCKED);
+        if (!bench_pool)
+                return -1;
+
+        long switches = process_context_switches();
+        long begin = bench_now_ns();
+
+        if (root)
+        {
+                task_queue_entry_arg_t *arg = alloc_task_arg(bench_pool, strlen(root) + 1);
+                strcpy(arg->arg, root);
+                enqueue_task(bench_pool, real_directory, arg);
+        }
+        else
+        {
+                task_queue_entry_arg_t *arg = alloc_task_arg(bench_pool, 0);
+                arg->arg = (void *)(long)(stat_per_task ? -SYNTHETIC_DEPTH : SYNTHETIC_DEPTH);
+                enqueue_task(bench_pool, fanout_task, arg);
+        }
+        join(bench_pool);
+
+        long end = bench_now_ns();
+        context_switches = process_context_switches() - switches;
+        return (end - begin) / 1e9;
+}
+
+int compare_longs(const void *a, const void *b)
+{
+        long left = *(const long *)a;
+        long right = *(const long *)b;
+        return (left > right) - (left < right);
+}
+
+// One task at a time, waiting for each before the next
+int run_latency(int parked, bench_result_t *result)
+{
+        bench_pool = create_bench_pool(LATENCY_WORKERS, TASK_QUEUE_LOCKED);
+        if (!bench_pool)
+                return -1;
+
+        latency_sample_t sample;
+        task_queue_entry_arg_t arg = {0};
+        arg.arg = &sample;
+        long *latencies = malloc(LATENCY_SAMPLES * sizeof(long));
+        struct timespec pause = {0, LATENCY_PARK_US * 1000L};
+
+        long switches = process_context_switches();
+        long begin = bench_now_ns();
+        for (int i = 0; i < LATENCY_SAMPLES; i++)
+        {
+                if (parked)
+                        nanosleep(&pause, NULL);
+                sample.enqueued_ns = bench_now_ns();
+                enqueue_task(bench_pool, latency_task, &arg);
+                wait_idle(bench_pool);
+                latencies[i] = sample.started_ns - sample.enqueued_ns;
+        }
+        long end = bench_now_ns();
+        context_switches = process_context_switches() - switches;
+        shutdown_pool(bench_pool);
+
+        qsort(latencies, LATENCY_SAMPLES, sizeof(long), compare_longs);
+        result->tasks = LATENCY_SAMPLES;
+        result->seconds = (end - begin) / 1e9;
+        result->has_latency = 1;
+        result->p50_us = latencies[LATENCY_SAMPLES / 2] / 1000.0;
+        result->p99_us = latencies[LATENCY_SAMPLES * 99 / 100] / 1000.0;
+        result->max_us = latencies[LATENCY_SAMPLES - 1] / 1000.0;
+        free(latencies);
+        return 0;
+}
+
+// Runs one tree benchmark from 1 to max_workers workers
+void run_scaling(const char *benchmark, int max_workers, const char *root, int stat_per_task)
+{
+        double baseline = 0;
+        for (int workers = 1; workers <= max_workers; workers = workers * 2 > max_workers && workers < max_workers ? max_workers : workers * 2)
+        {
+                double seconds = run_tree(workers, root, stat_per_task);
+                if (seconds < 0)
+                        break;
+                bench_result_t result = {
+                        .benchmark = benchmark,
+                        .backend = "locked",
+                        .workers = workers,
+                        .tasks = atomic_load(&tasks_run),
+                        .seconds = seconds,
+                        .baseline = baseline,
+                };
+                if (workers == 1)
+                {
+                        baseline = result.tasks / seconds;
+                        result.baseline = baseline;
+                }
+                print_result(&result);
+        }
+}
+
+int main(int argc, char *argv[])
+{
+        if (argc > 3)
+        {
+                printf("Usage: thread_pool_bench [max_workers] [dirname]\n");
+                return 1;
+        }
+        int max_workers = argc > 1 ? atoi(argv[1]) : DEFAULT_MAX_WORKERS;
+        const char *root = argc > 2 ? argv[2] : NULL;
+        if (max_workers < 1)
+        {
+                printf("max_workers has to be at least 1\n");
+                return 1;
+        }
+
+        init_logger(LOG_LEVEL_ERROR);
+        print_header();
+
+        const char *backend_names[] = {"locked", "lock-free"};
+        task_queue_backend_t backends[] = {TASK_QUEUE_LOCKED, TASK_QUEUE_LOCK_FREE};
+        for (int i = 0; i < 2; i++)
+        {
+                double seconds = run_external(backends[i]);
+                if (seconds < 0)
+                        break;
+                bench_result_t result = {
+                        .benchmark = "empty_external",
+                        .backend = backend_names[i],
+                        .workers = EXTERNAL_WORKERS,
+                        .tasks = atomic_load(&tasks_run),
+                        .seconds = seconds,
+                };
+                print_result(&result);
+        }
+
+        run_scaling("fanout", max_workers, NULL, 0);
+        run_scaling("fanout_stat", max_workers, NULL, 1);
+        if (root)
+        {
+                run_scaling("real", max_workers, root, 0);
+        }
+
+        const char *latency_names[] = {"latency_hot", "latency_parked"};
+        for (int parked = 0; parked < 2; parked++)
+        {
+                bench_result_t result = {
+                        .benchmark = latency_names[parked],
+                        .backend = "locked",
+                        .workers = LATENCY_WORKERS,
+                };
+                if (run_latency(parked, &result) == 0)
+                        print_result(&result);
+        }
+
+        stop_logger();
+        return 0;
+}
@@ -6,5 +6,6 @@
 #define MEMORY_ERROR    -3
 #define QUEUE_EMPTY     -4
 #define QUEUE_STOPPED   -5
+#define QUEUE_FULL      -8
 
 #endif
\ No newline at end of file
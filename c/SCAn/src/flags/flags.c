@@ -0,0 +1,187 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "flags.h"
+
+void display_help();
+void inform_of_misuse(char flag);
+bool parse_number(const char *value, unsigned long *number);
+bool is_long_flag(const char *arg, size_t name_len, const char *name);
+
+// Returns -1 if the arguments were wrong or help was asked for
+int parse_flags(int argc, char **argv, scan_flags_t *flags)
+{
+    flags->timeout_ms = 0;
+    flags->max_entries = 0;
+    flags->cpu_list = NULL;
+    flags->trace_path = NULL;
+    flags->pipeline = 0;
+    flags->io_uring = 0;
+    flags->index = 0;
+    flags->watch = 0;
+    flags->lock_profile = 0;
+    flags->first_path = argc;
+
+    for (int i = 1; i < argc; i++)
+    {
+        char *cur = *(argv + i);
+        if (*cur != '-')
+        {
+            flags->first_path = i;
+            break;
+        }
+
+        // Long names map onto the short ones, values follow a '='
+        char flag = *(cur + 1);
+        char *value = strchr(cur, '=');
+        size_t name_len = value ? (size_t)(value - cur) : strlen(cur);
+        if (flag == '-')
+        {
+            if (is_long_flag(cur, name_len, "--timeout"))
+                flag = 't';
+            else if (is_long_flag(cur, name_len, "--max-entries"))
+                flag = 'm';
+            else if (is_long_flag(cur, name_len, "--cpus"))
+                flag = 'c';
+            else if (is_long_flag(cur, name_len, "--trace"))
+                flag = 'T';
+            else if (!strcmp(cur, "--pipeline"))
+                flag = 'p';
+            else if (!strcmp(cur, "--io-uring"))
+                flag = 'u';
+            else if (!strcmp(cur, "--index"))
+                flag = 'i';
+            else if (!strcmp(cur, "--watch"))
+                flag = 'w';
+            else if (!strcmp(cur, "--lock-profile"))
+                flag = 'l';
+            else
+                flag = 'h';
+        }
+
+        unsigned long number;
+        switch (flag)
+        {
+        case 't':
+            if (!value || !parse_number(value + 1, &number) || number > UINT_MAX)
+            {
+                inform_of_misuse('t');
+                return -1;
+            }
+            flags->timeout_ms = number;
+            break;
+        case 'm':
+            if (!value || !parse_number(value + 1, &number))
+            {
+                inform_of_misuse('m');
+                return -1;
+            }
+            flags->max_entries = number;
+            break;
+        case 'c':
+            if (!value || !*(value + 1))
+            {
+                inform_of_misuse('c');
+                return -1;
+            }
+            flags->cpu_list = value + 1;
+            break;
+        case 'T':
+            if (!value || !*(value + 1))
+            {
+                inform_of_misuse('T');
+                return -1;
+            }
+            flags->trace_path = value + 1;
+            break;
+        case 'p':
+            flags->pipeline = 1;
+            break;
+        case 'u':
+            flags->io_uring = 1;
+            break;
+        case 'i':
+            flags->index = 1;
+            break;
+        case 'w':
+            flags->watch = 1;
+            break;
+        case 'l':
+            flags->lock_profile = 1;
+            break;
+        default:
+            display_help();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void display_usage();
+void display_flags();
+
+void display_help()
+{
+    printf("Scans the given directories, the current one if none are given\n\n");
+    display_usage();
+    display_flags();
+}
+
+void display_usage()
+{
+    printf("Usage:\n\tSCAn {flags} ...(dirname)\n\n");
+}
+
+void display_flags()
+{
+    printf("Flags:\n");
+    printf("\t-h, --help: Displays the help message for this command.\n");
+    printf("\t-t, --timeout=<ms>: Stops a scan after the given time and reports what was found so far.\n");
+    printf("\t-m, --max-entries=<n>: Stops a scan after visiting the given number of entries.\n");
+    printf("\t-c, --cpus=<list>: Keeps the workers on the NUMA nodes of the given CPUs, like 0-7,16-23.\n");
+    printf("\t-T, --trace=<file>: Writes a Chrome trace of every directory read, open it in chrome://tracing or Perfetto.\n");
+    printf("\t-p, --pipeline: Reads directories, stats files and sums them up in separate overlapping stages.\n");
+    printf("\t-u, --io-uring: Stats hundreds of entries at once through io_uring from a few threads, falls back to stat where it is not available.\n");
+    printf("\t-i, --index: Keeps an index of every directory in .scan of the scanned one and only reads the directories changed since the last scan.\n");
+    printf("\t-w, --watch: Scans one directory, then follows its changes through inotify and reports them every few seconds until interrupted.\n");
+    printf("\t-l, --lock-profile: Prints how often the shared locks were contended and how long they were waited for and held on exit.\n");
+    printf("\n");
+}
+
+void inform_of_misuse(char flag)
+{
+    switch (flag)
+    {
+    case 't':
+        printf("Expected -t=<milliseconds> or --timeout=<milliseconds>!\n");
+        break;
+    case 'm':
+        printf("Expected -m=<count> or --max-entries=<count>!\n");
+        break;
+    case 'c':
+        printf("Expected -c=<cpus> or --cpus=<cpus>, like 0-7,16-23!\n");
+        break;
+    case 'T':
+        printf("Expected -T=<file> or --trace=<file>!\n");
+        break;
+    }
+}
+
+bool parse_number(const char *value, unsigned long *number)
+{
+    char *end;
+    if (*value < '0' || *value > '9')
+        return false;
+    *number = strtoul(value, &end, 10);
+    return *end == '\0';
+}
+
+// Whole names only, so --timeoutfoo=5 isn't taken for --timeout
+bool is_long_flag(const char *arg, size_t name_len, const char *name)
+{
+    return name_len == strlen(name) && !strncmp(arg, name, name_len);
+}
@@ -0,0 +1,29 @@
+#ifndef FLAGS_H
+#define FLAGS_H
+
+typedef struct scan_flags_t
+{
+    // Limits on the whole scan of each given directory, 0 for none
+    unsigned int timeout_ms;
+    unsigned long max_entries;
+    // Workers stay on the NUMA nodes of these CPUs, NULL to run anywhere
+    const char *cpu_list;
+    // Chrome trace of every directory read goes here, NULL for none
+    const char *trace_path;
+    // Scan in overlapping stages, see scan_pipeline
+    unsigned short pipeline;
+    // Stats entries in batches through io_uring, see stat_ring_t
+    unsigned short io_uring;
+    // Reuses listings of unchanged directories from the index in .scan
+    unsigned short index;
+    // Keeps the file list of the scanned directory current until stopped
+    unsigned short watch;
+    // Prints how contended the shared locks were on exit
+    unsigned short lock_profile;
+    // Index of the first directory in argv
+    int first_path;
+} scan_flags_t;
+
+int parse_flags(int argc, char **argv, scan_flags_t *flags);
+
+#endif
@@ -0,0 +1,275 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "lock_profile.h"
+
+struct lock_site_t
+{
+    const char *name;
+    lock_site_t *next;
+
+    atomic_ulong acquisitions;
+    atomic_ulong contended;
+    atomic_ulong wait_ns;
+    atomic_ulong max_wait_ns;
+    atomic_ulong hold_ns;
+    atomic_ulong max_hold_ns;
+};
+
+// Sites live until exit, the report runs after the locks are gone
+static atomic_int profiling = 0;
+static pthread_mutex_t m_sites = PTHREAD_MUTEX_INITIALIZER;
+static lock_site_t *sites = NULL;
+static unsigned int site_count = 0;
+
+void enable_lock_profiling();
+int lock_profiling_enabled();
+int profiled_mutex_init(profiled_mutex_t *mutex, const char *name);
+int profiled_mutex_destroy(profiled_mutex_t *mutex);
+int profiled_mutex_lock(profiled_mutex_t *mutex);
+int profiled_mutex_unlock(profiled_mutex_t *mutex);
+int profiled_cond_wait(pthread_cond_t *cond, profiled_mutex_t *mutex);
+int profiled_cond_timedwait(pthread_cond_t *cond, profiled_mutex_t *mutex, const struct timespec *deadline);
+unsigned int lock_profile_sites(lock_site_stats_t *stats, unsigned int n);
+void lock_profile_report(FILE *out);
+
+long _lock_clock_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void _raise_max(atomic_ulong *max, unsigned long value)
+{
+    unsigned long current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current &&
+           !atomic_compare_exchange_weak_explicit(max, &current, value, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+lock_site_t *_find_lock_site(profiled_mutex_t *mutex)
+{
+    lock_site_t *site = atomic_load_explicit(&mutex->site, memory_order_acquire);
+    if (site)
+    {
+        return site;
+    }
+
+    const char *name = mutex->name ? mutex->name : "unnamed";
+    pthread_mutex_lock(&m_sites);
+    for (site = sites; site; site = site->next)
+    {
+        if (!strcmp(site->name, name))
+            break;
+    }
+    if (!site)
+    {
+        site = calloc(1, sizeof(lock_site_t));
+        if (site)
+        {
+            site->name = name;
+            site->next = sites;
+            sites = site;
+            site_count++;
+        }
+    }
+    pthread_mutex_unlock(&m_sites);
+
+    if (site)
+    {
+        atomic_store_explicit(&mutex->site, site, memory_order_release);
+    }
+    return site;
+}
+
+// Ends the hold the calling thread has on mutex
+void _end_lock_hold(profiled_mutex_t *mutex)
+{
+    if (!mutex->locked_ns)
+    {
+        return;
+    }
+    lock_site_t *site = atomic_load_explicit(&mutex->site, memory_order_relaxed);
+    if (site)
+    {
+        unsigned long hold = _lock_clock_ns() - mutex->locked_ns;
+        atomic_fetch_add_explicit(&site->hold_ns, hold, memory_order_relaxed);
+        _raise_max(&site->max_hold_ns, hold);
+    }
+    mutex->locked_ns = 0;
+}
+
+void _report_lock_profile_at_exit()
+{
+    lock_profile_report(stderr);
+}
+
+void enable_lock_profiling()
+{
+    if (atomic_exchange(&profiling, 1) == 0)
+    {
+        atexit(_report_lock_profile_at_exit);
+    }
+}
+
+int lock_profiling_enabled()
+{
+    return atomic_load_explicit(&profiling, memory_order_relaxed);
+}
+
+int profiled_mutex_init(profiled_mutex_t *mutex, const char *name)
+{
+    if (!mutex)
+    {
+        return ILLEGAL_ARGS;
+    }
+    mutex->name = name;
+    atomic_init(&mutex->site, NULL);
+    mutex->locked_ns = 0;
+    return pthread_mutex_init(&mutex->mutex, NULL) ? FATAL_ERROR : 0;
+}
+
+int profiled_mutex_destroy(profiled_mutex_t *mutex)
+{
+    if (!mutex)
+    {
+        return ILLEGAL_ARGS;
+    }
+    return pthread_mutex_destroy(&mutex->mutex) ? FATAL_ERROR : 0;
+}
+
+int profiled_mutex_lock(profiled_mutex_t *mutex)
+{
+    if (!atomic_load_explicit(&profiling, memory_order_relaxed))
+    {
+        return pthread_mutex_lock(&mutex->mutex);
+    }
+
+    lock_site_t *site = _find_lock_site(mutex);
+    long wait_ns = 0;
+    int err = pthread_mutex_trylock(&mutex->mutex);
+    if (err == EBUSY)
+    {
+        long begin = _lock_clock_ns();
+        err = pthread_mutex_lock(&mutex->mutex);
+        wait_ns = _lock_clock_ns() - begin;
+    }
+    if (err)
+    {
+        return err;
+    }
+
+    if (site)
+    {
+        atomic_fetch_add_explicit(&site->acquisitions, 1, memory_order_relaxed);
+        if (wait_ns)
+        {
+            atomic_fetch_add_explicit(&site->contended, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&site->wait_ns, wait_ns, memory_order_relaxed);
+            _raise_max(&site->max_wait_ns, wait_ns);
+        }
+        mutex->locked_ns = _lock_clock_ns();
+    }
+    return 0;
+}
+
+int profiled_mutex_unlock(profiled_mutex_t *mutex)
+{
+    _end_lock_hold(mutex);
+    return pthread_mutex_unlock(&mutex->mutex);
+}
+
+int profiled_cond_wait(pthread_cond_t *cond, profiled_mutex_t *mutex)
+{
+    _end_lock_hold(mutex);
+    int err = pthread_cond_wait(cond, &mutex->mutex);
+    if (atomic_load_explicit(&profiling, memory_order_relaxed) && atomic_load_explicit(&mutex->site, memory_order_relaxed))
+    {
+        mutex->locked_ns = _lock_clock_ns();
+    }
+    return err;
+}
+
+int profiled_cond_timedwait(pthread_cond_t *cond, profiled_mutex_t *mutex, const struct timespec *deadline)
+{
+    _end_lock_hold(mutex);
+    int err = pthread_cond_timedwait(cond, &mutex->mutex, deadline);
+    if (atomic_load_explicit(&profiling, memory_order_relaxed) && atomic_load_explicit(&mutex->site, memory_order_relaxed))
+    {
+        mutex->locked_ns = _lock_clock_ns();
+    }
+    return err;
+}
+
+int _compare_lock_sites(const void *a, const void *b)
+{
+    const lock_site_stats_t *left = a;
+    const lock_site_stats_t *right = b;
+    if (left->wait_ns != right->wait_ns)
+        return left->wait_ns < right->wait_ns ? 1 : -1;
+    return left->acquisitions < right->acquisitions ? 1 : left->acquisitions > right->acquisitions ? -1 : 0;
+}
+
+unsigned int lock_profile_sites(lock_site_stats_t *stats, unsigned int n)
+{
+    pthread_mutex_lock(&m_sites);
+    unsigned int count = site_count;
+    lock_site_stats_t *all = count ? malloc(count * sizeof(lock_site_stats_t)) : NULL;
+    unsigned int i = 0;
+    for (lock_site_t *site = sites; site && all; site = site->next, i++)
+    {
+        all[i].name = site->name;
+        all[i].acquisitions = atomic_load(&site->acquisitions);
+        all[i].contended = atomic_load(&site->contended);
+        all[i].wait_ns = atomic_load(&site->wait_ns);
+        all[i].max_wait_ns = atomic_load(&site->max_wait_ns);
+        all[i].hold_ns = atomic_load(&site->hold_ns);
+        all[i].max_hold_ns = atomic_load(&site->max_hold_ns);
+    }
+    pthread_mutex_unlock(&m_sites);
+
+    if (!all)
+    {
+        return 0;
+    }
+    qsort(all, count, sizeof(lock_site_stats_t), _compare_lock_sites);
+    if (stats)
+    {
+        memcpy(stats, all, (n < count ? n : count) * sizeof(lock_site_stats_t));
+    }
+    free(all);
+    return count;
+}
+
+void lock_profile_report(FILE *out)
+{
+    unsigned int count = lock_profile_sites(NULL, 0);
+    lock_site_stats_t *stats = count ? malloc(count * sizeof(lock_site_stats_t)) : NULL;
+    if (!stats)
+    {
+        return;
+    }
+    // Sites added in between are left out
+    unsigned int copied = lock_profile_sites(stats, count);
+    if (copied < count)
+        count = copied;
+
+    fprintf(out, "Lock contention, most waited on first:\n");
+    fprintf(out, "%-16s %12s %10s %9s %12s %12s %12s %12s\n",
+            "lock", "acquired", "contended", "percent", "wait ms", "max wait us", "mean hold us", "max hold us");
+    for (unsigned int i = 0; i < count; i++)
+    {
+        lock_site_stats_t *site = &stats[i];
+        fprintf(out, "%-16s %12lu %10lu %8.2f%% %12.3f %12.1f %12.3f %12.1f\n",
+                site->name, site->acquisitions, site->contended,
+                site->acquisitions ? 100.0 * site->contended / site->acquisitions : 0.0,
+                site->wait_ns / 1e6, site->max_wait_ns / 1e3,
+                site->acquisitions ? site->hold_ns / 1e3 / site->acquisitions : 0.0,
+                site->max_hold_ns / 1e3);
+    }
+    free(stats);
+}
@@ -0,0 +1,59 @@
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "constants.h"
+
+typedef struct lock_site_t lock_site_t;
+
+/*
+ * Mutex that records how it is used while lock profiling is on. Mutexes of
+ * the same name count towards one lock site, like the queues of several
+ * pools. Without profiling a lock or unlock costs one extra load.
+ */
+typedef struct profiled_mutex_t
+{
+    pthread_mutex_t mutex;
+    const char *name;
+    // Looked up on the first lock with profiling on
+    lock_site_t *_Atomic site;
+    // When the holder took the lock, 0 while it is not measured
+    long locked_ns;
+} profiled_mutex_t;
+
+#define PROFILED_MUTEX_INITIALIZER(lock_name) { PTHREAD_MUTEX_INITIALIZER, lock_name, NULL, 0 }
+
+typedef struct lock_site_stats_t
+{
+    const char *name;
+    unsigned long acquisitions;
+    // Acquisitions that found the lock taken and had to wait
+    unsigned long contended;
+    unsigned long wait_ns;
+    unsigned long max_wait_ns;
+    unsigned long hold_ns;
+    unsigned long max_hold_ns;
+} lock_site_stats_t;
+
+// Starts recording every profiled mutex and prints lock_profile_report to
+// stderr at exit. Locks already held are measured from their next lock on.
+void enable_lock_profiling();
+int lock_profiling_enabled();
+
+int profiled_mutex_init(profiled_mutex_t *mutex, const char *name);
+int profiled_mutex_destroy(profiled_mutex_t *mutex);
+int profiled_mutex_lock(profiled_mutex_t *mutex);
+int profiled_mutex_unlock(profiled_mutex_t *mutex);
+// Time spent waiting on the condition does not count as holding the lock
+int profiled_cond_wait(pthread_cond_t *cond, profiled_mutex_t *mutex);
+int profiled_cond_timedwait(pthread_cond_t *cond, profiled_mutex_t *mutex, const struct timespec *deadline);
+
+// Copies up to n sites, most waited on first. Returns how many there are.
+unsigned int lock_profile_sites(lock_site_stats_t *sites, unsigned int n);
+// Table of every lock site, most waited on first
+void lock_profile_report(FILE *out);
+
+#endif
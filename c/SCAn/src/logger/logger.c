@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +8,7 @@
 
 #include "logger.h"
 #include "constants.h"
+#include "lock_profile.h"
 
 #define __LOG_BUFFER_SIZE__ 350
 
@@ -52,7 +54,7 @@ typedef struct out_stream_info_t
 
 typedef struct logging_queue_t
 {
-    pthread_mutex_t *m_lock;
+    profiled_mutex_t *m_lock;
     pthread_cond_t *c_updated;
 
     logging_queue_entry_t *head;
@@ -97,6 +99,7 @@ int put_without_escape(const char *buff, FILE *out_stream);
 int flush_out_streams(logging_queue_t *queue, int force);
 int close_out_streams(logging_queue_t *queue);
 int stat_it_up(logger_t *logger);
+int next_flush_deadline(logging_queue_t *queue, struct timespec *deadline);
 out_stream_info_t *create_out_stream_info(log_level_enum_t log_level, FILE *out_stream, int min_interval);
 
 int destroy_out_stream_info(out_stream_info_t *info)
@@ -128,7 +131,7 @@ int destroy_logging_queue(logging_queue_t *queue)
     }
     if (queue->m_lock)
     {
-        pthread_mutex_destroy(queue->m_lock);
+        profiled_mutex_destroy(queue->m_lock);
         free(queue->m_lock);
     }
     for (int i = 0; i < queue->out_stream_count; i++)
@@ -150,10 +153,10 @@ int destroy_logger(logger_t *logger)
         return ILLEGAL_ARGS;
     if (logger->thread)
     {
-        pthread_mutex_lock(logger->queue->m_lock);
+        profiled_mutex_lock(logger->queue->m_lock);
         logger->queue->is_stopped = 1;
         pthread_cond_signal(logger->queue->c_updated);
-        pthread_mutex_unlock(logger->queue->m_lock);
+        profiled_mutex_unlock(logger->queue->m_lock);
         pthread_join(*logger->thread, NULL);
     }
     destroy_logging_queue(logger->queue);
@@ -166,11 +169,47 @@ struct timespec *rel_time(struct timespec *ts, const long milliseconds)
     clock_gettime(CLOCK_REALTIME, ts);
 
     ts->tv_sec += milliseconds / 1000;
-    ts->tv_nsec += milliseconds * 1000 * 1000;
+    ts->tv_nsec += (milliseconds % 1000) * 1000 * 1000;
+    if (ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
 
     return ts;
 }
 
+// Earliest time a stream with unflushed output may be flushed, 0 if there
+// is nothing to flush
+int next_flush_deadline(logging_queue_t *queue, struct timespec *deadline)
+{
+    int found = 0;
+    for (int i = 0; i < queue->out_stream_count; i++)
+    {
+        out_stream_info_t *info = queue->out_stream_infos[i];
+        if (!info->out_stream || !info->changes)
+            continue;
+
+        struct timespec due = {0, 0};
+        if (info->flushes)
+        {
+            due.tv_sec = info->last_flush->tv_sec + info->min_interval->tv_sec;
+            due.tv_nsec = info->last_flush->tv_nsec + info->min_interval->tv_nsec;
+            if (due.tv_nsec >= 1000000000L)
+            {
+                due.tv_sec++;
+                due.tv_nsec -= 1000000000L;
+            }
+        }
+        if (!found || due.tv_sec < deadline->tv_sec || (due.tv_sec == deadline->tv_sec && due.tv_nsec < deadline->tv_nsec))
+        {
+            *deadline = due;
+            found = 1;
+        }
+    }
+    return found;
+}
+
 void *log_messages(void *arg)
 {
     logger_t *logger = (logger_t *)arg;
@@ -179,15 +218,21 @@ void *log_messages(void *arg)
     struct timespec *ts = malloc(sizeof(struct timespec));
     while (!should_exit)
     {
-        pthread_mutex_lock(logging_queue->m_lock);
+        profiled_mutex_lock(logging_queue->m_lock);
 
-        do
+        // Sleeps until there is something to write, or until a stream with
+        // unflushed output may be flushed, rather than waking up to poll
+        int flush_due = 0;
+        while (!logging_queue->is_stopped && logging_queue->count == 0 && !flush_due)
         {
-            pthread_cond_timedwait(logging_queue->c_updated, logging_queue->m_lock, rel_time(ts, 100));
-            should_exit = logging_queue->is_stopped;
-        } while (!should_exit && logging_queue->count == 0);
+            if (next_flush_deadline(logging_queue, ts))
+                flush_due = profiled_cond_timedwait(logging_queue->c_updated, logging_queue->m_lock, ts) == ETIMEDOUT;
+            else
+                profiled_cond_wait(logging_queue->c_updated, logging_queue->m_lock);
+        }
+        should_exit = logging_queue->is_stopped;
 
-        pthread_mutex_unlock(logging_queue->m_lock);
+        profiled_mutex_unlock(logging_queue->m_lock);
 
         int result;
         do
@@ -286,11 +331,11 @@ logging_queue_t *create_logging_queue()
     {
         return NULL;
     }
-    queue->m_lock = malloc(sizeof(pthread_mutex_t));
+    queue->m_lock = malloc(sizeof(profiled_mutex_t));
     queue->c_updated = malloc(sizeof(pthread_cond_t));
 
     if (
-        pthread_mutex_init(queue->m_lock, NULL) ||
+        profiled_mutex_init(queue->m_lock, "logging_queue") ||
         pthread_cond_init(queue->c_updated, NULL))
     {
         if (queue->m_lock)
@@ -303,6 +348,7 @@ logging_queue_t *create_logging_queue()
     queue->head = NULL;
     queue->tail = NULL;
     queue->count = 0;
+    queue->is_stopped = 0;
 
     return queue;
 }
@@ -508,7 +554,7 @@ int enqueue_log_locked(const log_level_enum_t level, const char *message, va_lis
     {
         return 0;
     }
-    pthread_mutex_lock(logger->queue->m_lock);
+    profiled_mutex_lock(logger->queue->m_lock);
     int result = v_enqueue_log(level, message, args);
     if (result < 0)
         result = enqueue_log(LOG_LEVEL_ERROR, "Failed to enqueue log entry with error: %d\n", result);
@@ -519,7 +565,7 @@ int enqueue_log_locked(const log_level_enum_t level, const char *message, va_lis
     }
     if (result > 0)
         pthread_cond_broadcast(logger->queue->c_updated);
-    pthread_mutex_unlock(logger->queue->m_lock);
+    profiled_mutex_unlock(logger->queue->m_lock);
     return result;
 }
 
@@ -565,10 +611,10 @@ int dequeue_log_and_put(logging_queue_t *queue)
     {
         return ILLEGAL_ARGS;
     }
-    pthread_mutex_lock(queue->m_lock);
+    profiled_mutex_lock(queue->m_lock);
     if (queue->count == 0)
     {
-        pthread_mutex_unlock(queue->m_lock);
+        profiled_mutex_unlock(queue->m_lock);
         return QUEUE_EMPTY;
     }
 
@@ -580,7 +626,7 @@ int dequeue_log_and_put(logging_queue_t *queue)
     }
     queue->count--;
 
-    pthread_mutex_unlock(queue->m_lock);
+    profiled_mutex_unlock(queue->m_lock);
     for (int i = 0; i < queue->out_stream_count; i++)
     {
         out_stream_info_t *info = queue->out_stream_infos[i];
@@ -609,7 +655,11 @@ int flush_out_streams(logging_queue_t *queue, int force)
         time_t td_nsec = td_sec * 1000000000 + ts->tv_nsec - info->last_flush->tv_nsec;
 
 
-        if (!force && info->flushes && td_nsec < info->min_interval->tv_sec) continue;
+        if (!force && info->flushes && td_nsec < info->min_interval->tv_sec)
+        {
+            free(ts);
+            continue;
+        }
 
         if (force ||
             td_sec > info->min_interval->tv_sec || 
@@ -4,30 +4,124 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <limits.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <signal.h>
 
 #include "thread_pool.h"
+#include "parallel.h"
+#include "pipeline.h"
 #include "logger.h"
+#include "constants.h"
+#include "flags.h"
+#include "lock_profile.h"
+#include "walk.h"
+#include "stat_ring.h"
+#include "scan_index.h"
+#include "watch.h"
 
-pthread_mutex_t m_files = PTHREAD_MUTEX_INITIALIZER;
+profiled_mutex_t m_files = PROFILED_MUTEX_INITIALIZER("files");
 
 thread_pool_t *thread_pool;
-int *counters;
+// Totals of the root directory, set once its whole subtree is done
+unsigned long scanned_directories;
+unsigned long scanned_files;
 
-const int DEFAULT_THREAD_COUNT = 5;
+// Limits from the command line, a scan that hits one is cancelled and
+// reports what it found until then
+scan_flags_t flags;
+atomic_ulong scanned_entries;
+
+// Long scans log how far they got every PROGRESS_INTERVAL_MS
+#define PROGRESS_INTERVAL_MS 1000
+atomic_ulong directories_read;
+task_queue_entry_arg_t progress_arg;
+
+// The pool starts with one worker per CPU and adds more while directories
+// queue up behind workers blocked in syscalls
+const int MIN_THREAD_COUNT = 1;
+const int THREADS_PER_CPU = 8;
+const int IDLE_TIMEOUT_MS = 200;
+// With --io-uring the kernel does the waiting, more threads than CPUs
+// would only take turns submitting
+const int URING_THREADS_PER_CPU = 1;
+long cpu_count;
+
+// Pipeline mode, workers per CPU of each stage. Reading directories and
+// stat block on the filesystem, the analysis only needs the CPU.
+const int SCAN_WORKERS_PER_CPU = 4;
+const int STAT_WORKERS_PER_CPU = 4;
+const int ANALYZE_WORKERS_PER_CPU = 1;
+// Batches queued per stage, a full stage makes the ones feeding it wait
+#define PIPELINE_QUEUE_BATCHES 256
+
+typedef enum {
+        STAGE_SCAN,
+        STAGE_STAT,
+        STAGE_ANALYZE,
+        STAGE_COUNT,
+} scan_stage_t;
+
+// A directory or file on its way through the pipeline, the stat stage
+// fills in size and mtime
+typedef struct pipeline_item_t
+{
+        unsigned long long size;
+        time_t mtime;
+        int name_len;
+        char name[];
+} pipeline_item_t;
+
+// With --index, listings of the last scan of the current root. Paths in it
+// are relative to the root.
+scan_index_t *scan_index;
+int scan_root_len;
+
+cancel_token_t *pipeline_token;
+atomic_ulong pipeline_directories;
+atomic_ulong pipeline_files;
+pthread_mutex_t m_summary = PTHREAD_MUTEX_INITIALIZER;
+
+// Subdirectories handed to the pool at once
+#define SUBDIR_BATCH 128
+// Directories queued or being read at most. Past that a worker reads the
+// subdirectories it finds itself, so the frontier can't outgrow memory.
+#define MAX_PENDING_DIRECTORIES 16384
 
 typedef struct directory_name_t
 {
         char *name;
         int name_len;
+        // Subtree totals, children add theirs before they finish
+        atomic_ulong directories;
+        atomic_ulong files;
+        // Kept open while subdirectories still have to open themselves
+        // relative to it, the last user closes it. -1 if they go by path.
+        int dir_fd;
+        atomic_int dir_users;
 } directory_name_t;
 
+// Directories kept open for their subdirectories at most. Past that they
+// are opened by path, so a wide frontier can't run out of descriptors.
+#define MAX_SHARED_DIRECTORY_FDS 256
+atomic_int shared_directory_fds;
+
 typedef struct file_entry_t file_entry_t;
 typedef struct file_entry_t
 {
         char *name;
         int name_len;
+        // Taken while traversing, relative to the open directory
+        unsigned long long size;
+        time_t mtime;
         file_entry_t *next;
+        file_entry_t *prev;
+        // Chain of the path table in watch mode
+        file_entry_t *bucket_next;
 } file_entry_t;
 
 typedef struct file_list_t {
@@ -44,115 +138,644 @@ typedef struct file_ending_entry_t {
 
 file_list_t *files;
 
+// Watch mode looks files up by path to apply changes, see watch_files
+typedef struct file_table_t {
+        file_entry_t **buckets;
+        size_t bucket_count;
+        size_t count;
+        unsigned long long bytes;
+} file_table_t;
+
+// Set while watching, every directory read gets a watch
+watcher_t *watcher;
+atomic_int out_of_watches;
+file_table_t *file_table;
+// Events applied since the last summary
+atomic_ulong watch_created;
+atomic_ulong watch_deleted;
+atomic_ulong watch_changed;
+volatile sig_atomic_t stop_watching;
+// Directories deleted or moved out in one drain of events. Their files and
+// watches go in a single pass over each, see flush_deleted_directories.
+// Open addressing on the path hash, doubled whenever it gets half full.
+#define DELETED_MIN_SLOTS 64
+typedef struct deleted_directories_t {
+        char **paths;
+        size_t slot_count;
+        size_t count;
+} deleted_directories_t;
+deleted_directories_t deleted_directories;
+// Summaries of the watched directory every WATCH_SUMMARY_INTERVAL_MS
+#define WATCH_SUMMARY_INTERVAL_MS 10000
+#define WATCH_POLL_MS 500
+task_queue_entry_arg_t watch_summary_arg;
+
+// Per worker scratch of traverse_directories, reused for every directory
+typedef struct scan_scratch_t {
+        char path[PATH_MAX];
+        dir_reader_t reader;
+        // Set while a directory is read with it. One read inline inside
+        // another on the same worker gets a scratch of its own.
+        unsigned short busy;
+        unsigned short owned;
+        // Only with --io-uring, entries waiting to be stat'ed as one batch.
+        // Their names are copied out of the reader's buffer, which the next
+        // read overwrites.
+        stat_ring_t *ring;
+        stat_request_t *stats;
+        char *stat_names;
+        unsigned int stat_count;
+        unsigned int stat_names_used;
+        // Only with --index, listing of the directory being read
+        index_builder_t record;
+} scan_scratch_t;
+
+// Entries stat'ed at once, and room for that many of the longest names
+#define STAT_BATCH STAT_RING_DEPTH
+#define STAT_NAMES_SIZE (STAT_BATCH * (NAME_MAX + 1))
+
+// What one traverse_directories call found so far, shared with the
+// helpers that add entries to it
+typedef struct directory_walk_t {
+        task_queue_entry_arg_t *task_arg;
+        directory_name_t *dir_name;
+        scan_scratch_t *scratch;
+        unsigned long dirs;
+        unsigned long files;
+        int (*batch_funcs[SUBDIR_BATCH])(task_queue_entry_arg_t *);
+        task_queue_entry_arg_t *batch_args[SUBDIR_BATCH];
+        unsigned int batched;
+        // Entries go into the scratch's index record as well
+        int recording;
+} directory_walk_t;
+
+// File endings are counted in a table per summary, doubled whenever it gets
+// half full
+#define ENDING_MIN_SLOTS 64
+#define ENDING_MAX_LEN 16
+#define TOP_ENDINGS 5
+
+typedef struct ending_count_t {
+        char ending[ENDING_MAX_LEN];
+        unsigned long files;
+        unsigned long long bytes;
+} ending_count_t;
+
+typedef struct file_summary_t {
+        unsigned long files;
+        unsigned long long bytes;
+        // Sum of per file hashes over path, size and mtime, equal for equal
+        // trees no matter in which order they were visited
+        unsigned long long fingerprint;
+        ending_count_t *endings;
+        unsigned int ending_slots;
+        unsigned int ending_count;
+        // Endings too long to track, and ones dropped without memory to grow
+        unsigned long other_files;
+} file_summary_t;
+
+int traverse_directories(task_queue_entry_arg_t *task_arg);
+void *create_scratch(unsigned int slot, void *user_data);
+scan_scratch_t *new_scan_scratch(int with_ring);
+void destroy_scratch(unsigned int slot, void *scratch, void *user_data);
+scan_scratch_t *acquire_scratch(void *context);
+void release_scratch(scan_scratch_t *scratch);
+int finish_directory(task_queue_entry_arg_t *task_arg);
+void drop_directory(task_queue_entry_arg_t *task_arg);
+void release_directory(directory_name_t *dir_name);
+int add_entry(directory_walk_t *walk, int path_length, const entry_stat_t *entry);
+int flush_stats(directory_walk_t *walk, int dir_fd);
+int replay_directory(directory_walk_t *walk, const index_record_t *record);
+void log_file_summary(file_summary_t *summary);
+void append_file(file_entry_t *file);
+file_entry_t **find_file(const char *name, int name_len);
+int scan_pipeline(char *path);
+int report_progress(task_queue_entry_arg_t *task_arg);
+
+int enqueue_directories(task_queue_entry_arg_t *parent, unsigned int n, int (**funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+        if (n == 0)
+                return 0;
+
+        // Deeper directories go first, finishing subtrees keeps the frontier small.
+        // Only the first levels get lanes of their own, from depth
+        // TASK_PRIORITY_HIGHEST on everything shares the top one. That is
+        // deliberate: workers pop their own deque newest first, so within the
+        // lane the deepest directory a worker pushed still runs next, and
+        // steals take the oldest, shallowest ones that split the most work.
+        unsigned int priority = parent->priority < TASK_PRIORITY_HIGHEST ? parent->priority + 1 : TASK_PRIORITY_HIGHEST;
+        int err = enqueue_child_tasks_with_priority(thread_pool, parent, priority, n, funcs, args);
+        if (err != 0)
+        {
+                for (unsigned int i = 0; i < n; i++)
+                {
+                        log_error("Failed to enqueue task for directory: %s\n", ((directory_name_t *)args[i]->arg)->name);
+                        release_directory(parent->arg);
+                        free_task_arg(thread_pool, args[i]);
+                }
+        }
+        return err;
+}
+
+// Runs after the whole subtree of a directory is done
+int finish_directory(task_queue_entry_arg_t *task_arg)
+{
+        directory_name_t *dir_name = (directory_name_t *)(task_arg->arg);
+        unsigned long directories = atomic_load(&dir_name->directories);
+        unsigned long files_amount = atomic_load(&dir_name->files);
+        log_debug("Finished %s: %lu directories and %lu files\n", dir_name->name, directories, files_amount);
+
+        if (task_arg->parent)
+        {
+                directory_name_t *parent = (directory_name_t *)(task_arg->parent->arg);
+                atomic_fetch_add(&parent->directories, directories);
+                atomic_fetch_add(&parent->files, files_amount);
+        }
+        else
+        {
+                scanned_directories = directories;
+                scanned_files = files_amount;
+        }
+        free_task_arg(thread_pool, task_arg);
+        return 0;
+}
+
+// The pipeline stats in a stage of its own, its scan workers need no ring
+void *create_scratch(unsigned int slot, void *user_data)
+{
+        (void)slot;
+        (void)user_data;
+        return new_scan_scratch(flags.io_uring && !flags.pipeline);
+}
+
+scan_scratch_t *new_scan_scratch(int with_ring)
+{
+        scan_scratch_t *scratch = calloc(1, sizeof(scan_scratch_t));
+        if (!scratch)
+        {
+                return NULL;
+        }
+        if (init_dir_reader(&scratch->reader, 0) != 0)
+        {
+                free(scratch);
+                return NULL;
+        }
+        if (with_ring)
+        {
+                // Without a ring entries are stat'ed one by one
+                scratch->ring = create_stat_ring(STAT_BATCH);
+                scratch->stats = malloc(STAT_BATCH * sizeof(stat_request_t));
+                scratch->stat_names = malloc(STAT_NAMES_SIZE);
+                if (!scratch->ring || !scratch->stats || !scratch->stat_names)
+                {
+                        destroy_stat_ring(scratch->ring);
+                        free(scratch->stats);
+                        free(scratch->stat_names);
+                        scratch->ring = NULL;
+                        scratch->stats = NULL;
+                        scratch->stat_names = NULL;
+                }
+        }
+        // Without a builder directories are read but not recorded
+        if (flags.index && init_index_builder(&scratch->record) != 0)
+        {
+                destroy_index_builder(&scratch->record);
+        }
+        return scratch;
+}
+
+void destroy_scratch(unsigned int slot, void *scratch, void *user_data)
+{
+        (void)slot;
+        (void)user_data;
+        scan_scratch_t *own = scratch;
+        if (own)
+        {
+                destroy_dir_reader(&own->reader);
+                destroy_stat_ring(own->ring);
+                free(own->stats);
+                free(own->stat_names);
+                destroy_index_builder(&own->record);
+                free(own);
+        }
+}
+
+// Scratch of the calling worker, or one of its own for a task run outside
+// of the pool or inside another read. NULL if out of memory.
+scan_scratch_t *acquire_scratch(void *context)
+{
+        scan_scratch_t *scratch = context;
+        if (!scratch || scratch->busy)
+        {
+                scratch = new_scan_scratch(0);
+                if (!scratch)
+                {
+                        return NULL;
+                }
+                scratch->owned = 1;
+        }
+        scratch->busy = 1;
+        return scratch;
+}
+
+void release_scratch(scan_scratch_t *scratch)
+{
+        finish_dir_reader(&scratch->reader);
+        scratch->busy = 0;
+        if (scratch->owned)
+        {
+                destroy_scratch(0, scratch, NULL);
+        }
+}
+
+// Directories still queued when a scan is cancelled end up here
+void drop_directory(task_queue_entry_arg_t *task_arg)
+{
+        if (task_arg->parent)
+        {
+                release_directory(task_arg->parent->arg);
+        }
+        free_task_arg(thread_pool, task_arg);
+}
+
+// Lets go of a directory kept open for its subdirectories
+void release_directory(directory_name_t *dir_name)
+{
+        if (dir_name->dir_fd >= 0 && atomic_fetch_sub(&dir_name->dir_users, 1) == 1)
+        {
+                close(dir_name->dir_fd);
+                atomic_fetch_sub(&shared_directory_fds, 1);
+        }
+}
+
+// Entries no scan looks into, in any mode
+int is_skipped_entry(const char *name)
+{
+        return (!strcmp(".scan", name) ||
+                !strcmp(".git", name) ||
+                !strcmp(".idea", name)
+                //!strcmp("node_modules", name)
+        );
+}
+
+// Hands a found subdirectory to the pool or files a found file, the full
+// path is in the scratch already
+int add_entry(directory_walk_t *walk, int path_length, const entry_stat_t *entry)
+{
+        directory_name_t *dir_name = walk->dir_name;
+        char *path = walk->scratch->path;
+        if (walk->recording && add_index_entry(&walk->scratch->record, path + dir_name->name_len + 1,
+                                               path_length - dir_name->name_len - 1, entry) != 0)
+        {
+                // Left out of the index, so it gets read next time
+                walk->recording = 0;
+        }
+        if (entry->kind == ENTRY_DIRECTORY)
+        {
+                walk->dirs++;
+                // Arg, descriptor and path share one pooled block
+                task_queue_entry_arg_t *next_arg = alloc_task_arg(thread_pool, sizeof(directory_name_t) + path_length + 1);
+                if (!next_arg)
+                {
+                        return MEMORY_ERROR;
+                }
+                directory_name_t *next = next_arg->arg;
+                next->name = (char *)(next + 1);
+                next->name_len = path_length;
+                atomic_init(&next->directories, 1);
+                atomic_init(&next->files, 0);
+                next->dir_fd = -1;
+                atomic_init(&next->dir_users, 0);
+                memcpy(next->name, path, path_length + 1);
+                if (dir_name->dir_fd >= 0)
+                {
+                        atomic_fetch_add(&dir_name->dir_users, 1);
+                }
+
+                log_debug("Enqueueing directory: %s\n", path);
+                walk->batch_funcs[walk->batched] = traverse_directories;
+                walk->batch_args[walk->batched++] = next_arg;
+                if (walk->batched == SUBDIR_BATCH)
+                {
+                        int err = enqueue_directories(walk->task_arg, walk->batched, walk->batch_funcs, walk->batch_args);
+                        walk->batched = 0;
+                        return err;
+                }
+        }
+        else if (entry->kind == ENTRY_FILE)
+        {
+                walk->files++;
+                // Entry and name in one block
+                file_entry_t *file = malloc(sizeof(file_entry_t) + path_length + 1);
+                if (!file)
+                {
+                        return MEMORY_ERROR;
+                }
+                file->name = (char *)(file + 1);
+                memcpy(file->name, path, path_length + 1);
+                file->name_len = path_length;
+                file->size = entry->size;
+                file->mtime = entry->mtime;
+
+                profiled_mutex_lock(&m_files);
+                append_file(file);
+                profiled_mutex_unlock(&m_files);
+        }
+        return 0;
+}
+
+// Stats the entries batched up in the scratch all at once and adds them
+int flush_stats(directory_walk_t *walk, int dir_fd)
+{
+        scan_scratch_t *scratch = walk->scratch;
+        unsigned int n = scratch->stat_count;
+        scratch->stat_count = 0;
+        scratch->stat_names_used = 0;
+        if (stat_entries_at(scratch->ring, dir_fd, scratch->stats, n) != 0)
+        {
+                // The ring broke down, stat has to do
+                for (unsigned int i = 0; i < n; i++)
+                {
+                        stat_request_t *request = &scratch->stats[i];
+                        request->result = stat_entry_at(dir_fd, request->name, request->fields, &request->stat);
+                }
+        }
+
+        directory_name_t *dir_name = walk->dir_name;
+        for (unsigned int i = 0; i < n; i++)
+        {
+                stat_request_t *request = &scratch->stats[i];
+                if (request->result != 0)
+                {
+                        continue;
+                }
+                int name_len = strlen(request->name);
+                memcpy(scratch->path, dir_name->name, dir_name->name_len);
+                scratch->path[dir_name->name_len] = '/';
+                memcpy(scratch->path + dir_name->name_len + 1, request->name, name_len + 1);
+                int err = add_entry(walk, dir_name->name_len + 1 + name_len, &request->stat);
+                if (err != 0)
+                {
+                        return err;
+                }
+        }
+        return 0;
+}
+
+// Adds the entries the index has for an unchanged directory, instead of
+// reading it again
+int replay_directory(directory_walk_t *walk, const index_record_t *record)
+{
+        directory_name_t *dir_name = walk->dir_name;
+        if (keep_index_record(scan_index, record) != 0)
+        {
+                return MEMORY_ERROR;
+        }
+        size_t offset = 0;
+        indexed_entry_t indexed;
+        while (next_indexed_entry(record, &offset, &indexed) == 0)
+        {
+                if (is_cancelled(walk->task_arg->token))
+                        break;
+                if (flags.max_entries && atomic_fetch_add_explicit(&scanned_entries, 1, memory_order_relaxed) >= flags.max_entries)
+                {
+                        cancel(walk->task_arg->token);
+                        break;
+                }
+
+                int path_length = dir_name->name_len + 1 + indexed.name_len;
+                if (path_length >= PATH_MAX)
+                {
+                        continue;
+                }
+                memcpy(walk->scratch->path, dir_name->name, dir_name->name_len);
+                walk->scratch->path[dir_name->name_len] = '/';
+                memcpy(walk->scratch->path + dir_name->name_len + 1, indexed.name, indexed.name_len + 1);
+
+                entry_stat_t entry;
+                entry.kind = indexed.kind;
+                entry.size = indexed.size;
+                entry.mtime = indexed.mtime;
+                int err = add_entry(walk, path_length, &entry);
+                if (err != 0)
+                {
+                        return err;
+                }
+        }
+        return 0;
+}
+
 int traverse_directories(task_queue_entry_arg_t *task_arg)
 {
         directory_name_t *dir_name = (directory_name_t *)(task_arg->arg);
-        DIR *pDir;
+        set_task_label(thread_pool, dir_name->name);
+        atomic_fetch_add_explicit(&directories_read, 1, memory_order_relaxed);
 
-        pDir = opendir(dir_name->name);
-        if (pDir == NULL)
+        // Relative to the parent if it is still open, which saves resolving
+        // the whole path again
+        directory_name_t *parent = task_arg->parent ? task_arg->parent->arg : NULL;
+        int dir_fd;
+        if (parent && parent->dir_fd >= 0)
+        {
+                dir_fd = open_directory_at(parent->dir_fd, dir_name->name + parent->name_len + 1);
+                release_directory(parent);
+        }
+        else
+        {
+                dir_fd = open_directory_at(AT_FDCWD, dir_name->name);
+        }
+        if (dir_fd < 0)
         {
+                free_task_arg(thread_pool, task_arg);
                 return 1;
         }
+        // Before reading, so nothing created in between goes unnoticed
+        if (watcher && watch_directory(watcher, dir_name->name) == QUEUE_FULL && !atomic_exchange(&out_of_watches, 1))
+        {
+                log_warning("Out of inotify watches, changes below %s and other directories are missed. Raise fs.inotify.max_user_watches.\n", dir_name->name);
+        }
+
+        // Workers bring their scratch with a reader and its buffer
+        scan_scratch_t *scratch = acquire_scratch(task_arg->context);
+        if (!scratch || start_dir_reader(&scratch->reader, dir_fd) != 0)
+        {
+                if (scratch)
+                        release_scratch(scratch);
+                close(dir_fd);
+                free_task_arg(thread_pool, task_arg);
+                return scratch ? 1 : MEMORY_ERROR;
+        }
+        if (atomic_fetch_add(&shared_directory_fds, 1) < MAX_SHARED_DIRECTORY_FDS)
+        {
+                dir_name->dir_fd = dir_fd;
+                atomic_init(&dir_name->dir_users, 1);
+        }
+        else
+        {
+                atomic_fetch_sub(&shared_directory_fds, 1);
+        }
 
-        counters[2 * task_arg->id]++;
+        // Totals are final once every subdirectory has reported back
+        set_continuation(thread_pool, task_arg, finish_directory);
 
         log_debug("Traverse: %s\n", dir_name->name);
 
-        unsigned short encounteredDirs = 0;
-        unsigned short encounteredFiles = 0;
-        struct dirent *pDirent;
-        while ((pDirent = readdir(pDir)) != NULL)
-        {
-                if (!strcmp(".", pDirent->d_name) ||
-                    !strcmp("..", pDirent->d_name) ||
-                    !strcmp(".scan", pDirent->d_name) ||
-                    !strcmp(".git", pDirent->d_name) ||
-                    !strcmp(".idea", pDirent->d_name)
-                    //!strcmp("node_modules", pDirent->d_name)
-                )
-                        continue;
+        directory_walk_t walk;
+        walk.task_arg = task_arg;
+        walk.dir_name = dir_name;
+        walk.scratch = scratch;
+        walk.dirs = 0;
+        walk.files = 0;
+        walk.batched = 0;
+        walk.recording = 0;
+        int err = 0;
+
+        // Unchanged since the last scan, so the index knows what is in it
+        const index_record_t *record = NULL;
+        if (scan_index)
+        {
+                const char *relative = dir_name->name + scan_root_len;
+                while (*relative == '/')
+                        relative++;
+                unsigned int relative_len = dir_name->name_len - (relative - dir_name->name);
+                directory_identity_t identity;
+                if (identify_directory(dir_fd, &identity) == 0)
+                {
+                        record = find_unchanged_directory(scan_index, relative, relative_len, &identity);
+                        if (record)
+                                err = replay_directory(&walk, record);
+                        else
+                                walk.recording = begin_index_record(scan_index, &scratch->record, relative, relative_len, &identity) == 0;
+                }
+        }
 
-                int sub_dir_name_length = dir_name->name_len + 2 + pDirent->d_namlen;
-                char *sub_dir_name = malloc(sub_dir_name_length);
+        const dir_entry_t *pDirent;
+        while (!record && (pDirent = read_dir_entry(&scratch->reader)) != NULL)
+        {
+                if (is_skipped_entry(pDirent->name))
+                        continue;
 
-                strcpy(sub_dir_name, dir_name->name);
-                strcat(sub_dir_name, "/");
-                strcat(sub_dir_name, pDirent->d_name);
+                if (is_cancelled(task_arg->token))
+                        break;
+                if (flags.max_entries && atomic_fetch_add_explicit(&scanned_entries, 1, memory_order_relaxed) >= flags.max_entries)
+                {
+                        cancel(task_arg->token);
+                        break;
+                }
 
-                struct stat *s = malloc(sizeof(struct stat));
-                if (stat(sub_dir_name, s) != 0)
+                int sub_dir_name_length = dir_name->name_len + 1 + pDirent->name_len;
+                if (sub_dir_name_length >= PATH_MAX)
                 {
-                        free(s);
-                        free(sub_dir_name);
+                        log_warning("Path too long, skipping: %s/%s\n", dir_name->name, pDirent->name);
                         continue;
                 }
 
-                if (s->st_mode & S_IFDIR)
+                // Directories need no stat at all when the directory knows the type,
+                // files only the fields the summary uses
+                entry_stat_t entry;
+                entry.kind = pDirent->kind;
+                unsigned int fields = entry.kind == ENTRY_UNKNOWN ? WALK_TYPE | WALK_SIZE | WALK_MTIME :
+                                      entry.kind == ENTRY_FILE ? WALK_SIZE | WALK_MTIME : 0;
+                if (fields && scratch->ring)
                 {
-                        encounteredDirs++;
-                        task_queue_entry_arg_t *next_arg = malloc(sizeof(task_queue_entry_arg_t));
-                        directory_name_t *next = malloc(sizeof(directory_name_t));
-                        next->name = sub_dir_name;
-                        next->name_len = sub_dir_name_length;
-                        next_arg->arg = next;
-
-                        log_debug("Enqueueing directory: %s\n", sub_dir_name);
-                        int err = enqueue_task(thread_pool, traverse_directories, next_arg);
-                        if (err != 0)
+                        // Stat'ed together with the rest of the batch
+                        stat_request_t *request = &scratch->stats[scratch->stat_count++];
+                        request->name = scratch->stat_names + scratch->stat_names_used;
+                        request->fields = fields;
+                        request->stat.kind = entry.kind;
+                        memcpy(scratch->stat_names + scratch->stat_names_used, pDirent->name, pDirent->name_len + 1);
+                        scratch->stat_names_used += pDirent->name_len + 1;
+                        if (scratch->stat_count == STAT_BATCH && (err = flush_stats(&walk, dir_fd)) != 0)
                         {
-                                free(next->name);
-                                free(next);
-                                free(s);
-                                free(sub_dir_name);
-                                log_error("Failed to enqueue task for directory: %s\n", sub_dir_name);
-                                return err;
+                                break;
                         }
+                        continue;
                 }
-                else if (s->st_mode & S_IFREG)
+                if (fields && stat_entry_at(dir_fd, pDirent->name, fields, &entry) != 0)
                 {
-                        encounteredFiles++;
-                        counters[2 * task_arg->id + 1]++;
-                        file_entry_t *file = malloc(sizeof(file_entry_t));
-                        file->name = sub_dir_name;
-                        file->name_len = sub_dir_name_length;
-                        file->next = NULL;
+                        continue;
+                }
 
-                        pthread_mutex_lock(&m_files);
-                        if (files->first == NULL)
-                        {
-                                files->first = file;
-                                files->last = file;
-                        }
-                        else
-                        {
-                                files->last->next = file;
-                                files->last = file;
-                        }
-                        pthread_mutex_unlock(&m_files);
+                char *sub_dir_name = scratch->path;
+                memcpy(sub_dir_name, dir_name->name, dir_name->name_len);
+                sub_dir_name[dir_name->name_len] = '/';
+                memcpy(sub_dir_name + dir_name->name_len + 1, pDirent->name, pDirent->name_len + 1);
+                if ((err = add_entry(&walk, sub_dir_name_length, &entry)) != 0)
+                {
+                        break;
+                }
+        }
+        // Counted already, so these are kept even after a cancel
+        if (scratch->stat_count)
+        {
+                if (err == 0)
+                {
+                        err = flush_stats(&walk, dir_fd);
+                }
+                scratch->stat_count = 0;
+                scratch->stat_names_used = 0;
+        }
+        // What was read so far is kept, but a listing cut short must not go
+        // into the index as if it were the whole directory
+        int failed = scratch->reader.error != 0;
+        if (failed)
+        {
+                log_warning("Could not read all of %s: %s\n", dir_name->name, strerror(scratch->reader.error));
+        }
+        if (walk.recording && err == 0 && !failed && commit_index_record(scan_index, &scratch->record) != 0)
+        {
+                log_warning("Out of memory, %s is left out of the index\n", dir_name->name);
+        }
+        // Subdirectories run inline from here on may have it
+        release_scratch(scratch);
+
+        // Whatever was batched would only be dropped after a cancel
+        if (err == 0 && !is_cancelled(task_arg->token))
+        {
+                err = enqueue_directories(task_arg, walk.batched, walk.batch_funcs, walk.batch_args);
+        }
+        else
+        {
+                for (unsigned int i = 0; i < walk.batched; i++)
+                {
+                        release_directory(dir_name);
+                        free_task_arg(thread_pool, walk.batch_args[i]);
                 }
-                free(s);
         }
-        closedir(pDir);
-        free(dir_name->name);
-        free(dir_name);
-        free(task_arg);
-        log_info("Added %4u dirs and %4u files\n", encounteredDirs, encounteredFiles);
+        if (dir_name->dir_fd >= 0)
+        {
+                release_directory(dir_name);
+        }
+        else
+        {
+                close(dir_fd);
+        }
+        atomic_fetch_add(&dir_name->files, walk.files);
+        if (err != 0 || failed)
+        {
+                return err ? err : 1;
+        }
+        log_info("Added %4lu dirs and %4lu files\n", walk.dirs, walk.files);
         return 0;
 }
 
-int traverse(int length, char *path)
+int traverse(int length, char *path, cancel_token_t *token)
 {
-        directory_name_t *dir_name = malloc(sizeof(directory_name_t));
-        dir_name->name = path;
+        task_queue_entry_arg_t *arg = alloc_task_arg(thread_pool, sizeof(directory_name_t) + length + 1);
+        if (!arg)
+        {
+                return 1;
+        }
+        directory_name_t *dir_name = arg->arg;
+        dir_name->name = (char *)(dir_name + 1);
         dir_name->name_len = length;
+        atomic_init(&dir_name->directories, 1);
+        atomic_init(&dir_name->files, 0);
+        dir_name->dir_fd = -1;
+        atomic_init(&dir_name->dir_users, 0);
+        memcpy(dir_name->name, path, length + 1);
 
-        task_queue_entry_arg_t *arg = malloc(sizeof(task_queue_entry_arg_t));
-        arg->arg = dir_name;
-
-        enqueue_task(thread_pool, traverse_directories, arg);
-
-        return 0;
+        return enqueue_cancellable_task(thread_pool, token, traverse_directories, arg);
 }
 
 int printd(char *str, const time_t *time)
@@ -165,72 +788,1138 @@ int printd(char *str, const time_t *time)
 }
 
 
-int main(int argc, char *argv[])
+unsigned long long hash_bytes(const char *bytes, int length)
 {
-        if (argc > 2)
+        // FNV-1a
+        unsigned long long hash = 14695981039346656037ULL;
+        for (int i = 0; i < length; i++)
         {
-                printf("Usage: SCAn [dirname]\n");
-                return 1;
+                hash ^= (unsigned char)bytes[i];
+                hash *= 1099511628211ULL;
         }
+        return hash;
+}
 
-        init_logger(LOG_LEVEL_INFO);
+unsigned long long mix_hash(unsigned long long hash)
+{
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        return hash;
+}
 
-        char *path;
-        if (argc == 2)
+// The slot holding ending, or the empty one it goes into. NULL if the table
+// is full.
+ending_count_t *find_ending(ending_count_t *endings, unsigned int slots, const char *ending, int length)
+{
+        unsigned int slot = hash_bytes(ending, length) & (slots - 1);
+        for (unsigned int i = 0; i < slots; i++, slot = (slot + 1) & (slots - 1))
         {
-                path = argv[1];
+                if (endings[slot].files == 0 || !strcmp(endings[slot].ending, ending))
+                {
+                        return &endings[slot];
+                }
         }
-        else
+        return NULL;
+}
+
+// Stays as it is without memory
+void grow_endings(file_summary_t *summary)
+{
+        unsigned int slots = summary->ending_slots ? summary->ending_slots * 2 : ENDING_MIN_SLOTS;
+        ending_count_t *endings = calloc(slots, sizeof(ending_count_t));
+        if (!endings)
         {
-                path = malloc(2);
-                *path = '.';
-                *(path + 1) = '\0';
+                return;
         }
+        for (unsigned int i = 0; i < summary->ending_slots; i++)
+        {
+                ending_count_t *count = &summary->endings[i];
+                if (count->files)
+                {
+                        *find_ending(endings, slots, count->ending, strlen(count->ending)) = *count;
+                }
+        }
+        free(summary->endings);
+        summary->endings = endings;
+        summary->ending_slots = slots;
+}
 
-        struct stat s;
-        stat(path, &s);
-        printd("Last top level status change:", &(s.st_ctime));
-        printd("Last top level data change:  ", &(s.st_mtime));
-
-        counters = malloc(2 * DEFAULT_THREAD_COUNT * sizeof(int));
-        for (int i = 0; i < DEFAULT_THREAD_COUNT; i++)
+void count_ending(file_summary_t *summary, const char *ending, unsigned long files, unsigned long long bytes)
+{
+        int length = strlen(ending);
+        if (summary->ending_count * 2 >= summary->ending_slots)
+        {
+                grow_endings(summary);
+        }
+        ending_count_t *count = find_ending(summary->endings, summary->ending_slots, ending, length);
+        if (!count)
+        {
+                summary->other_files += files;
+                return;
+        }
+        if (count->files == 0)
         {
-                counters[2 * i] = 0;
-                counters[2 * i + 1] = 0;
+                memcpy(count->ending, ending, length + 1);
+                summary->ending_count++;
         }
+        count->files += files;
+        count->bytes += bytes;
+}
 
-        files = malloc(sizeof(file_list_t));
-        files->first = NULL;
-        files->last = NULL;
+void init_file_summary(void *partial, void *context)
+{
+        (void)context;
+        memset(partial, 0, sizeof(file_summary_t));
+}
 
-        thread_pool_creation_status_t *status = malloc(sizeof(thread_pool_creation_status_t));
-        thread_pool = create_thread_pool(DEFAULT_THREAD_COUNT, status);
+void add_file(file_summary_t *summary, const char *name, int name_len, unsigned long long size, time_t mtime)
+{
+        summary->files++;
+        summary->bytes += size;
+        summary->fingerprint += mix_hash(hash_bytes(name, name_len) ^
+                                         mix_hash(size) ^
+                                         mix_hash((unsigned long long)mtime << 1));
 
-        if (status == NULL || *status != CREATED)
+        const char *ending = "";
+        for (int i = name_len - 1; i >= 0 && name[i] != '/'; i--)
         {
-                return 1;
+                if (name[i] == '.')
+                {
+                        ending = name + i + 1;
+                        break;
+                }
         }
-
-        clock_t begin = clock();
-
-        if (traverse(strlen(path), path))
+        if (strlen(ending) >= ENDING_MAX_LEN)
         {
-                return 2;
+                summary->other_files++;
+                return;
         }
+        count_ending(summary, ending, 1, size);
+}
 
-        join(thread_pool);
+void summarize_file(void *node, void *partial, void *context)
+{
+        (void)context;
+        file_entry_t *file = node;
+        add_file(partial, file->name, file->name_len, file->size, file->mtime);
+}
 
-        clock_t end = clock();
-        int directories = 0;
-        int files_amount = 0;
-        for (int i = 0; i < DEFAULT_THREAD_COUNT; i++)
+void merge_file_summary(void *result, const void *partial, void *context)
+{
+        (void)context;
+        file_summary_t *into = result;
+        const file_summary_t *from = partial;
+        into->files += from->files;
+        into->bytes += from->bytes;
+        into->fingerprint += from->fingerprint;
+        into->other_files += from->other_files;
+        for (unsigned int i = 0; i < from->ending_slots; i++)
         {
-                directories += *(counters + 2 * i);
-                files_amount += *(counters + 2 * i + 1);
+                if (from->endings[i].files)
+                {
+                        count_ending(into, from->endings[i].ending, from->endings[i].files, from->endings[i].bytes);
+                }
         }
+        // Every partial is merged once, its table isn't needed after
+        free(from->endings);
+}
 
-        double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
-        log_info("Traversed %d directories and found %d files in %fs\n", directories, files_amount, time_spent);
-        stop_logger();
-        return 0;
+// Sizes and endings of every file found, computed across the pool
+void summarize_files()
+{
+        file_summary_t *summary = malloc(sizeof(file_summary_t));
+        if (!summary)
+        {
+                return;
+        }
+        if (parallel_reduce_list(thread_pool, files->first, offsetof(file_entry_t, next), PARALLEL_AUTO_GRAIN,
+                                 summarize_file, sizeof(file_summary_t), init_file_summary, merge_file_summary,
+                                 summary, NULL) != 0)
+        {
+                log_error("Failed to summarize files\n");
+                free(summary);
+                return;
+        }
+        log_file_summary(summary);
+        free(summary);
+}
+
+// Consumes the ending counts and frees their table. Ties go to the ending
+// that sorts first so the report doesn't depend on the merge order.
+void log_file_summary(file_summary_t *summary)
+{
+        log_info("%lu files with %llu bytes, fingerprint %016llx\n", summary->files, summary->bytes, summary->fingerprint);
+        for (int top = 0; top < TOP_ENDINGS; top++)
+        {
+                ending_count_t *best = NULL;
+                for (unsigned int i = 0; i < summary->ending_slots; i++)
+                {
+                        ending_count_t *count = &summary->endings[i];
+                        if (count->files && (!best || count->files > best->files ||
+                                             (count->files == best->files && strcmp(count->ending, best->ending) < 0)))
+                        {
+                                best = count;
+                        }
+                }
+                if (!best)
+                {
+                        break;
+                }
+                char label[ENDING_MAX_LEN + 1] = "(none)";
+                if (best->ending[0])
+                {
+                        snprintf(label, sizeof(label), ".%s", best->ending);
+                }
+                log_info("  %-16s %8lu files %12llu bytes\n", label, best->files, best->bytes);
+                best->files = 0;
+        }
+        free(summary->endings);
+        summary->endings = NULL;
+        summary->ending_slots = 0;
+        summary->ending_count = 0;
+}
+
+void free_files(file_list_t *list)
+{
+        file_entry_t *file = list->first;
+        while (file)
+        {
+                file_entry_t *next = file->next;
+                free(file);
+                file = next;
+        }
+        list->first = NULL;
+        list->last = NULL;
+        if (file_table)
+        {
+                memset(file_table->buckets, 0, file_table->bucket_count * sizeof(file_entry_t *));
+                file_table->count = 0;
+                file_table->bytes = 0;
+        }
+}
+
+file_entry_t **find_file(const char *name, int name_len)
+{
+        file_entry_t **slot = &file_table->buckets[hash_bytes(name, name_len) & (file_table->bucket_count - 1)];
+        while (*slot && ((*slot)->name_len != name_len || memcmp((*slot)->name, name, name_len)))
+        {
+                slot = &(*slot)->bucket_next;
+        }
+        return slot;
+}
+
+// Doubles the buckets once there is a file for every one
+void grow_file_table()
+{
+        size_t bucket_count = file_table->bucket_count * 2;
+        file_entry_t **buckets = calloc(bucket_count, sizeof(file_entry_t *));
+        if (!buckets)
+        {
+                // Chains just get longer
+                return;
+        }
+        for (size_t i = 0; i < file_table->bucket_count; i++)
+        {
+                file_entry_t *file = file_table->buckets[i];
+                while (file)
+                {
+                        file_entry_t *next = file->bucket_next;
+                        size_t bucket = hash_bytes(file->name, file->name_len) & (bucket_count - 1);
+                        file->bucket_next = buckets[bucket];
+                        buckets[bucket] = file;
+                        file = next;
+                }
+        }
+        free(file_table->buckets);
+        file_table->buckets = buckets;
+        file_table->bucket_count = bucket_count;
+}
+
+// Adds a file to the list, m_files has to be held. While watching one
+// already listed under that name is updated instead.
+void append_file(file_entry_t *file)
+{
+        if (file_table)
+        {
+                file_entry_t **slot = find_file(file->name, file->name_len);
+                if (*slot)
+                {
+                        file_table->bytes += file->size - (*slot)->size;
+                        (*slot)->size = file->size;
+                        (*slot)->mtime = file->mtime;
+                        free(file);
+                        return;
+                }
+                file->bucket_next = NULL;
+                *slot = file;
+                file_table->bytes += file->size;
+                if (++file_table->count > file_table->bucket_count)
+                {
+                        grow_file_table();
+                }
+        }
+
+        file->next = NULL;
+        file->prev = files->last;
+        if (files->first == NULL)
+        {
+                files->first = file;
+        }
+        else
+        {
+                files->last->next = file;
+        }
+        files->last = file;
+}
+
+// Takes a file out of the list and the table, m_files has to be held
+void remove_file(file_entry_t **slot)
+{
+        file_entry_t *file = *slot;
+        *slot = file->bucket_next;
+        file_table->count--;
+        file_table->bytes -= file->size;
+        if (file->prev)
+                file->prev->next = file->next;
+        else
+                files->first = file->next;
+        if (file->next)
+                file->next->prev = file->prev;
+        else
+                files->last = file->prev;
+        free(file);
+}
+
+int report_progress(task_queue_entry_arg_t *task_arg)
+{
+        (void)task_arg;
+        log_info("Progress: %lu directories read so far\n", atomic_load_explicit(&directories_read, memory_order_relaxed));
+        return 0;
+}
+
+// Runs one traversal on the shared pool, the workers stay around for the next
+int scan(char *path)
+{
+        struct stat s;
+        stat(path, &s);
+        printd("Last top level status change:", &(s.st_ctime));
+        printd("Last top level data change:  ", &(s.st_mtime));
+
+        if (flags.pipeline)
+        {
+                return scan_pipeline(path);
+        }
+
+        scanned_directories = 0;
+        scanned_files = 0;
+        free_files(files);
+        atomic_store(&scanned_entries, 0);
+
+        cancel_token_t *token = create_cancel_token(flags.timeout_ms, drop_directory);
+        if (!token)
+        {
+                return MEMORY_ERROR;
+        }
+        if (flags.index)
+        {
+                scan_index = open_scan_index(path);
+                if (!scan_index)
+                {
+                        destroy_cancel_token(token);
+                        return MEMORY_ERROR;
+                }
+                scan_root_len = strlen(path);
+        }
+
+        // Wall time, clock() would sum the CPU time of every worker
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        atomic_store(&directories_read, 0);
+        thread_pool_timer_t *progress = enqueue_periodic_task(thread_pool, PROGRESS_INTERVAL_MS, report_progress, &progress_arg);
+
+        if (traverse(strlen(path), path, token))
+        {
+                if (progress)
+                        cancel_periodic_task(thread_pool, progress);
+                destroy_cancel_token(token);
+                destroy_scan_index(scan_index);
+                scan_index = NULL;
+                return 2;
+        }
+
+        wait_idle(thread_pool);
+        if (progress)
+                cancel_periodic_task(thread_pool, progress);
+
+        int cancelled = is_cancelled(token);
+        if (cancelled)
+        {
+                log_warning("Scan of %s was cancelled, %lu queued directories were skipped, totals are partial\n", path, cancel_token_dropped(token));
+        }
+        destroy_cancel_token(token);
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (scan_index)
+        {
+                // A partial scan would leave whole subtrees out of the index
+                log_info("Reused %lu directories from the index and read %lu\n",
+                         atomic_load(&scan_index->reused), atomic_load(&scan_index->read));
+                if (!cancelled && save_scan_index(scan_index) != 0)
+                {
+                        log_warning("Could not write the index of %s to %s\n", path, scan_index->path);
+                }
+                destroy_scan_index(scan_index);
+                scan_index = NULL;
+        }
+        summarize_files();
+        double time_spent = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        log_info("Traversed %s: %lu directories and %lu files in %fs\n", path, scanned_directories, scanned_files, time_spent);
+
+        thread_pool_stats_t stats;
+        if (thread_pool_stats(thread_pool, &stats) == 0)
+        {
+                log_info("Pool has %u workers (peak %u), grew %lu and shrank %lu times so far\n",
+                         stats.workers, stats.peak_workers, stats.grow_events, stats.shrink_events);
+                // Long queue waits with short run times mean too few workers,
+                // long run times a slow filesystem
+                log_info("Tasks waited %.1fus at p99 (max %.1fus) and ran %.1fus at p99 (max %.1fus), %lu steals\n",
+                         stats.queue_wait.p99_ns / 1e3, stats.queue_wait.max_ns / 1e3,
+                         stats.run_time.p99_ns / 1e3, stats.run_time.max_ns / 1e3, stats.steals);
+        }
+        return 0;
+}
+
+pipeline_item_t *create_pipeline_item(const char *name, int name_len)
+{
+        pipeline_item_t *item = malloc(sizeof(pipeline_item_t) + name_len + 1);
+        if (!item)
+        {
+                return NULL;
+        }
+        item->name_len = name_len;
+        memcpy(item->name, name, name_len + 1);
+        return item;
+}
+
+// Sends subdirectories back into the scan stage and files on to stat
+void scan_directory(pipeline_t *pipeline, pipeline_item_t *dir, void *context)
+{
+        if (is_cancelled(pipeline_token))
+        {
+                return;
+        }
+        int dir_fd = open_directory_at(AT_FDCWD, dir->name);
+        if (dir_fd < 0)
+        {
+                return;
+        }
+        scan_scratch_t *scratch = acquire_scratch(context);
+        if (!scratch || start_dir_reader(&scratch->reader, dir_fd) != 0)
+        {
+                if (scratch)
+                        release_scratch(scratch);
+                close(dir_fd);
+                return;
+        }
+
+        const dir_entry_t *pDirent;
+        while ((pDirent = read_dir_entry(&scratch->reader)) != NULL)
+        {
+                if (is_skipped_entry(pDirent->name))
+                        continue;
+
+                if (is_cancelled(pipeline_token))
+                        break;
+                if (flags.max_entries && atomic_fetch_add_explicit(&scanned_entries, 1, memory_order_relaxed) >= flags.max_entries)
+                {
+                        cancel(pipeline_token);
+                        break;
+                }
+
+                int name_length = dir->name_len + 1 + pDirent->name_len;
+                if (name_length >= PATH_MAX)
+                {
+                        log_warning("Path too long, skipping: %s/%s\n", dir->name, pDirent->name);
+                        continue;
+                }
+                memcpy(scratch->path, dir->name, dir->name_len);
+                scratch->path[dir->name_len] = '/';
+                memcpy(scratch->path + dir->name_len + 1, pDirent->name, pDirent->name_len + 1);
+
+                // Symlinks are followed like in the task mode, so those and
+                // filesystems without d_type need their type looked up here
+                entry_stat_t entry;
+                entry.kind = pDirent->kind;
+                if (entry.kind == ENTRY_UNKNOWN && stat_entry_at(dir_fd, pDirent->name, WALK_TYPE, &entry) != 0)
+                        continue;
+                int is_dir = entry.kind == ENTRY_DIRECTORY;
+                int is_file = entry.kind == ENTRY_FILE;
+                if (!is_dir && !is_file)
+                        continue;
+
+                pipeline_item_t *item = create_pipeline_item(scratch->path, name_length);
+                if (!item)
+                {
+                        log_error("Out of memory, skipping the rest of %s\n", dir->name);
+                        break;
+                }
+                atomic_fetch_add_explicit(is_dir ? &pipeline_directories : &pipeline_files, 1, memory_order_relaxed);
+                if (pipeline_emit(pipeline, is_dir ? STAGE_SCAN : STAGE_STAT, item) != 0)
+                {
+                        free(item);
+                }
+        }
+        if (scratch->reader.error)
+        {
+                log_warning("Could not read all of %s: %s\n", dir->name, strerror(scratch->reader.error));
+        }
+        release_scratch(scratch);
+        close(dir_fd);
+}
+
+int scan_stage(pipeline_t *pipeline, void **items, unsigned int n, void *context)
+{
+        for (unsigned int i = 0; i < n; i++)
+        {
+                scan_directory(pipeline, items[i], context);
+                free(items[i]);
+        }
+        return 0;
+}
+
+// Ring of a stat worker with --io-uring, a whole batch of items is
+// stat'ed at once
+typedef struct stat_stage_ring_t {
+        stat_ring_t *ring;
+        stat_request_t stats[PIPELINE_DEFAULT_BATCH];
+} stat_stage_ring_t;
+
+void *create_stat_stage_ring(unsigned int slot, void *user_data)
+{
+        (void)slot;
+        (void)user_data;
+        stat_stage_ring_t *stage_ring = malloc(sizeof(stat_stage_ring_t));
+        if (stage_ring)
+        {
+                stage_ring->ring = create_stat_ring(PIPELINE_DEFAULT_BATCH);
+        }
+        return stage_ring;
+}
+
+void destroy_stat_stage_ring(unsigned int slot, void *context, void *user_data)
+{
+        (void)slot;
+        (void)user_data;
+        stat_stage_ring_t *stage_ring = context;
+        if (stage_ring)
+        {
+                destroy_stat_ring(stage_ring->ring);
+                free(stage_ring);
+        }
+}
+
+int stat_stage(pipeline_t *pipeline, void **items, unsigned int n, void *context)
+{
+        stat_stage_ring_t *stage_ring = context;
+        for (unsigned int first = 0; first < n; first += PIPELINE_DEFAULT_BATCH)
+        {
+                unsigned int count = n - first < PIPELINE_DEFAULT_BATCH ? n - first : PIPELINE_DEFAULT_BATCH;
+                // Items carry no directory, so these go by path
+                int batched = 0;
+                if (stage_ring && stage_ring->ring)
+                {
+                        for (unsigned int i = 0; i < count; i++)
+                        {
+                                stage_ring->stats[i].name = ((pipeline_item_t *)items[first + i])->name;
+                                stage_ring->stats[i].fields = WALK_SIZE | WALK_MTIME;
+                        }
+                        batched = stat_entries_at(stage_ring->ring, AT_FDCWD, stage_ring->stats, count) == 0;
+                }
+
+                for (unsigned int i = 0; i < count; i++)
+                {
+                        pipeline_item_t *item = items[first + i];
+                        entry_stat_t entry;
+                        int result = batched ? stage_ring->stats[i].result :
+                                     stat_entry_at(AT_FDCWD, item->name, WALK_SIZE | WALK_MTIME, &entry);
+                        if (result != 0)
+                        {
+                                free(item);
+                                continue;
+                        }
+                        if (batched)
+                        {
+                                entry = stage_ring->stats[i].stat;
+                        }
+                        item->size = entry.size;
+                        item->mtime = entry.mtime;
+                        if (pipeline_emit(pipeline, STAGE_ANALYZE, item) != 0)
+                        {
+                                free(item);
+                        }
+                }
+        }
+        return 0;
+}
+
+int analyze_stage(pipeline_t *pipeline, void **items, unsigned int n, void *context)
+{
+        (void)pipeline;
+        for (unsigned int i = 0; i < n; i++)
+        {
+                pipeline_item_t *item = items[i];
+                if (context)
+                {
+                        add_file(context, item->name, item->name_len, item->size, item->mtime);
+                }
+                free(item);
+        }
+        return context ? 0 : MEMORY_ERROR;
+}
+
+// Every analyze worker sums into its own summary, folded into the result
+// when the pipeline shuts down
+void *create_partial_summary(unsigned int slot, void *result)
+{
+        (void)slot;
+        (void)result;
+        file_summary_t *partial = malloc(sizeof(file_summary_t));
+        if (partial)
+        {
+                init_file_summary(partial, NULL);
+        }
+        return partial;
+}
+
+void merge_partial_summary(unsigned int slot, void *partial, void *result)
+{
+        (void)slot;
+        if (!partial)
+        {
+                return;
+        }
+        pthread_mutex_lock(&m_summary);
+        merge_file_summary(result, partial, NULL);
+        pthread_mutex_unlock(&m_summary);
+        free(partial);
+}
+
+// Reads directories, stats files and sums them up in separate stages that
+// overlap, instead of one task per directory followed by a summary pass
+int scan_pipeline(char *path)
+{
+        file_summary_t *summary = malloc(sizeof(file_summary_t));
+        pipeline_token = create_cancel_token(flags.timeout_ms, NULL);
+        pipeline_item_t *root = create_pipeline_item(path, strlen(path));
+        if (!summary || !pipeline_token || !root)
+        {
+                free(summary);
+                destroy_cancel_token(pipeline_token);
+                free(root);
+                return MEMORY_ERROR;
+        }
+        init_file_summary(summary, NULL);
+        atomic_store(&scanned_entries, 0);
+        atomic_store(&pipeline_directories, 1);
+        atomic_store(&pipeline_files, 0);
+
+        struct timespec begin;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        pipeline_stage_options_t stages[STAGE_COUNT] = {
+                [STAGE_SCAN] = {
+                        .name = "scan",
+                        .func = scan_stage,
+                        .workers = cpu_count * SCAN_WORKERS_PER_CPU,
+                        .queue_batches = PIPELINE_QUEUE_BATCHES,
+                        .worker_init = create_scratch,
+                        .worker_teardown = destroy_scratch,
+                },
+                [STAGE_STAT] = {
+                        .name = "stat",
+                        .func = stat_stage,
+                        .workers = cpu_count * STAT_WORKERS_PER_CPU,
+                        .queue_batches = PIPELINE_QUEUE_BATCHES,
+                        .worker_init = flags.io_uring ? create_stat_stage_ring : NULL,
+                        .worker_teardown = flags.io_uring ? destroy_stat_stage_ring : NULL,
+                },
+                [STAGE_ANALYZE] = {
+                        .name = "analyze",
+                        .func = analyze_stage,
+                        .workers = cpu_count * ANALYZE_WORKERS_PER_CPU,
+                        .queue_batches = PIPELINE_QUEUE_BATCHES,
+                        .worker_init = create_partial_summary,
+                        .worker_teardown = merge_partial_summary,
+                        .worker_user_data = summary,
+                },
+        };
+        pipeline_t *pipeline = create_pipeline(STAGE_COUNT, stages, PIPELINE_DEFAULT_BATCH);
+        if (!pipeline)
+        {
+                log_error("Failed to create the scan pipeline\n");
+                free(summary);
+                destroy_cancel_token(pipeline_token);
+                free(root);
+                return 2;
+        }
+
+        if (pipeline_emit(pipeline, STAGE_SCAN, root) != 0)
+        {
+                free(root);
+        }
+        int err = pipeline_finish(pipeline);
+        // Analyze workers fold their partials into summary on the way out
+        destroy_pipeline(pipeline);
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double time_spent = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+        if (is_cancelled(pipeline_token))
+        {
+                log_warning("Scan of %s was cancelled, totals are partial\n", path);
+        }
+        destroy_cancel_token(pipeline_token);
+        pipeline_token = NULL;
+
+        log_file_summary(summary);
+        free(summary);
+        log_info("Traversed %s: %lu directories and %lu files in %fs\n", path,
+                 atomic_load(&pipeline_directories), atomic_load(&pipeline_files), time_spent);
+        return err ? 2 : 0;
+}
+
+// Puts the files of the initial scan into the path table
+int build_file_table()
+{
+        file_table = malloc(sizeof(file_table_t));
+        if (!file_table)
+        {
+                return MEMORY_ERROR;
+        }
+        file_table->bucket_count = 1024;
+        file_table->count = 0;
+        file_table->bytes = 0;
+        for (file_entry_t *file = files->first; file; file = file->next)
+        {
+                file_table->count++;
+        }
+        while (file_table->bucket_count < file_table->count)
+        {
+                file_table->bucket_count *= 2;
+        }
+        file_table->buckets = calloc(file_table->bucket_count, sizeof(file_entry_t *));
+        if (!file_table->buckets)
+        {
+                free(file_table);
+                file_table = NULL;
+                return MEMORY_ERROR;
+        }
+        for (file_entry_t *file = files->first; file; file = file->next)
+        {
+                file_entry_t **slot = &file_table->buckets[hash_bytes(file->name, file->name_len) & (file_table->bucket_count - 1)];
+                file->bucket_next = *slot;
+                *slot = file;
+                file_table->bytes += file->size;
+        }
+        return 0;
+}
+
+void destroy_file_table()
+{
+        if (file_table)
+        {
+                free(file_table->buckets);
+                free(file_table);
+                file_table = NULL;
+        }
+}
+
+// Reads a directory that showed up while watching, adding watches to it
+// and everything below
+int scan_new_directory(const char *path, int length)
+{
+        cancel_token_t *token = create_cancel_token(0, drop_directory);
+        if (!token)
+        {
+                return MEMORY_ERROR;
+        }
+        int err = traverse(length, (char *)path, token);
+        wait_idle(thread_pool);
+        destroy_cancel_token(token);
+        return err;
+}
+
+// Takes every file below path out of the list, m_files has to be held
+void remove_subtree(const char *path, int length)
+{
+        file_entry_t *file = files->first;
+        while (file)
+        {
+                file_entry_t *next = file->next;
+                if (file->name_len > length && file->name[length] == '/' && !memcmp(file->name, path, length))
+                {
+                        remove_file(find_file(file->name, file->name_len));
+                }
+                file = next;
+        }
+}
+
+char **find_deleted_directory(char **paths, size_t slot_count, const char *path, int length)
+{
+        size_t slot = hash_bytes(path, length) & (slot_count - 1);
+        while (paths[slot] && (strncmp(paths[slot], path, length) || paths[slot][length]))
+        {
+                slot = (slot + 1) & (slot_count - 1);
+        }
+        return &paths[slot];
+}
+
+int add_deleted_directory(const char *path, int length)
+{
+        deleted_directories_t *deleted = &deleted_directories;
+        if ((deleted->count + 1) * 2 > deleted->slot_count)
+        {
+                size_t slot_count = deleted->slot_count ? deleted->slot_count * 2 : DELETED_MIN_SLOTS;
+                char **paths = calloc(slot_count, sizeof(char *));
+                if (!paths)
+                        return MEMORY_ERROR;
+                for (size_t i = 0; i < deleted->slot_count; i++)
+                {
+                        if (deleted->paths[i])
+                                *find_deleted_directory(paths, slot_count, deleted->paths[i], strlen(deleted->paths[i])) = deleted->paths[i];
+                }
+                free(deleted->paths);
+                deleted->paths = paths;
+                deleted->slot_count = slot_count;
+        }
+        char **slot = find_deleted_directory(deleted->paths, deleted->slot_count, path, length);
+        if (*slot)
+                return 0;
+        *slot = strndup(path, length);
+        if (!*slot)
+                return MEMORY_ERROR;
+        deleted->count++;
+        return 0;
+}
+
+// Whether path or one of the directories above it was deleted, checks
+// each of its '/' instead of each deleted directory
+int is_deleted_path(const char *path, void *user_data)
+{
+        (void)user_data;
+        deleted_directories_t *deleted = &deleted_directories;
+        int length = strlen(path);
+        for (int i = 1; i <= length; i++)
+        {
+                if ((i == length || path[i] == '/') && *find_deleted_directory(deleted->paths, deleted->slot_count, path, i))
+                        return 1;
+        }
+        return 0;
+}
+
+// Takes the files and watches below the directories deleted since the last
+// flush out, one pass over the file list for all of them
+void flush_deleted_directories(void)
+{
+        deleted_directories_t *deleted = &deleted_directories;
+        if (deleted->count == 0)
+                return;
+        profiled_mutex_lock(&m_files);
+        file_entry_t *file = files->first;
+        while (file)
+        {
+                file_entry_t *next = file->next;
+                if (is_deleted_path(file->name, NULL))
+                {
+                        remove_file(find_file(file->name, file->name_len));
+                }
+                file = next;
+        }
+        profiled_mutex_unlock(&m_files);
+        unwatch_matching(watcher, is_deleted_path, NULL);
+        for (size_t i = 0; i < deleted->slot_count; i++)
+        {
+                free(deleted->paths[i]);
+                deleted->paths[i] = NULL;
+        }
+        deleted->count = 0;
+}
+
+void destroy_deleted_directories(void)
+{
+        free(deleted_directories.paths);
+        memset(&deleted_directories, 0, sizeof(deleted_directories));
+}
+
+void apply_watch_event(const watch_event_t *event, void *user_data)
+{
+        char *root = user_data;
+        // A directory deleted and created again in the same drain has to be
+        // gone before its new files are listed
+        if (event->kind != WATCH_DELETED)
+        {
+                flush_deleted_directories();
+        }
+        if (event->kind == WATCH_OVERFLOW)
+        {
+                log_warning("Missed changes of %s, scanning all of it again\n", root);
+                unwatch_subtree(watcher, root, strlen(root));
+                profiled_mutex_lock(&m_files);
+                free_files(files);
+                profiled_mutex_unlock(&m_files);
+                scan_new_directory(root, strlen(root));
+                return;
+        }
+
+        const char *name = strrchr(event->path, '/') + 1;
+        if (is_skipped_entry(name))
+        {
+                return;
+        }
+        if (event->kind == WATCH_DELETED)
+        {
+                atomic_fetch_add_explicit(&watch_deleted, 1, memory_order_relaxed);
+                // Left for flush_deleted_directories, one rm -rf deletes
+                // every directory below as well
+                if (event->is_dir && add_deleted_directory(event->path, event->path_len) == 0)
+                {
+                        return;
+                }
+                profiled_mutex_lock(&m_files);
+                if (event->is_dir)
+                {
+                        remove_subtree(event->path, event->path_len);
+                }
+                else
+                {
+                        file_entry_t **slot = find_file(event->path, event->path_len);
+                        if (*slot)
+                                remove_file(slot);
+                }
+                profiled_mutex_unlock(&m_files);
+                if (event->is_dir)
+                {
+                        unwatch_subtree(watcher, event->path, event->path_len);
+                }
+                return;
+        }
+
+        atomic_fetch_add_explicit(event->kind == WATCH_CREATED ? &watch_created : &watch_changed, 1, memory_order_relaxed);
+        // Symlinks are followed like in a scan, and it may be gone already
+        entry_stat_t entry;
+        if (stat_entry_at(AT_FDCWD, event->path, WALK_TYPE | WALK_SIZE | WALK_MTIME, &entry) != 0)
+        {
+                return;
+        }
+        if (entry.kind == ENTRY_DIRECTORY)
+        {
+                // Moved in with whatever it holds, or filled before its watch
+                if (event->kind == WATCH_CREATED)
+                        scan_new_directory(event->path, event->path_len);
+                return;
+        }
+        if (entry.kind != ENTRY_FILE)
+        {
+                return;
+        }
+        file_entry_t *file = malloc(sizeof(file_entry_t) + event->path_len + 1);
+        if (!file)
+        {
+                log_error("Out of memory, %s is not listed\n", event->path);
+                return;
+        }
+        file->name = (char *)(file + 1);
+        memcpy(file->name, event->path, event->path_len + 1);
+        file->name_len = event->path_len;
+        file->size = entry.size;
+        file->mtime = entry.mtime;
+        profiled_mutex_lock(&m_files);
+        append_file(file);
+        profiled_mutex_unlock(&m_files);
+}
+
+int report_watch(task_queue_entry_arg_t *task_arg)
+{
+        (void)task_arg;
+        unsigned long created = atomic_exchange(&watch_created, 0);
+        unsigned long deleted = atomic_exchange(&watch_deleted, 0);
+        unsigned long changed = atomic_exchange(&watch_changed, 0);
+        double seconds = WATCH_SUMMARY_INTERVAL_MS / 1e3;
+
+        profiled_mutex_lock(&m_files);
+        size_t count = file_table ? file_table->count : 0;
+        unsigned long long bytes = file_table ? file_table->bytes : 0;
+        profiled_mutex_unlock(&m_files);
+        log_info("Watching %lu directories with %zu files and %llu bytes, %lu created, %lu deleted and %lu changed in the last %.0fs (%.1f events/s)\n",
+                 watched_directories(watcher), count, bytes, created, deleted, changed, seconds,
+                 (created + deleted + changed) / seconds);
+        return 0;
+}
+
+void request_stop(int signal)
+{
+        (void)signal;
+        stop_watching = 1;
+}
+
+// Scans path once, then applies its changes to the file list instead of
+// scanning it again, until SIGINT or SIGTERM
+int watch_files(char *path)
+{
+        watcher = create_watcher();
+        if (!watcher)
+        {
+                log_error("inotify is not available, can't watch %s\n", path);
+                return 1;
+        }
+        // Watches every directory it reads
+        int err = scan(path);
+        if (err == 0 && build_file_table() != 0)
+        {
+                err = MEMORY_ERROR;
+        }
+        if (err != 0)
+        {
+                destroy_watcher(watcher);
+                watcher = NULL;
+                return err;
+        }
+
+        struct sigaction stop;
+        memset(&stop, 0, sizeof(stop));
+        stop.sa_handler = request_stop;
+        sigemptyset(&stop.sa_mask);
+        sigaction(SIGINT, &stop, NULL);
+        sigaction(SIGTERM, &stop, NULL);
+
+        log_info("Watching %lu directories of %s, interrupt to stop\n", watched_directories(watcher), path);
+        thread_pool_timer_t *summary = enqueue_periodic_task(thread_pool, WATCH_SUMMARY_INTERVAL_MS, report_watch, &watch_summary_arg);
+        while (!stop_watching)
+        {
+                int read = read_watch_events(watcher, WATCH_POLL_MS, apply_watch_event, path);
+                flush_deleted_directories();
+                if (read < 0)
+                {
+                        log_error("Failed to read the changes of %s\n", path);
+                        err = 2;
+                        break;
+                }
+        }
+        if (summary)
+                cancel_periodic_task(thread_pool, summary);
+
+        summarize_files();
+        log_info("Stopped watching %s with %zu files listed\n", path, file_table->count);
+        destroy_file_table();
+        destroy_deleted_directories();
+        destroy_watcher(watcher);
+        watcher = NULL;
+        return err;
+}
+
+int main(int argc, char *argv[])
+{
+        if (parse_flags(argc, argv, &flags) != 0)
+        {
+                return 1;
+        }
+
+        // Before the logger, its queue lock is one of the profiled ones
+        if (flags.lock_profile)
+        {
+                enable_lock_profiling();
+        }
+        init_logger(LOG_LEVEL_INFO);
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus < 1)
+        {
+                cpus = 1;
+        }
+        cpu_count = cpus;
+
+        if (flags.watch && (flags.pipeline || argc - flags.first_path > 1))
+        {
+                log_error("--watch follows a single directory and doesn't go with --pipeline\n");
+                stop_logger();
+                return 1;
+        }
+        if (flags.index && flags.pipeline)
+        {
+                log_warning("The index is only used without --pipeline\n");
+                flags.index = 0;
+        }
+
+        if (flags.io_uring)
+        {
+                stat_ring_t *probe = create_stat_ring(1);
+                if (!probe)
+                {
+                        log_warning("io_uring is not available, stat'ing entries one by one\n");
+                        flags.io_uring = 0;
+                }
+                destroy_stat_ring(probe);
+        }
+        int max_thread_count = cpus * (flags.io_uring ? URING_THREADS_PER_CPU : THREADS_PER_CPU);
+
+        files = malloc(sizeof(file_list_t));
+        files->first = NULL;
+        files->last = NULL;
+
+        // One pool for all scans, threads are only started once
+        thread_pool_creation_status_t *status = malloc(sizeof(thread_pool_creation_status_t));
+        thread_pool_options_t options = {
+                .thread_count = cpus,
+                .queue_backend = TASK_QUEUE_LOCKED,
+                .min_threads = MIN_THREAD_COUNT,
+                .max_threads = max_thread_count,
+                .idle_timeout_ms = IDLE_TIMEOUT_MS,
+                .max_pending = MAX_PENDING_DIRECTORIES,
+                .full_policy = THREAD_POOL_FULL_RUN_INLINE,
+                // Scanners share the page cache and dentries of their node,
+                // so workers may move between its cores but not off it
+                .placement = flags.cpu_list ? THREAD_POOL_PLACEMENT_NODES : THREAD_POOL_PLACEMENT_NONE,
+                .cpu_list = flags.cpu_list,
+                .trace_path = flags.trace_path,
+                .worker_init = create_scratch,
+                .worker_teardown = destroy_scratch,
+        };
+        // The pipeline mode sets up pools of its own for every scan
+        if (!flags.pipeline)
+        {
+                thread_pool = create_thread_pool_with_options(&options, status);
+                if (status == NULL || *status != CREATED)
+                {
+                        if (status && *status == INVALID_OPTIONS)
+                                log_error("Could not place workers on CPUs %s\n", flags.cpu_list);
+                        stop_logger();
+                        return 1;
+                }
+        }
+
+        int err = 0;
+        if (flags.watch)
+        {
+                err = watch_files(flags.first_path == argc ? "." : argv[flags.first_path]);
+        }
+        else if (flags.first_path == argc)
+        {
+                err = scan(".");
+        }
+        for (int i = flags.first_path; i < argc && err == 0 && !flags.watch; i++)
+        {
+                err = scan(argv[i]);
+        }
+
+        if (thread_pool)
+        {
+                shutdown_pool(thread_pool);
+        }
+        free_files(files);
+        stop_logger();
+        return err;
 }
@@ -0,0 +1,575 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "scan_index.h"
+
+#define INDEX_MAGIC "SCANIDX"
+#define INDEX_VERSION 1
+#define INDEX_MIN_CAPACITY 4096
+
+// Directories changed this close to the start of a scan may change again
+// without their timestamps moving, the clock only ticks so often
+#define RACY_SECONDS 1
+
+typedef struct index_file_header_t
+{
+    char magic[8];
+    unsigned int version;
+    // Records of another layout are not read
+    unsigned int record_header_size;
+    unsigned long long record_count;
+} index_file_header_t;
+
+// Every record starts with this, followed by the NUL terminated path and
+// the entries. An entry is its kind in one byte, the name length in two,
+// the NUL terminated name and for files the size and mtime.
+typedef struct index_record_header_t
+{
+    unsigned int size;
+    unsigned int entry_count;
+    directory_identity_t identity;
+    unsigned int path_len;
+} index_record_header_t;
+
+// Record of this scan, data is either part of the loaded index or follows
+typedef struct index_node_t index_node_t;
+typedef struct index_node_t
+{
+    index_node_t *next;
+    const unsigned char *data;
+    size_t size;
+    unsigned char owned[];
+} index_node_t;
+
+scan_index_t *open_scan_index(const char *root);
+void destroy_scan_index(scan_index_t *index);
+int save_scan_index(scan_index_t *index);
+int identify_directory(int fd, directory_identity_t *identity);
+const index_record_t *find_unchanged_directory(scan_index_t *index, const char *path, unsigned int path_len, const directory_identity_t *identity);
+int keep_index_record(scan_index_t *index, const index_record_t *record);
+int next_indexed_entry(const index_record_t *record, size_t *offset, indexed_entry_t *entry);
+int init_index_builder(index_builder_t *builder);
+void destroy_index_builder(index_builder_t *builder);
+int begin_index_record(scan_index_t *index, index_builder_t *builder, const char *path, unsigned int path_len, const directory_identity_t *identity);
+int add_index_entry(index_builder_t *builder, const char *name, unsigned int name_len, const entry_stat_t *stat);
+int commit_index_record(scan_index_t *index, index_builder_t *builder);
+
+unsigned long long _hash_path(const char *path, unsigned int length)
+{
+    // FNV-1a
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned int i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+const char *_record_path(const unsigned char *record)
+{
+    return (const char *)(record + sizeof(index_record_header_t));
+}
+
+// Checks every entry of a record lies within it, a damaged index is not
+// used at all
+int _check_record(const unsigned char *record, size_t available)
+{
+    index_record_header_t header;
+    if (available < sizeof(header))
+        return FATAL_ERROR;
+    memcpy(&header, record, sizeof(header));
+    if (header.size > available || header.size < sizeof(header) + header.path_len + 1 ||
+        record[sizeof(header) + header.path_len] != '\0')
+        return FATAL_ERROR;
+
+    size_t offset = 0;
+    indexed_entry_t entry;
+    for (unsigned int i = 0; i < header.entry_count; i++)
+    {
+        if (next_indexed_entry((const index_record_t *)record, &offset, &entry) != 0)
+            return FATAL_ERROR;
+    }
+    return next_indexed_entry((const index_record_t *)record, &offset, &entry) == QUEUE_EMPTY ? 0 : FATAL_ERROR;
+}
+
+// Hashes every record of the loaded file, FATAL_ERROR if it is damaged
+int _load_records(scan_index_t *index)
+{
+    index_file_header_t header;
+    if (index->loaded_size < sizeof(header))
+        return FATAL_ERROR;
+    memcpy(&header, index->loaded, sizeof(header));
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) || header.version != INDEX_VERSION ||
+        header.record_header_size != sizeof(index_record_header_t) || header.record_count > index->loaded_size)
+        return FATAL_ERROR;
+
+    size_t slot_count = 16;
+    while (slot_count < header.record_count * 2)
+        slot_count *= 2;
+    index->slots = calloc(slot_count, sizeof(size_t));
+    if (!index->slots)
+        return MEMORY_ERROR;
+    index->slot_count = slot_count;
+
+    size_t offset = sizeof(header);
+    for (unsigned long long i = 0; i < header.record_count; i++)
+    {
+        const unsigned char *record = index->loaded + offset;
+        if (_check_record(record, index->loaded_size - offset) != 0)
+            return FATAL_ERROR;
+        index_record_header_t record_header;
+        memcpy(&record_header, record, sizeof(record_header));
+
+        size_t slot = _hash_path(_record_path(record), record_header.path_len) & (slot_count - 1);
+        while (index->slots[slot])
+            slot = (slot + 1) & (slot_count - 1);
+        index->slots[slot] = offset + 1;
+        offset += record_header.size;
+    }
+    return offset == index->loaded_size ? 0 : FATAL_ERROR;
+}
+
+int _read_file(const char *path, unsigned char **data, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FATAL_ERROR;
+    struct stat s;
+    if (fstat(fd, &s) != 0 || s.st_size <= 0)
+    {
+        close(fd);
+        return FATAL_ERROR;
+    }
+    unsigned char *buffer = malloc(s.st_size);
+    if (!buffer)
+    {
+        close(fd);
+        return MEMORY_ERROR;
+    }
+    size_t done = 0;
+    while (done < (size_t)s.st_size)
+    {
+        ssize_t got = read(fd, buffer + done, s.st_size - done);
+        if (got <= 0)
+        {
+            if (got < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        done += got;
+    }
+    close(fd);
+    if (done != (size_t)s.st_size)
+    {
+        free(buffer);
+        return FATAL_ERROR;
+    }
+    *data = buffer;
+    *size = done;
+    return 0;
+}
+
+scan_index_t *open_scan_index(const char *root)
+{
+    if (!root)
+    {
+        return NULL;
+    }
+    scan_index_t *index = calloc(1, sizeof(scan_index_t));
+    if (!index)
+    {
+        return NULL;
+    }
+    size_t path_size = strlen(root) + sizeof("/" SCAN_INDEX_DIR "/" SCAN_INDEX_FILE);
+    index->path = malloc(path_size);
+    if (!index->path)
+    {
+        free(index);
+        return NULL;
+    }
+    snprintf(index->path, path_size, "%s/%s/%s", root, SCAN_INDEX_DIR, SCAN_INDEX_FILE);
+    atomic_init(&index->records, NULL);
+    atomic_init(&index->record_count, 0);
+    atomic_init(&index->reused, 0);
+    atomic_init(&index->read, 0);
+    index->started = time(NULL);
+
+    if (_read_file(index->path, &index->loaded, &index->loaded_size) == 0 && _load_records(index) != 0)
+    {
+        // Starts over, every directory gets read
+        free(index->loaded);
+        free(index->slots);
+        index->loaded = NULL;
+        index->loaded_size = 0;
+        index->slots = NULL;
+        index->slot_count = 0;
+    }
+    return index;
+}
+
+void destroy_scan_index(scan_index_t *index)
+{
+    if (!index)
+    {
+        return;
+    }
+    index_node_t *node = atomic_load(&index->records);
+    while (node)
+    {
+        index_node_t *next = node->next;
+        free(node);
+        node = next;
+    }
+    free(index->loaded);
+    free(index->slots);
+    free(index->path);
+    free(index);
+}
+
+int _write_all(int fd, const void *data, size_t size)
+{
+    const unsigned char *bytes = data;
+    while (size)
+    {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return FATAL_ERROR;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+int save_scan_index(scan_index_t *index)
+{
+    if (!index)
+    {
+        return ILLEGAL_ARGS;
+    }
+    // path ends in SCAN_INDEX_DIR/SCAN_INDEX_FILE, the directory may be new
+    size_t length = strlen(index->path);
+    char *temporary = malloc(length + sizeof(".tmp"));
+    if (!temporary)
+    {
+        return MEMORY_ERROR;
+    }
+    memcpy(temporary, index->path, length - sizeof(SCAN_INDEX_FILE));
+    temporary[length - sizeof(SCAN_INDEX_FILE)] = '\0';
+    if (mkdir(temporary, 0755) != 0 && errno != EEXIST)
+    {
+        free(temporary);
+        return FATAL_ERROR;
+    }
+    snprintf(temporary, length + sizeof(".tmp"), "%s.tmp", index->path);
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        free(temporary);
+        return FATAL_ERROR;
+    }
+    index_file_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.version = INDEX_VERSION;
+    header.record_header_size = sizeof(index_record_header_t);
+    header.record_count = atomic_load(&index->record_count);
+
+    // Written in large chunks, an index has a record per directory
+    size_t chunk_capacity = 1 << 20;
+    unsigned char *chunk = malloc(chunk_capacity);
+    int err = chunk ? _write_all(fd, &header, sizeof(header)) : MEMORY_ERROR;
+    size_t used = 0;
+    for (index_node_t *node = atomic_load(&index->records); node && err == 0; node = node->next)
+    {
+        if (used + node->size > chunk_capacity)
+        {
+            err = _write_all(fd, chunk, used);
+            used = 0;
+        }
+        if (node->size > chunk_capacity)
+        {
+            err = err ? err : _write_all(fd, node->data, node->size);
+            continue;
+        }
+        memcpy(chunk + used, node->data, node->size);
+        used += node->size;
+    }
+    if (err == 0)
+        err = _write_all(fd, chunk, used);
+    free(chunk);
+    if (err == 0 && fsync(fd) != 0)
+        err = FATAL_ERROR;
+    if (close(fd) != 0 && err == 0)
+        err = FATAL_ERROR;
+    if (err == 0 && rename(temporary, index->path) != 0)
+        err = FATAL_ERROR;
+    if (err != 0)
+        unlink(temporary);
+    free(temporary);
+    return err;
+}
+
+int identify_directory(int fd, directory_identity_t *identity)
+{
+    struct stat s;
+    if (!identity || fstat(fd, &s) != 0)
+    {
+        return FATAL_ERROR;
+    }
+    identity->dev = s.st_dev;
+    identity->ino = s.st_ino;
+#ifdef __APPLE__
+    identity->mtime_sec = s.st_mtimespec.tv_sec;
+    identity->mtime_nsec = s.st_mtimespec.tv_nsec;
+    identity->ctime_sec = s.st_ctimespec.tv_sec;
+    identity->ctime_nsec = s.st_ctimespec.tv_nsec;
+#else
+    identity->mtime_sec = s.st_mtim.tv_sec;
+    identity->mtime_nsec = s.st_mtim.tv_nsec;
+    identity->ctime_sec = s.st_ctim.tv_sec;
+    identity->ctime_nsec = s.st_ctim.tv_nsec;
+#endif
+    return 0;
+}
+
+const index_record_t *find_unchanged_directory(scan_index_t *index, const char *path, unsigned int path_len, const directory_identity_t *identity)
+{
+    if (!index || !index->slot_count || !path || !identity)
+    {
+        return NULL;
+    }
+    size_t slot = _hash_path(path, path_len) & (index->slot_count - 1);
+    for (; index->slots[slot]; slot = (slot + 1) & (index->slot_count - 1))
+    {
+        const unsigned char *record = index->loaded + index->slots[slot] - 1;
+        index_record_header_t header;
+        memcpy(&header, record, sizeof(header));
+        if (header.path_len != path_len || memcmp(_record_path(record), path, path_len))
+        {
+            continue;
+        }
+        if (memcmp(&header.identity, identity, sizeof(directory_identity_t)))
+        {
+            return NULL;
+        }
+        return (const index_record_t *)record;
+    }
+    return NULL;
+}
+
+int _push_node(scan_index_t *index, index_node_t *node)
+{
+    void *head = atomic_load(&index->records);
+    do
+    {
+        node->next = head;
+    } while (!atomic_compare_exchange_weak(&index->records, &head, node));
+    atomic_fetch_add(&index->record_count, 1);
+    return 0;
+}
+
+int keep_index_record(scan_index_t *index, const index_record_t *record)
+{
+    if (!index || !record)
+    {
+        return ILLEGAL_ARGS;
+    }
+    index_node_t *node = malloc(sizeof(index_node_t));
+    if (!node)
+    {
+        return MEMORY_ERROR;
+    }
+    index_record_header_t header;
+    memcpy(&header, record, sizeof(header));
+    node->data = (const unsigned char *)record;
+    node->size = header.size;
+    atomic_fetch_add_explicit(&index->reused, 1, memory_order_relaxed);
+    return _push_node(index, node);
+}
+
+int next_indexed_entry(const index_record_t *record, size_t *offset, indexed_entry_t *entry)
+{
+    if (!record || !offset || !entry)
+    {
+        return ILLEGAL_ARGS;
+    }
+    const unsigned char *bytes = (const unsigned char *)record;
+    index_record_header_t header;
+    memcpy(&header, bytes, sizeof(header));
+    size_t at = *offset ? *offset : sizeof(header) + header.path_len + 1;
+    if (at == header.size)
+    {
+        return QUEUE_EMPTY;
+    }
+
+    unsigned short name_len;
+    if (at + 3 > header.size)
+        return FATAL_ERROR;
+    unsigned char kind = bytes[at];
+    memcpy(&name_len, bytes + at + 1, sizeof(name_len));
+    at += 3;
+    if (at + name_len + 1 > header.size || bytes[at + name_len] != '\0')
+        return FATAL_ERROR;
+    entry->name = (const char *)(bytes + at);
+    entry->name_len = name_len;
+    at += name_len + 1;
+
+    if (kind == ENTRY_FILE)
+    {
+        unsigned long long size;
+        long long mtime;
+        if (at + sizeof(size) + sizeof(mtime) > header.size)
+            return FATAL_ERROR;
+        memcpy(&size, bytes + at, sizeof(size));
+        memcpy(&mtime, bytes + at + sizeof(size), sizeof(mtime));
+        at += sizeof(size) + sizeof(mtime);
+        entry->size = size;
+        entry->mtime = mtime;
+    }
+    else if (kind != ENTRY_DIRECTORY)
+    {
+        return FATAL_ERROR;
+    }
+    entry->kind = kind;
+    *offset = at;
+    return 0;
+}
+
+int init_index_builder(index_builder_t *builder)
+{
+    if (!builder)
+    {
+        return ILLEGAL_ARGS;
+    }
+    builder->capacity = INDEX_MIN_CAPACITY;
+    builder->buffer = malloc(builder->capacity);
+    builder->size = 0;
+    builder->entries = 0;
+    return builder->buffer ? 0 : MEMORY_ERROR;
+}
+
+void destroy_index_builder(index_builder_t *builder)
+{
+    if (builder)
+    {
+        free(builder->buffer);
+        builder->buffer = NULL;
+    }
+}
+
+int _reserve(index_builder_t *builder, size_t more)
+{
+    if (builder->size + more <= builder->capacity)
+    {
+        return 0;
+    }
+    size_t capacity = builder->capacity;
+    while (capacity < builder->size + more)
+        capacity *= 2;
+    unsigned char *buffer = realloc(builder->buffer, capacity);
+    if (!buffer)
+    {
+        return MEMORY_ERROR;
+    }
+    builder->buffer = buffer;
+    builder->capacity = capacity;
+    return 0;
+}
+
+int begin_index_record(scan_index_t *index, index_builder_t *builder, const char *path, unsigned int path_len, const directory_identity_t *identity)
+{
+    if (!index || !builder || !builder->buffer || !path || !identity)
+    {
+        return ILLEGAL_ARGS;
+    }
+    builder->size = 0;
+    builder->entries = 0;
+    if (_reserve(builder, sizeof(index_record_header_t) + path_len + 1) != 0)
+    {
+        return MEMORY_ERROR;
+    }
+    index_record_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.identity = *identity;
+    header.path_len = path_len;
+    if (identity->mtime_sec >= index->started - RACY_SECONDS || identity->ctime_sec >= index->started - RACY_SECONDS)
+    {
+        // Never matches, so the directory is read again next time
+        header.identity.mtime_sec = -1;
+        header.identity.ctime_sec = -1;
+    }
+    memcpy(builder->buffer, &header, sizeof(header));
+    memcpy(builder->buffer + sizeof(header), path, path_len);
+    builder->buffer[sizeof(header) + path_len] = '\0';
+    builder->size = sizeof(header) + path_len + 1;
+    atomic_fetch_add_explicit(&index->read, 1, memory_order_relaxed);
+    return 0;
+}
+
+int add_index_entry(index_builder_t *builder, const char *name, unsigned int name_len, const entry_stat_t *stat)
+{
+    if (!builder || !name || !stat || name_len > 0xffff)
+    {
+        return ILLEGAL_ARGS;
+    }
+    if (stat->kind != ENTRY_DIRECTORY && stat->kind != ENTRY_FILE)
+    {
+        return 0;
+    }
+    unsigned long long size = stat->size;
+    long long mtime = stat->mtime;
+    if (_reserve(builder, 3 + name_len + 1 + sizeof(size) + sizeof(mtime)) != 0)
+    {
+        return MEMORY_ERROR;
+    }
+    unsigned char *at = builder->buffer + builder->size;
+    unsigned short length = name_len;
+    at[0] = stat->kind;
+    memcpy(at + 1, &length, sizeof(length));
+    memcpy(at + 3, name, name_len);
+    at[3 + name_len] = '\0';
+    at += 3 + name_len + 1;
+    if (stat->kind == ENTRY_FILE)
+    {
+        memcpy(at, &size, sizeof(size));
+        memcpy(at + sizeof(size), &mtime, sizeof(mtime));
+        at += sizeof(size) + sizeof(mtime);
+    }
+    builder->size = at - builder->buffer;
+    builder->entries++;
+    return 0;
+}
+
+int commit_index_record(scan_index_t *index, index_builder_t *builder)
+{
+    if (!index || !builder || builder->size < sizeof(index_record_header_t))
+    {
+        return ILLEGAL_ARGS;
+    }
+    index_record_header_t header;
+    memcpy(&header, builder->buffer, sizeof(header));
+    header.size = builder->size;
+    header.entry_count = builder->entries;
+    memcpy(builder->buffer, &header, sizeof(header));
+
+    index_node_t *node = malloc(sizeof(index_node_t) + builder->size);
+    if (!node)
+    {
+        return MEMORY_ERROR;
+    }
+    memcpy(node->owned, builder->buffer, builder->size);
+    node->data = node->owned;
+    node->size = builder->size;
+    return _push_node(index, node);
+}
@@ -0,0 +1,106 @@
+#ifndef SCAN_INDEX_H
+#define SCAN_INDEX_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "constants.h"
+#include "walk.h"
+
+// Kept in the scanned root, which the scan itself skips
+#define SCAN_INDEX_DIR ".scan"
+#define SCAN_INDEX_FILE "index"
+
+// What tells a directory apart from the one listed in the index. Adding,
+// removing or renaming an entry moves mtime, a chmod or rename of the
+// directory itself ctime.
+typedef struct directory_identity_t
+{
+    unsigned long long dev;
+    unsigned long long ino;
+    long long mtime_sec;
+    long long mtime_nsec;
+    long long ctime_sec;
+    long long ctime_nsec;
+} directory_identity_t;
+
+// One stored entry of a directory, name is NUL terminated
+typedef struct indexed_entry_t
+{
+    const char *name;
+    unsigned int name_len;
+    // ENTRY_DIRECTORY or ENTRY_FILE, only files have size and mtime
+    entry_kind_t kind;
+    unsigned long long size;
+    time_t mtime;
+} indexed_entry_t;
+
+// Listing of one directory in the loaded index
+typedef struct index_record_t index_record_t;
+
+// Collects the listing of one directory while it is read, one per thread
+// and reused for every directory
+typedef struct index_builder_t
+{
+    unsigned char *buffer;
+    size_t size;
+    size_t capacity;
+    unsigned int entries;
+} index_builder_t;
+
+/*
+ * Listings of every directory below a root as of the last scan, plus the
+ * ones collected during this one. Directories still matching their stored
+ * identity are not read again, their listing is reused as it is. Lookups
+ * and adding records are safe from any number of threads.
+ *
+ * Files are only stat'ed when their directory is read, so a file rewritten
+ * in place keeps its old size and mtime until its directory changes.
+ */
+typedef struct scan_index_t
+{
+    char *path;
+    // The file as it was loaded, records point into it
+    unsigned char *loaded;
+    size_t loaded_size;
+    // Open addressing on the path hash, offsets into loaded plus one
+    size_t *slots;
+    size_t slot_count;
+    // Records of this scan, pushed by the workers
+    _Atomic(void *) records;
+    atomic_ulong record_count;
+    atomic_ulong reused;
+    atomic_ulong read;
+    // Directories changed since this are not trusted next time, their
+    // timestamps may not have moved yet
+    time_t started;
+} scan_index_t;
+
+// Loads the index of root. A missing or damaged one is started afresh.
+// NULL only without memory.
+scan_index_t *open_scan_index(const char *root);
+void destroy_scan_index(scan_index_t *index);
+// Writes the records collected since open_scan_index to disk, replacing
+// the old index at once so a crash never leaves half of one
+int save_scan_index(scan_index_t *index);
+
+int identify_directory(int fd, directory_identity_t *identity);
+// The stored listing of path, relative to the root, if the directory still
+// has the same identity. NULL if it has to be read.
+const index_record_t *find_unchanged_directory(scan_index_t *index, const char *path, unsigned int path_len, const directory_identity_t *identity);
+// Carries a listing found unchanged over into the index being built
+int keep_index_record(scan_index_t *index, const index_record_t *record);
+// Walks the entries of a record, offset starts at 0. 0 for every entry,
+// QUEUE_EMPTY after the last one.
+int next_indexed_entry(const index_record_t *record, size_t *offset, indexed_entry_t *entry);
+
+int init_index_builder(index_builder_t *builder);
+void destroy_index_builder(index_builder_t *builder);
+int begin_index_record(scan_index_t *index, index_builder_t *builder, const char *path, unsigned int path_len, const directory_identity_t *identity);
+// kind and, for files, size and mtime of stat are stored
+int add_index_entry(index_builder_t *builder, const char *name, unsigned int name_len, const entry_stat_t *stat);
+// Adds the finished listing to the index being built
+int commit_index_record(scan_index_t *index, index_builder_t *builder);
+
+#endif
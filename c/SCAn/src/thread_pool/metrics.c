@@ -0,0 +1,148 @@
+#include <stdlib.h>
+
+#include "metrics.h"
+
+worker_metrics_t *_create_metrics(int shared);
+void _destroy_metrics(worker_metrics_t *metrics);
+void _count_metric(const worker_metrics_t *metrics, atomic_ulong *counter, unsigned long n);
+void _record_histogram(const worker_metrics_t *metrics, histogram_t *histogram, long value_ns);
+void _merge_histogram(histogram_t *into, const histogram_t *from);
+void _summarize_histogram(const histogram_t *histogram, thread_pool_latency_t *summary);
+unsigned int _bucket_of(unsigned long value);
+unsigned long _bucket_upper_bound(unsigned int bucket);
+unsigned long _percentile(const histogram_t *histogram, unsigned long total, unsigned int permille);
+
+worker_metrics_t *_create_metrics(int shared)
+{
+    worker_metrics_t *metrics = calloc(1, sizeof(worker_metrics_t));
+    if (!metrics)
+    {
+        return NULL;
+    }
+    metrics->shared = shared;
+    return metrics;
+}
+
+void _destroy_metrics(worker_metrics_t *metrics)
+{
+    free(metrics);
+}
+
+void _count_metric(const worker_metrics_t *metrics, atomic_ulong *counter, unsigned long n)
+{
+    if (metrics->shared)
+    {
+        atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+        return;
+    }
+    // Only this thread writes, a load and a store avoid the locked add
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+unsigned int _bucket_of(unsigned long value)
+{
+    if (value < (1ul << HISTOGRAM_SUB_BITS))
+    {
+        return value;
+    }
+    unsigned int magnitude = 63 - __builtin_clzl(value);
+    if (magnitude >= HISTOGRAM_MAX_BITS)
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    unsigned int shift = magnitude - HISTOGRAM_SUB_BITS;
+    unsigned int sub_bucket = (value >> shift) & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + sub_bucket;
+}
+
+// Largest value that lands in bucket
+unsigned long _bucket_upper_bound(unsigned int bucket)
+{
+    if (bucket < (1u << HISTOGRAM_SUB_BITS))
+    {
+        return bucket;
+    }
+    unsigned int shift = (bucket >> HISTOGRAM_SUB_BITS) - 1;
+    unsigned long sub_bucket = bucket & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    unsigned long lower = ((1ul << HISTOGRAM_SUB_BITS) + sub_bucket) << shift;
+    return lower + (1ul << shift) - 1;
+}
+
+void _record_histogram(const worker_metrics_t *metrics, histogram_t *histogram, long value_ns)
+{
+    // Clocks of different CPUs may disagree by a little
+    unsigned long value = value_ns > 0 ? value_ns : 0;
+    _count_metric(metrics, &histogram->counts[_bucket_of(value)], 1);
+    _count_metric(metrics, &histogram->sum_ns, value);
+
+    unsigned long max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    while (value > max &&
+           !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max, value, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+void _merge_histogram(histogram_t *into, const histogram_t *from)
+{
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        unsigned long count = atomic_load_explicit(&from->counts[i], memory_order_relaxed);
+        if (count)
+        {
+            atomic_store_explicit(&into->counts[i], atomic_load_explicit(&into->counts[i], memory_order_relaxed) + count, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&into->sum_ns, atomic_load_explicit(&into->sum_ns, memory_order_relaxed) + atomic_load_explicit(&from->sum_ns, memory_order_relaxed), memory_order_relaxed);
+    unsigned long max = atomic_load_explicit(&from->max_ns, memory_order_relaxed);
+    if (max > atomic_load_explicit(&into->max_ns, memory_order_relaxed))
+    {
+        atomic_store_explicit(&into->max_ns, max, memory_order_relaxed);
+    }
+}
+
+// Upper bound of the bucket holding the value at permille of the way
+unsigned long _percentile(const histogram_t *histogram, unsigned long total, unsigned int permille)
+{
+    unsigned long rank = (total * permille + 999) / 1000;
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    unsigned long seen = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank)
+        {
+            return _bucket_upper_bound(i);
+        }
+    }
+    return _bucket_upper_bound(HISTOGRAM_BUCKETS - 1);
+}
+
+void _summarize_histogram(const histogram_t *histogram, thread_pool_latency_t *summary)
+{
+    unsigned long total = 0;
+    for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        total += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    }
+    summary->samples = total;
+    summary->max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    if (total == 0)
+    {
+        summary->mean_ns = summary->p50_ns = summary->p90_ns = summary->p99_ns = 0;
+        return;
+    }
+    summary->mean_ns = atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed) / total;
+    summary->p50_ns = _percentile(histogram, total, 500);
+    summary->p90_ns = _percentile(histogram, total, 900);
+    summary->p99_ns = _percentile(histogram, total, 990);
+    // A bucket bound may lie above anything recorded
+    if (summary->p50_ns > summary->max_ns)
+        summary->p50_ns = summary->max_ns;
+    if (summary->p90_ns > summary->max_ns)
+        summary->p90_ns = summary->max_ns;
+    if (summary->p99_ns > summary->max_ns)
+        summary->p99_ns = summary->max_ns;
+}
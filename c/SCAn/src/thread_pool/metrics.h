@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+
+#include "constants.h"
+#include "thread_pool.h"
+
+// Values below 2^HISTOGRAM_SUB_BITS get a bucket each, every power of two
+// above is split into 2^HISTOGRAM_SUB_BITS buckets, a relative error of at
+// most 1/16. Values from 2^HISTOGRAM_MAX_BITS ns, about 18 minutes, share
+// the last bucket.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+// Log bucketed nanoseconds. Counters are atomics so stats can be read while
+// workers record, a histogram with a single writer only needs plain stores.
+typedef struct histogram_t
+{
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong sum_ns;
+    atomic_ulong max_ns;
+} histogram_t;
+
+// Recorded by one worker slot, or shared by every thread outside of the pool
+typedef struct worker_metrics_t
+{
+    // Written by several threads, needs atomic increments
+    int shared;
+    atomic_ulong tasks_run;
+    atomic_ulong steals;
+    atomic_ulong idle_ns;
+    histogram_t queue_wait;
+    histogram_t run_time;
+} worker_metrics_t;
+
+worker_metrics_t *_create_metrics(int shared);
+void _destroy_metrics(worker_metrics_t *metrics);
+void _count_metric(const worker_metrics_t *metrics, atomic_ulong *counter, unsigned long n);
+void _record_histogram(const worker_metrics_t *metrics, histogram_t *histogram, long value_ns);
+// Adds the counts of from to into, which nobody else may record to
+void _merge_histogram(histogram_t *into, const histogram_t *from);
+void _summarize_histogram(const histogram_t *histogram, thread_pool_latency_t *summary);
+
+#endif
@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include "object_pool.h"
+
+object_pool_t *_create_object_pool();
+int _destroy_object_pool(object_pool_t *pool);
+object_cache_t *_create_object_cache();
+int _destroy_object_cache(object_pool_t *pool, object_cache_t *cache);
+void *_object_pool_alloc(object_pool_t *pool, object_cache_t *cache, size_t size);
+void _object_pool_free(object_pool_t *pool, object_cache_t *cache, void *ptr);
+
+size_t _object_class_size(int size_class)
+{
+    return (size_t)1 << (OBJECT_POOL_MIN_SHIFT + size_class);
+}
+
+int _object_size_class(size_t size)
+{
+    size_t total = size + OBJECT_POOL_HEADER_SIZE;
+    for (int size_class = 0; size_class < OBJECT_POOL_CLASSES; size_class++)
+    {
+        if (total <= _object_class_size(size_class))
+        {
+            return size_class;
+        }
+    }
+    return OBJECT_POOL_LARGE;
+}
+
+object_pool_t *_create_object_pool()
+{
+    object_pool_t *pool = malloc(sizeof(object_pool_t));
+    if (!pool)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < OBJECT_POOL_CLASSES; i++)
+    {
+        object_depot_t *depot = &pool->depots[i];
+        if (pthread_mutex_init(&depot->m_lock, NULL))
+        {
+            for (int j = 0; j < i; j++)
+            {
+                pthread_mutex_destroy(&pool->depots[j].m_lock);
+            }
+            free(pool);
+            return NULL;
+        }
+        depot->batches = NULL;
+        depot->loose = NULL;
+        depot->slabs = NULL;
+    }
+    return pool;
+}
+
+int _destroy_object_pool(object_pool_t *pool)
+{
+    if (!pool)
+    {
+        return ILLEGAL_ARGS;
+    }
+    for (int i = 0; i < OBJECT_POOL_CLASSES; i++)
+    {
+        object_depot_t *depot = &pool->depots[i];
+        object_slab_t *slab = depot->slabs;
+        while (slab)
+        {
+            object_slab_t *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+        pthread_mutex_destroy(&depot->m_lock);
+    }
+    free(pool);
+    return 0;
+}
+
+object_cache_t *_create_object_cache()
+{
+    return calloc(1, sizeof(object_cache_t));
+}
+
+// Depot lock has to be held
+int _carve_slab(object_depot_t *depot, int size_class)
+{
+    object_slab_t *slab = malloc(OBJECT_POOL_SLAB_SIZE);
+    if (!slab)
+    {
+        return MEMORY_ERROR;
+    }
+    slab->next = depot->slabs;
+    depot->slabs = slab;
+
+    // Blocks start after a header sized gap to keep the slab pointer intact
+    // and payloads 16 byte aligned
+    size_t block_size = _object_class_size(size_class);
+    char *start = (char *)slab + OBJECT_POOL_HEADER_SIZE;
+    size_t count = (OBJECT_POOL_SLAB_SIZE - OBJECT_POOL_HEADER_SIZE) / block_size;
+    for (size_t i = count; i > 0; i--)
+    {
+        object_block_t *block = (object_block_t *)(start + (i - 1) * block_size);
+        block->next = depot->loose;
+        depot->loose = block;
+    }
+    return 0;
+}
+
+// Depot lock has to be held. Hands out a whole batch if the caller can take
+// one, otherwise up to max single blocks.
+object_block_t *_take_from_depot(object_depot_t *depot, int size_class, unsigned int max, unsigned int *taken)
+{
+    *taken = 0;
+    if (depot->batches && max >= OBJECT_POOL_BATCH)
+    {
+        object_block_t *batch = depot->batches;
+        depot->batches = batch->next_batch;
+        *taken = OBJECT_POOL_BATCH;
+        return batch;
+    }
+    if (!depot->loose)
+    {
+        if (depot->batches)
+        {
+            depot->loose = depot->batches;
+            depot->batches = depot->batches->next_batch;
+        }
+        else if (_carve_slab(depot, size_class))
+        {
+            return NULL;
+        }
+    }
+
+    object_block_t *first = depot->loose;
+    object_block_t *last = first;
+    *taken = 1;
+    while (*taken < max && last->next)
+    {
+        last = last->next;
+        (*taken)++;
+    }
+    depot->loose = last->next;
+    last->next = NULL;
+    return first;
+}
+
+void *_object_pool_alloc(object_pool_t *pool, object_cache_t *cache, size_t size)
+{
+    int size_class = _object_size_class(size);
+    if (!pool || size_class == OBJECT_POOL_LARGE)
+    {
+        char *large = malloc(size + OBJECT_POOL_HEADER_SIZE);
+        if (!large)
+        {
+            return NULL;
+        }
+        *(unsigned int *)large = OBJECT_POOL_LARGE;
+        return large + OBJECT_POOL_HEADER_SIZE;
+    }
+
+    object_depot_t *depot = &pool->depots[size_class];
+    object_block_t *block;
+    if (!cache)
+    {
+        unsigned int taken;
+        pthread_mutex_lock(&depot->m_lock);
+        block = _take_from_depot(depot, size_class, 1, &taken);
+        pthread_mutex_unlock(&depot->m_lock);
+    }
+    else
+    {
+        object_class_cache_t *local = &cache->classes[size_class];
+        if (!local->head)
+        {
+            pthread_mutex_lock(&depot->m_lock);
+            local->head = _take_from_depot(depot, size_class, OBJECT_POOL_BATCH, &local->count);
+            pthread_mutex_unlock(&depot->m_lock);
+        }
+        block = local->head;
+        if (block)
+        {
+            local->head = block->next;
+            local->count--;
+        }
+    }
+
+    if (!block)
+    {
+        return NULL;
+    }
+    *(unsigned int *)block = size_class;
+    return (char *)block + OBJECT_POOL_HEADER_SIZE;
+}
+
+void _object_pool_free(object_pool_t *pool, object_cache_t *cache, void *ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+    object_block_t *block = (object_block_t *)((char *)ptr - OBJECT_POOL_HEADER_SIZE);
+    unsigned int size_class = *(unsigned int *)block;
+    if (!pool || size_class == OBJECT_POOL_LARGE)
+    {
+        free(block);
+        return;
+    }
+
+    object_depot_t *depot = &pool->depots[size_class];
+    if (!cache)
+    {
+        pthread_mutex_lock(&depot->m_lock);
+        block->next = depot->loose;
+        depot->loose = block;
+        pthread_mutex_unlock(&depot->m_lock);
+        return;
+    }
+
+    object_class_cache_t *local = &cache->classes[size_class];
+    block->next = local->head;
+    local->head = block;
+    local->count++;
+    if (local->count < 2 * OBJECT_POOL_BATCH)
+    {
+        return;
+    }
+
+    // A consumer keeps freeing what a producer allocated, pass a batch back
+    object_block_t *first = local->head;
+    object_block_t *last = first;
+    for (int i = 1; i < OBJECT_POOL_BATCH; i++)
+    {
+        last = last->next;
+    }
+    local->head = last->next;
+    local->count -= OBJECT_POOL_BATCH;
+    last->next = NULL;
+
+    pthread_mutex_lock(&depot->m_lock);
+    first->next_batch = depot->batches;
+    depot->batches = first;
+    pthread_mutex_unlock(&depot->m_lock);
+}
+
+int _destroy_object_cache(object_pool_t *pool, object_cache_t *cache)
+{
+    if (!pool || !cache)
+    {
+        return ILLEGAL_ARGS;
+    }
+    for (int i = 0; i < OBJECT_POOL_CLASSES; i++)
+    {
+        object_class_cache_t *local = &cache->classes[i];
+        if (!local->head)
+        {
+            continue;
+        }
+        object_block_t *last = local->head;
+        while (last->next)
+        {
+            last = last->next;
+        }
+        object_depot_t *depot = &pool->depots[i];
+        pthread_mutex_lock(&depot->m_lock);
+        last->next = depot->loose;
+        depot->loose = local->head;
+        pthread_mutex_unlock(&depot->m_lock);
+    }
+    free(cache);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include "constants.h"
+
+// Size classes are powers of two from 32 to 1024 bytes, header included
+#define OBJECT_POOL_MIN_SHIFT 5
+#define OBJECT_POOL_CLASSES 6
+#define OBJECT_POOL_LARGE OBJECT_POOL_CLASSES
+#define OBJECT_POOL_HEADER_SIZE 16
+
+// Blocks move between a worker cache and the shared depot in batches of this size
+#define OBJECT_POOL_BATCH 32
+#define OBJECT_POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct object_block_t object_block_t;
+
+struct object_block_t
+{
+    object_block_t *next;
+    object_block_t *next_batch;
+};
+
+typedef struct object_slab_t object_slab_t;
+
+struct object_slab_t
+{
+    object_slab_t *next;
+};
+
+typedef struct object_depot_t
+{
+    pthread_mutex_t m_lock;
+    object_block_t *batches;
+    object_block_t *loose;
+    object_slab_t *slabs;
+} object_depot_t;
+
+typedef struct object_class_cache_t
+{
+    object_block_t *head;
+    unsigned int count;
+} object_class_cache_t;
+
+/*
+ * Per worker freelists, only ever touched by the owning thread. Blocks freed
+ * here may come from any other thread, the surplus is handed back to the
+ * depot a whole batch at a time.
+ */
+typedef struct object_cache_t
+{
+    object_class_cache_t classes[OBJECT_POOL_CLASSES];
+} object_cache_t;
+
+typedef struct object_pool_t
+{
+    object_depot_t depots[OBJECT_POOL_CLASSES];
+} object_pool_t;
+
+object_pool_t *_create_object_pool();
+int _destroy_object_pool(object_pool_t *pool);
+object_cache_t *_create_object_cache();
+int _destroy_object_cache(object_pool_t *pool, object_cache_t *cache);
+void *_object_pool_alloc(object_pool_t *pool, object_cache_t *cache, size_t size);
+void _object_pool_free(object_pool_t *pool, object_cache_t *cache, void *ptr);
+
+#endif
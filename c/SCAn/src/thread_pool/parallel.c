@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "parallel.h"
+#include "constants.h"
+
+// Automatic grain aims for this many chunks per worker, enough for stealing
+// to even out uneven chunks
+#define PARALLEL_CHUNKS_PER_WORKER 8
+// Automatic list chunks start small so short lists still spread out, and
+// double up to the maximum so long ones don't turn into a task per node
+#define PARALLEL_LIST_MIN_GRAIN 4
+#define PARALLEL_LIST_MAX_GRAIN 1024
+// Partials get their own cache lines, workers update them constantly
+#define PARALLEL_PARTIAL_ALIGN 64
+
+typedef struct parallel_job_t
+{
+    thread_pool_t *pool;
+    void *context;
+    size_t grain;
+
+    parallel_range_body_t range_body;
+    parallel_node_body_t node_body;
+    size_t next_offset;
+
+    // One accumulator per task slot, NULL for parallel_for
+    char *partials;
+    size_t partial_stride;
+    unsigned int slots;
+    // All threads outside of the pool share the last slot
+    pthread_mutex_t m_outside;
+
+    // Items not processed yet
+    atomic_size_t remaining;
+    // Set under m_done by whoever finishes the last item. The job lives on
+    // the caller's stack, so the caller only returns once it sees this,
+    // remaining alone would let it go while the finisher still holds m_done.
+    int done;
+    pthread_mutex_t m_done;
+    pthread_cond_t c_done;
+} parallel_job_t;
+
+typedef struct parallel_chunk_t
+{
+    parallel_job_t *job;
+    size_t begin;
+    size_t end;
+    // Lists only, chunk covers count nodes starting at node
+    void *node;
+} parallel_chunk_t;
+
+int parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain, parallel_range_body_t body, void *context);
+int parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain, parallel_range_body_t body,
+                    size_t partial_size, parallel_init_t init, parallel_merge_t merge, void *result, void *context);
+int parallel_for_list(thread_pool_t *pool, void *first, size_t next_offset, size_t grain, parallel_node_body_t body, void *context);
+int parallel_reduce_list(thread_pool_t *pool, void *first, size_t next_offset, size_t grain, parallel_node_body_t body,
+                         size_t partial_size, parallel_init_t init, parallel_merge_t merge, void *result, void *context);
+
+int _init_parallel_job(parallel_job_t *job, thread_pool_t *pool, size_t partial_size, parallel_init_t init, void *context)
+{
+    memset(job, 0, sizeof(parallel_job_t));
+    job->pool = pool;
+    job->context = context;
+    job->slots = thread_pool_slots(pool);
+    atomic_init(&job->remaining, 0);
+
+    if (partial_size)
+    {
+        job->partial_stride = (partial_size + PARALLEL_PARTIAL_ALIGN - 1) & ~(size_t)(PARALLEL_PARTIAL_ALIGN - 1);
+        job->partials = aligned_alloc(PARALLEL_PARTIAL_ALIGN, job->slots * job->partial_stride);
+        if (!job->partials)
+        {
+            return MEMORY_ERROR;
+        }
+        for (unsigned int i = 0; i < job->slots; i++)
+        {
+            init(job->partials + i * job->partial_stride, context);
+        }
+    }
+
+    if (pthread_mutex_init(&job->m_outside, NULL))
+    {
+        free(job->partials);
+        return FATAL_ERROR;
+    }
+    if (pthread_mutex_init(&job->m_done, NULL) || pthread_cond_init(&job->c_done, NULL))
+    {
+        pthread_mutex_destroy(&job->m_outside);
+        free(job->partials);
+        return FATAL_ERROR;
+    }
+    return 0;
+}
+
+void _destroy_parallel_job(parallel_job_t *job)
+{
+    pthread_cond_destroy(&job->c_done);
+    pthread_mutex_destroy(&job->m_done);
+    pthread_mutex_destroy(&job->m_outside);
+    free(job->partials);
+}
+
+void _finish_parallel_items(parallel_job_t *job, size_t n)
+{
+    if (atomic_fetch_sub(&job->remaining, n) != n)
+    {
+        return;
+    }
+    pthread_mutex_lock(&job->m_done);
+    job->done = 1;
+    pthread_cond_broadcast(&job->c_done);
+    pthread_mutex_unlock(&job->m_done);
+}
+
+// Helps with queued tasks until every item of the job is done, then merges
+void _wait_parallel_job(parallel_job_t *job, parallel_merge_t merge, void *result)
+{
+    while (atomic_load(&job->remaining) > 0 && run_pending_task(job->pool) == 0)
+    {
+    }
+    // Nothing left to pick up, the rest may still run on other threads and
+    // the last finisher may still be on its way out of m_done
+    pthread_mutex_lock(&job->m_done);
+    while (!job->done)
+    {
+        pthread_cond_wait(&job->c_done, &job->m_done);
+    }
+    pthread_mutex_unlock(&job->m_done);
+
+    if (job->partials)
+    {
+        for (unsigned int i = 0; i < job->slots; i++)
+        {
+            merge(result, job->partials + i * job->partial_stride, job->context);
+        }
+    }
+}
+
+// Accumulator of the task slot id. The slot shared by outside threads stays
+// locked until _unlock_parallel_partial.
+void *_lock_parallel_partial(parallel_job_t *job, unsigned int id)
+{
+    if (!job->partials)
+    {
+        return NULL;
+    }
+    if (id >= job->slots - 1)
+    {
+        id = job->slots - 1;
+        pthread_mutex_lock(&job->m_outside);
+    }
+    return job->partials + id * job->partial_stride;
+}
+
+void _unlock_parallel_partial(parallel_job_t *job, unsigned int id)
+{
+    if (job->partials && id >= job->slots - 1)
+    {
+        pthread_mutex_unlock(&job->m_outside);
+    }
+}
+
+int _run_range_chunk(task_queue_entry_arg_t *task_arg);
+
+int _split_range_chunk(parallel_job_t *job, size_t mid, size_t end)
+{
+    task_queue_entry_arg_t *arg = alloc_task_arg(job->pool, sizeof(parallel_chunk_t));
+    if (!arg)
+    {
+        return MEMORY_ERROR;
+    }
+    parallel_chunk_t *chunk = arg->arg;
+    chunk->job = job;
+    chunk->begin = mid;
+    chunk->end = end;
+    chunk->node = NULL;
+    int err = enqueue_task(job->pool, _run_range_chunk, arg);
+    if (err)
+    {
+        free_task_arg(job->pool, arg);
+    }
+    return err;
+}
+
+void _process_range(parallel_job_t *job, unsigned int id, size_t begin, size_t end)
+{
+    // Hand off the upper halves until the rest fits into one grain, those
+    // are the chunks other workers steal first
+    while (end - begin > job->grain)
+    {
+        size_t mid = begin + (end - begin) / 2;
+        if (_split_range_chunk(job, mid, end))
+        {
+            break;
+        }
+        end = mid;
+    }
+
+    void *partial = _lock_parallel_partial(job, id);
+    job->range_body(begin, end, partial, job->context);
+    _unlock_parallel_partial(job, id);
+    _finish_parallel_items(job, end - begin);
+}
+
+int _run_range_chunk(task_queue_entry_arg_t *task_arg)
+{
+    parallel_chunk_t *chunk = task_arg->arg;
+    parallel_job_t *job = chunk->job;
+    set_task_label(job->pool, "parallel range");
+    size_t begin = chunk->begin;
+    size_t end = chunk->end;
+    unsigned int id = (unsigned int)task_arg->id;
+    free_task_arg(job->pool, task_arg);
+
+    _process_range(job, id, begin, end);
+    return 0;
+}
+
+size_t _auto_range_grain(thread_pool_t *pool, size_t items)
+{
+    thread_pool_stats_t stats;
+    unsigned int workers = thread_pool_stats(pool, &stats) == 0 && stats.workers > 0 ? stats.workers : 1;
+    size_t grain = items / ((size_t)workers * PARALLEL_CHUNKS_PER_WORKER);
+    return grain > 0 ? grain : 1;
+}
+
+int parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain, parallel_range_body_t body,
+                    size_t partial_size, parallel_init_t init, parallel_merge_t merge, void *result, void *context)
+{
+    if (!pool || !body || begin > end || (partial_size && (!init || !merge || !result)))
+        return ILLEGAL_ARGS;
+    if (begin == end)
+    {
+        if (partial_size)
+            init(result, context);
+        return 0;
+    }
+
+    parallel_job_t job;
+    int err = _init_parallel_job(&job, pool, partial_size, init, context);
+    if (err)
+        return err;
+    job.range_body = body;
+    job.grain = grain != PARALLEL_AUTO_GRAIN ? grain : _auto_range_grain(pool, end - begin);
+    atomic_store(&job.remaining, end - begin);
+
+    // The caller works on the lower half itself instead of just waiting
+    _process_range(&job, thread_pool_current_slot(pool), begin, end);
+
+    if (partial_size)
+        init(result, context);
+    _wait_parallel_job(&job, merge, result);
+    _destroy_parallel_job(&job);
+    return 0;
+}
+
+int parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain, parallel_range_body_t body, void *context)
+{
+    return parallel_reduce(pool, begin, end, grain, body, 0, NULL, NULL, NULL, context);
+}
+
+void *_next_parallel_node(parallel_job_t *job, void *node)
+{
+    return *(void **)((char *)node + job->next_offset);
+}
+
+void _process_list(parallel_job_t *job, unsigned int id, void *node, size_t count)
+{
+    void *partial = _lock_parallel_partial(job, id);
+    for (size_t i = 0; i < count; i++)
+    {
+        void *next = _next_parallel_node(job, node);
+        job->node_body(node, partial, job->context);
+        node = next;
+    }
+    _unlock_parallel_partial(job, id);
+    _finish_parallel_items(job, count);
+}
+
+int _run_list_chunk(task_queue_entry_arg_t *task_arg)
+{
+    parallel_chunk_t *chunk = task_arg->arg;
+    parallel_job_t *job = chunk->job;
+    set_task_label(job->pool, "parallel list");
+    void *node = chunk->node;
+    size_t count = chunk->end;
+    unsigned int id = (unsigned int)task_arg->id;
+    free_task_arg(job->pool, task_arg);
+
+    _process_list(job, id, node, count);
+    return 0;
+}
+
+int parallel_reduce_list(thread_pool_t *pool, void *first, size_t next_offset, size_t grain, parallel_node_body_t body,
+                         size_t partial_size, parallel_init_t init, parallel_merge_t merge, void *result, void *context)
+{
+    if (!pool || !body || (partial_size && (!init || !merge || !result)))
+        return ILLEGAL_ARGS;
+
+    parallel_job_t job;
+    int err = _init_parallel_job(&job, pool, partial_size, init, context);
+    if (err)
+        return err;
+    job.node_body = body;
+    job.next_offset = next_offset;
+
+    // The walk holds one item until it's done, so the count can't reach 0
+    // while chunks are still being handed out
+    atomic_store(&job.remaining, 1);
+    size_t chunk_size = grain != PARALLEL_AUTO_GRAIN ? grain : PARALLEL_LIST_MIN_GRAIN;
+    void *node = first;
+    while (node)
+    {
+        void *chunk_first = node;
+        size_t count = 0;
+        while (node && count < chunk_size)
+        {
+            node = _next_parallel_node(&job, node);
+            count++;
+        }
+
+        atomic_fetch_add(&job.remaining, count);
+        task_queue_entry_arg_t *arg = alloc_task_arg(pool, sizeof(parallel_chunk_t));
+        if (arg)
+        {
+            parallel_chunk_t *chunk = arg->arg;
+            chunk->job = &job;
+            chunk->begin = 0;
+            chunk->end = count;
+            chunk->node = chunk_first;
+            err = enqueue_task(pool, _run_list_chunk, arg);
+            if (err)
+            {
+                free_task_arg(pool, arg);
+            }
+        }
+        if (!arg || err)
+        {
+            // Couldn't hand it out, run it right here
+            _process_list(&job, thread_pool_current_slot(pool), chunk_first, count);
+            err = 0;
+        }
+
+        if (grain == PARALLEL_AUTO_GRAIN && chunk_size < PARALLEL_LIST_MAX_GRAIN)
+        {
+            chunk_size *= 2;
+        }
+    }
+    _finish_parallel_items(&job, 1);
+
+    if (partial_size)
+        init(result, context);
+    _wait_parallel_job(&job, merge, result);
+    _destroy_parallel_job(&job);
+    return 0;
+}
+
+int parallel_for_list(thread_pool_t *pool, void *first, size_t next_offset, size_t grain, parallel_node_body_t body, void *context)
+{
+    return parallel_reduce_list(pool, first, next_offset, grain, body, 0, NULL, NULL, NULL, context);
+}
@@ -0,0 +1,38 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+
+#include "thread_pool.h"
+
+// grain 0 picks a chunk size from the amount of work and the pool size
+#define PARALLEL_AUTO_GRAIN 0
+
+// Called for [begin, end). partial is the calling worker's accumulator, NULL
+// for parallel_for
+typedef void (*parallel_range_body_t)(size_t begin, size_t end, void *partial, void *context);
+// Called once per list node
+typedef void (*parallel_node_body_t)(void *node, void *partial, void *context);
+// Sets up an empty accumulator, both for the partials and the result
+typedef void (*parallel_init_t)(void *partial, void *context);
+// Folds a finished partial into the result, runs on the calling thread
+typedef void (*parallel_merge_t)(void *result, const void *partial, void *context);
+
+/*
+ * The calls below return once every chunk has run. The calling thread runs
+ * queued tasks while it waits, so they may be used from within a task as
+ * well. Chunks are split in halves down to the grain size, idle workers steal
+ * the larger halves.
+ */
+int parallel_for(thread_pool_t *pool, size_t begin, size_t end, size_t grain, parallel_range_body_t body, void *context);
+int parallel_reduce(thread_pool_t *pool, size_t begin, size_t end, size_t grain, parallel_range_body_t body,
+                    size_t partial_size, parallel_init_t init, parallel_merge_t merge, void *result, void *context);
+
+// Lists are linked through a pointer at next_offset in every node. They are
+// walked once on the calling thread and handed out in chunks of grain nodes,
+// with PARALLEL_AUTO_GRAIN the chunks grow as the walk goes on.
+int parallel_for_list(thread_pool_t *pool, void *first, size_t next_offset, size_t grain, parallel_node_body_t body, void *context);
+int parallel_reduce_list(thread_pool_t *pool, void *first, size_t next_offset, size_t grain, parallel_node_body_t body,
+                         size_t partial_size, parallel_init_t init, parallel_merge_t merge, void *result, void *context);
+
+#endif
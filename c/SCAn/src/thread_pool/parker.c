@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <time.h>
+#include "parker.h"
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+int _init_parker(parker_t *parker);
+void _destroy_parker(parker_t *parker);
+void _arm_parker(parker_t *parker);
+int _park(parker_t *parker, long deadline_ns);
+void _unpark(parker_t *parker);
+void _cpu_relax();
+int _init_monotonic_cond(pthread_cond_t *cond);
+int _monotonic_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, long deadline_ns);
+
+#define PARKER_ARMED 0
+#define PARKER_SIGNALED 1
+
+int _init_parker(parker_t *parker)
+{
+    if (!parker)
+    {
+        return ILLEGAL_ARGS;
+    }
+    atomic_init(&parker->state, PARKER_SIGNALED);
+#ifndef __linux__
+    if (_init_monotonic_cond(&parker->c_wake))
+    {
+        return FATAL_ERROR;
+    }
+    if (pthread_mutex_init(&parker->m_lock, NULL))
+    {
+        pthread_cond_destroy(&parker->c_wake);
+        return FATAL_ERROR;
+    }
+#endif
+    return 0;
+}
+
+void _destroy_parker(parker_t *parker)
+{
+#ifdef __linux__
+    (void)parker;
+#else
+    pthread_cond_destroy(&parker->c_wake);
+    pthread_mutex_destroy(&parker->m_lock);
+#endif
+}
+
+// Has to be called before the thread announces itself as parked, an unpark
+// arriving between the two makes the following _park return at once
+void _arm_parker(parker_t *parker)
+{
+    atomic_store(&parker->state, PARKER_ARMED);
+}
+
+// Sleeps until unparked or, with deadline_ns > 0, until CLOCK_MONOTONIC
+// reaches the deadline
+int _park(parker_t *parker, long deadline_ns)
+{
+#ifdef __linux__
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000L,
+        .tv_nsec = deadline_ns % 1000000000L,
+    };
+    while (atomic_load(&parker->state) == PARKER_ARMED)
+    {
+        // The bitset variant takes an absolute CLOCK_MONOTONIC deadline
+        long err = syscall(SYS_futex, &parker->state, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+                           PARKER_ARMED, deadline_ns > 0 ? &deadline : NULL, NULL, FUTEX_BITSET_MATCH_ANY);
+        if (err == -1 && errno == ETIMEDOUT)
+        {
+            return atomic_load(&parker->state) == PARKER_ARMED ? PARKER_TIMED_OUT : 0;
+        }
+    }
+    return 0;
+#else
+    int timed_out = 0;
+    pthread_mutex_lock(&parker->m_lock);
+    while (atomic_load(&parker->state) == PARKER_ARMED && !timed_out)
+    {
+        if (deadline_ns > 0)
+            timed_out = _monotonic_timedwait(&parker->c_wake, &parker->m_lock, deadline_ns) == ETIMEDOUT;
+        else
+            pthread_cond_wait(&parker->c_wake, &parker->m_lock);
+    }
+    timed_out = atomic_load(&parker->state) == PARKER_ARMED;
+    pthread_mutex_unlock(&parker->m_lock);
+    return timed_out ? PARKER_TIMED_OUT : 0;
+#endif
+}
+
+void _unpark(parker_t *parker)
+{
+#ifdef __linux__
+    if (atomic_exchange(&parker->state, PARKER_SIGNALED) == PARKER_ARMED)
+    {
+        syscall(SYS_futex, &parker->state, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, 1, NULL, NULL, 0);
+    }
+#else
+    pthread_mutex_lock(&parker->m_lock);
+    atomic_store(&parker->state, PARKER_SIGNALED);
+    pthread_cond_signal(&parker->c_wake);
+    pthread_mutex_unlock(&parker->m_lock);
+#endif
+}
+
+void _cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+int _init_monotonic_cond(pthread_cond_t *cond)
+{
+#ifdef __APPLE__
+    return pthread_cond_init(cond, NULL) ? FATAL_ERROR : 0;
+#else
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr))
+        return FATAL_ERROR;
+    int err = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) || pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return err ? FATAL_ERROR : 0;
+#endif
+}
+
+int _monotonic_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, long deadline_ns)
+{
+#ifdef __APPLE__
+    // The wall clock may be stepped while waiting, which moves the wakeup.
+    // Every caller checks its condition again afterwards.
+    struct timespec monotonic, realtime;
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    deadline_ns += (realtime.tv_sec - monotonic.tv_sec) * 1000000000L + (realtime.tv_nsec - monotonic.tv_nsec);
+#endif
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000L,
+        .tv_nsec = deadline_ns % 1000000000L,
+    };
+    return pthread_cond_timedwait(cond, mutex, &deadline);
+}
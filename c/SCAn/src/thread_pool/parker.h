@@ -0,0 +1,38 @@
+#ifndef PARKER_H
+#define PARKER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "constants.h"
+
+#define PARKER_TIMED_OUT 1
+
+/*
+ * One-shot wake signal for a single sleeping thread. On Linux this is a
+ * futex on the state word, elsewhere a private mutex and condvar. Only the
+ * owning thread parks, any thread may unpark it.
+ */
+typedef struct parker_t
+{
+    atomic_int state;
+#ifndef __linux__
+    pthread_mutex_t m_lock;
+    pthread_cond_t c_wake;
+#endif
+} parker_t;
+
+int _init_parker(parker_t *parker);
+void _destroy_parker(parker_t *parker);
+void _arm_parker(parker_t *parker);
+int _park(parker_t *parker, long deadline_ns);
+void _unpark(parker_t *parker);
+void _cpu_relax();
+
+// Condvars whose waits end at a CLOCK_MONOTONIC deadline in nanoseconds.
+// macOS has no pthread_condattr_setclock, there the deadline is moved over
+// to CLOCK_REALTIME right before each wait.
+int _init_monotonic_cond(pthread_cond_t *cond);
+int _monotonic_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, long deadline_ns);
+
+#endif
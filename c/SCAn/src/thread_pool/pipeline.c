@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pipeline.h"
+#include "logger.h"
+#include "constants.h"
+
+typedef struct pipeline_batch_t
+{
+    pipeline_t *pipeline;
+    unsigned int stage;
+    unsigned int count;
+    void *items[];
+} pipeline_batch_t;
+
+typedef struct pipeline_stage_t
+{
+    char *name;
+    pipeline_stage_func_t func;
+    thread_pool_t *pool;
+
+    atomic_ulong items;
+    atomic_ulong batches;
+    atomic_ulong queued;
+    atomic_ulong peak_queued;
+    atomic_ulong blocked_ns;
+
+    // Filled by threads outside of the pipeline, guarded by m_outside
+    task_queue_entry_arg_t *outside_batch;
+} pipeline_stage_t;
+
+typedef struct pipeline_t
+{
+    unsigned int stage_count;
+    unsigned int batch_size;
+    pipeline_stage_t stages[PIPELINE_MAX_STAGES];
+    pthread_mutex_t m_outside;
+} pipeline_t;
+
+// Batches a stage function emits into, one per stage it may emit to
+typedef struct pipeline_emitter_t
+{
+    pipeline_t *pipeline;
+    unsigned int stage;
+    task_queue_entry_arg_t *batches[PIPELINE_MAX_STAGES];
+} pipeline_emitter_t;
+
+// Emitter of the stage function running on this thread, NULL elsewhere
+static __thread pipeline_emitter_t *current_emitter = NULL;
+
+pipeline_t *create_pipeline(unsigned int stage_count, const pipeline_stage_options_t *stages, unsigned int batch_size);
+void destroy_pipeline(pipeline_t *pipeline);
+int pipeline_emit(pipeline_t *pipeline, unsigned int stage, void *item);
+int pipeline_finish(pipeline_t *pipeline);
+int pipeline_stage_stats(pipeline_t *pipeline, unsigned int stage, pipeline_stage_stats_t *stats);
+int _run_pipeline_batch(task_queue_entry_arg_t *task_arg);
+
+long _pipeline_clock_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+task_queue_entry_arg_t *_create_pipeline_batch(pipeline_t *pipeline, unsigned int stage)
+{
+    task_queue_entry_arg_t *arg = alloc_task_arg(pipeline->stages[stage].pool, sizeof(pipeline_batch_t) + pipeline->batch_size * sizeof(void *));
+    if (!arg)
+    {
+        return NULL;
+    }
+    pipeline_batch_t *batch = arg->arg;
+    batch->pipeline = pipeline;
+    batch->stage = stage;
+    batch->count = 0;
+    return arg;
+}
+
+// Hands a batch to its stage, waiting for room if the stage is full
+int _submit_pipeline_batch(pipeline_t *pipeline, task_queue_entry_arg_t *arg)
+{
+    pipeline_batch_t *batch = arg->arg;
+    pipeline_stage_t *stage = &pipeline->stages[batch->stage];
+    if (batch->count == 0)
+    {
+        free_task_arg(stage->pool, arg);
+        return 0;
+    }
+
+    unsigned long queued = atomic_fetch_add(&stage->queued, batch->count) + batch->count;
+    unsigned long peak = atomic_load_explicit(&stage->peak_queued, memory_order_relaxed);
+    while (queued > peak &&
+           !atomic_compare_exchange_weak_explicit(&stage->peak_queued, &peak, queued, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+
+    unsigned int count = batch->count;
+    long begin = _pipeline_clock_ns();
+    int err = enqueue_task(stage->pool, _run_pipeline_batch, arg);
+    atomic_fetch_add_explicit(&stage->blocked_ns, _pipeline_clock_ns() - begin, memory_order_relaxed);
+    if (err)
+    {
+        atomic_fetch_sub(&stage->queued, count);
+        log_error("Pipeline stage %s refused a batch of %u items: %d\n", stage->name, count, err);
+        free_task_arg(stage->pool, arg);
+    }
+    return err;
+}
+
+// Appends item to *slot, sending the batch on once it is full
+int _append_pipeline_item(pipeline_t *pipeline, unsigned int stage, task_queue_entry_arg_t **slot, void *item)
+{
+    if (!*slot)
+    {
+        *slot = _create_pipeline_batch(pipeline, stage);
+        if (!*slot)
+        {
+            return MEMORY_ERROR;
+        }
+    }
+    pipeline_batch_t *batch = (*slot)->arg;
+    batch->items[batch->count++] = item;
+    if (batch->count < pipeline->batch_size)
+    {
+        return 0;
+    }
+    task_queue_entry_arg_t *full = *slot;
+    *slot = NULL;
+    return _submit_pipeline_batch(pipeline, full);
+}
+
+// Sends on every batch the emitter collected
+int _flush_pipeline_emitter(pipeline_emitter_t *emitter)
+{
+    int err = 0;
+    for (unsigned int i = emitter->stage; i < emitter->pipeline->stage_count; i++)
+    {
+        if (emitter->batches[i])
+        {
+            int batch_err = _submit_pipeline_batch(emitter->pipeline, emitter->batches[i]);
+            emitter->batches[i] = NULL;
+            if (batch_err)
+                err = batch_err;
+        }
+    }
+    return err;
+}
+
+int _run_pipeline_batch(task_queue_entry_arg_t *task_arg)
+{
+    pipeline_batch_t *batch = task_arg->arg;
+    pipeline_t *pipeline = batch->pipeline;
+    pipeline_stage_t *stage = &pipeline->stages[batch->stage];
+    atomic_fetch_sub(&stage->queued, batch->count);
+    atomic_fetch_add_explicit(&stage->items, batch->count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stage->batches, 1, memory_order_relaxed);
+
+    // A full stage may run a batch inline inside another one
+    pipeline_emitter_t emitter;
+    memset(&emitter, 0, sizeof(pipeline_emitter_t));
+    emitter.pipeline = pipeline;
+    emitter.stage = batch->stage;
+    pipeline_emitter_t *outer_emitter = current_emitter;
+    current_emitter = &emitter;
+
+    int err = stage->func(pipeline, batch->items, batch->count, task_arg->context);
+
+    current_emitter = outer_emitter;
+    int flush_err = _flush_pipeline_emitter(&emitter);
+    free_task_arg(stage->pool, task_arg);
+    return err ? err : flush_err;
+}
+
+pipeline_t *create_pipeline(unsigned int stage_count, const pipeline_stage_options_t *stages, unsigned int batch_size)
+{
+    if (stage_count == 0 || stage_count > PIPELINE_MAX_STAGES || !stages)
+    {
+        return NULL;
+    }
+    for (unsigned int i = 0; i < stage_count; i++)
+    {
+        if (!stages[i].func || stages[i].workers == 0)
+        {
+            return NULL;
+        }
+    }
+
+    pipeline_t *pipeline = calloc(1, sizeof(pipeline_t));
+    if (!pipeline)
+    {
+        return NULL;
+    }
+    if (pthread_mutex_init(&pipeline->m_outside, NULL))
+    {
+        free(pipeline);
+        return NULL;
+    }
+    pipeline->batch_size = batch_size ? batch_size : PIPELINE_DEFAULT_BATCH;
+
+    for (unsigned int i = 0; i < stage_count; i++)
+    {
+        pipeline_stage_t *stage = &pipeline->stages[i];
+        // Stage workers submitting into a stage are outside of its pool, so
+        // they wait for room. Batches a stage emits into itself run inline.
+        thread_pool_options_t options = {
+            .thread_count = stages[i].workers,
+            .queue_backend = TASK_QUEUE_LOCKED,
+            .max_pending = stages[i].queue_batches,
+            .full_policy = THREAD_POOL_FULL_BLOCK,
+            .worker_init = stages[i].worker_init,
+            .worker_teardown = stages[i].worker_teardown,
+            .worker_user_data = stages[i].worker_user_data,
+        };
+        thread_pool_creation_status_t status;
+        stage->pool = create_thread_pool_with_options(&options, &status);
+        stage->name = strdup(stages[i].name ? stages[i].name : "stage");
+        stage->func = stages[i].func;
+        atomic_init(&stage->items, 0);
+        atomic_init(&stage->batches, 0);
+        atomic_init(&stage->queued, 0);
+        atomic_init(&stage->peak_queued, 0);
+        atomic_init(&stage->blocked_ns, 0);
+        pipeline->stage_count = i + 1;
+        if (status != CREATED || !stage->name)
+        {
+            destroy_pipeline(pipeline);
+            return NULL;
+        }
+    }
+    return pipeline;
+}
+
+void destroy_pipeline(pipeline_t *pipeline)
+{
+    if (!pipeline)
+    {
+        return;
+    }
+    for (unsigned int i = 0; i < pipeline->stage_count; i++)
+    {
+        pipeline_stage_t *stage = &pipeline->stages[i];
+        if (stage->outside_batch)
+        {
+            free_task_arg(stage->pool, stage->outside_batch);
+        }
+        if (stage->pool)
+        {
+            shutdown_pool(stage->pool);
+        }
+        free(stage->name);
+    }
+    pthread_mutex_destroy(&pipeline->m_outside);
+    free(pipeline);
+}
+
+int pipeline_emit(pipeline_t *pipeline, unsigned int stage, void *item)
+{
+    if (!pipeline || stage >= pipeline->stage_count)
+    {
+        return ILLEGAL_ARGS;
+    }
+
+    pipeline_emitter_t *emitter = current_emitter;
+    if (emitter && emitter->pipeline == pipeline)
+    {
+        // Going back could make two stages wait on each other for room
+        if (stage < emitter->stage)
+        {
+            return ILLEGAL_ARGS;
+        }
+        return _append_pipeline_item(pipeline, stage, &emitter->batches[stage], item);
+    }
+
+    pthread_mutex_lock(&pipeline->m_outside);
+    int err = _append_pipeline_item(pipeline, stage, &pipeline->stages[stage].outside_batch, item);
+    pthread_mutex_unlock(&pipeline->m_outside);
+    return err;
+}
+
+int pipeline_finish(pipeline_t *pipeline)
+{
+    if (!pipeline)
+    {
+        return ILLEGAL_ARGS;
+    }
+
+    int err = 0;
+    pthread_mutex_lock(&pipeline->m_outside);
+    for (unsigned int i = 0; i < pipeline->stage_count; i++)
+    {
+        pipeline_stage_t *stage = &pipeline->stages[i];
+        if (stage->outside_batch)
+        {
+            int batch_err = _submit_pipeline_batch(pipeline, stage->outside_batch);
+            stage->outside_batch = NULL;
+            if (batch_err)
+                err = batch_err;
+        }
+    }
+    pthread_mutex_unlock(&pipeline->m_outside);
+
+    // Stages only feed themselves and later ones, once a stage is idle with
+    // everything before it done, nothing can reach it anymore
+    for (unsigned int i = 0; i < pipeline->stage_count; i++)
+    {
+        wait_idle(pipeline->stages[i].pool);
+    }
+
+    for (unsigned int i = 0; i < pipeline->stage_count; i++)
+    {
+        pipeline_stage_stats_t stats;
+        pipeline_stage_stats(pipeline, i, &stats);
+        log_info("Stage %-8s %9lu items in %7lu batches, queue peak %7lu items, fed in %.1fms, queue wait p99 %.1fus, run time p99 %.1fus\n",
+                 stats.name, stats.items, stats.batches, stats.peak_queued, stats.blocked_ns / 1e6,
+                 stats.pool.queue_wait.p99_ns / 1e3, stats.pool.run_time.p99_ns / 1e3);
+    }
+    return err;
+}
+
+int pipeline_stage_stats(pipeline_t *pipeline, unsigned int stage, pipeline_stage_stats_t *stats)
+{
+    if (!pipeline || stage >= pipeline->stage_count || !stats)
+    {
+        return ILLEGAL_ARGS;
+    }
+    pipeline_stage_t *from = &pipeline->stages[stage];
+    stats->name = from->name;
+    stats->items = atomic_load(&from->items);
+    stats->batches = atomic_load(&from->batches);
+    stats->queued = atomic_load(&from->queued);
+    stats->peak_queued = atomic_load(&from->peak_queued);
+    stats->blocked_ns = atomic_load(&from->blocked_ns);
+    return thread_pool_stats(from->pool, &stats->pool);
+}
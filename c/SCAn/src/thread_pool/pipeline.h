@@ -0,0 +1,62 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "thread_pool.h"
+
+#define PIPELINE_MAX_STAGES 8
+// Items handed from one stage to the next at once, for a batch_size of 0
+#define PIPELINE_DEFAULT_BATCH 64
+
+typedef struct pipeline_t pipeline_t;
+
+// Processes n items of the stage and takes them over, results go on with
+// pipeline_emit. The items array itself is only valid during the call.
+// context is the calling worker's, see thread_pool_options_t.
+typedef int (*pipeline_stage_func_t)(pipeline_t *pipeline, void **items, unsigned int n, void *context);
+
+typedef struct pipeline_stage_options_t {
+    const char *name;
+    pipeline_stage_func_t func;
+    unsigned int workers;
+    // Batches queued for the stage at most, 0 for no bound. Stages feeding
+    // a full one wait for room, which keeps a slow stage from piling up work.
+    unsigned long queue_batches;
+    void *(*worker_init)(unsigned int slot, void *user_data);
+    void (*worker_teardown)(unsigned int slot, void *context, void *user_data);
+    void *worker_user_data;
+} pipeline_stage_options_t;
+
+typedef struct pipeline_stage_stats_t {
+    const char *name;
+    // Items the stage processed, in how many batches
+    unsigned long items;
+    unsigned long batches;
+    // Items handed to the stage but not picked up yet, now and at most
+    unsigned long queued;
+    unsigned long peak_queued;
+    // Time spent handing batches to the stage, mostly waiting for room in
+    // its queue. A stage upstream producers keep waiting on is the bottleneck.
+    unsigned long blocked_ns;
+    thread_pool_stats_t pool;
+} pipeline_stage_stats_t;
+
+/*
+ * Staged pipeline. Every stage runs on its own pool with a bounded queue,
+ * items move between stages in batches of batch_size. Items emitted by a
+ * stage are collected while its function runs and handed on when a batch is
+ * full or the function returns. Stages may emit into themselves or later
+ * stages only, so waiting for room never goes in a circle.
+ */
+pipeline_t *create_pipeline(unsigned int stage_count, const pipeline_stage_options_t *stages, unsigned int batch_size);
+// Frees the pipeline, stage workers run their teardown here. Items still
+// queued are not processed, call pipeline_finish first.
+void destroy_pipeline(pipeline_t *pipeline);
+// Hands item to stage. Threads outside of the pipeline share one batch per
+// stage, those go out once full or on pipeline_finish.
+int pipeline_emit(pipeline_t *pipeline, unsigned int stage, void *item);
+// Sends out what outside threads emitted and waits until every stage has
+// processed all of its items. Logs the stage stats.
+int pipeline_finish(pipeline_t *pipeline);
+int pipeline_stage_stats(pipeline_t *pipeline, unsigned int stage, pipeline_stage_stats_t *stats);
+
+#endif
@@ -0,0 +1,253 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "placement.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+int _init_placement(worker_placement_t *placement, thread_pool_placement_t mode, const char *cpu_list);
+void _destroy_placement(worker_placement_t *placement);
+int _is_placed(const worker_placement_t *placement);
+int _place_thread_attr(const worker_placement_t *placement, unsigned int slot, pthread_attr_t *attr);
+int _run_placed(const worker_placement_t *placement, unsigned int slot, void *(*func)(void *), void *arg);
+int _parse_cpu_list(const char *list, int *cpus, unsigned int capacity, unsigned int *count);
+#ifdef __linux__
+void add_node_cpus(int cpu, cpu_set_t *set);
+#endif
+
+// Highest CPU number a list may name
+#define PLACEMENT_MAX_CPUS 1024
+#define NODE_CPULIST_PATH "/sys/devices/system/node/node%d/cpulist"
+// Nodes are numbered densely on all machines we run on, a gap this long
+// means there are no more
+#define MAX_NODE_GAP 8
+
+// Parses "0-3,8,10-11" into cpus, at most capacity of them
+int _parse_cpu_list(const char *list, int *cpus, unsigned int capacity, unsigned int *count)
+{
+    *count = 0;
+    const char *cur = list;
+    while (*cur && *cur != '\n')
+    {
+        char *end;
+        long first = strtol(cur, &end, 10);
+        if (end == cur || first < 0 || first >= PLACEMENT_MAX_CPUS)
+        {
+            return ILLEGAL_ARGS;
+        }
+        long last = first;
+        cur = end;
+        if (*cur == '-')
+        {
+            last = strtol(cur + 1, &end, 10);
+            if (end == cur + 1 || last < first || last >= PLACEMENT_MAX_CPUS)
+            {
+                return ILLEGAL_ARGS;
+            }
+            cur = end;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            if (*count == capacity)
+            {
+                return ILLEGAL_ARGS;
+            }
+            cpus[(*count)++] = cpu;
+        }
+        if (*cur == ',')
+        {
+            cur++;
+        }
+        else if (*cur && *cur != '\n')
+        {
+            return ILLEGAL_ARGS;
+        }
+    }
+    return *count ? 0 : ILLEGAL_ARGS;
+}
+
+int _init_placement(worker_placement_t *placement, thread_pool_placement_t mode, const char *cpu_list)
+{
+    placement->mode = THREAD_POOL_PLACEMENT_NONE;
+    placement->cpus = NULL;
+    placement->cpu_count = 0;
+    placement->cpu_sets = NULL;
+    if (mode == THREAD_POOL_PLACEMENT_NONE)
+    {
+        return 0;
+    }
+    if (mode != THREAD_POOL_PLACEMENT_CORES && mode != THREAD_POOL_PLACEMENT_NODES)
+    {
+        return ILLEGAL_ARGS;
+    }
+
+    int *cpus = malloc(PLACEMENT_MAX_CPUS * sizeof(int));
+    if (!cpus)
+    {
+        return MEMORY_ERROR;
+    }
+    unsigned int count = 0;
+    if (cpu_list && _parse_cpu_list(cpu_list, cpus, PLACEMENT_MAX_CPUS, &count))
+    {
+        free(cpus);
+        return ILLEGAL_ARGS;
+    }
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+    {
+        free(cpus);
+        return FATAL_ERROR;
+    }
+    if (cpu_list)
+    {
+        // Pinning to a CPU that is offline or outside our cpuset fails only
+        // once the thread is created, better to refuse the list right away
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (cpus[i] >= CPU_SETSIZE || !CPU_ISSET(cpus[i], &allowed))
+            {
+                free(cpus);
+                return ILLEGAL_ARGS;
+            }
+        }
+    }
+    else
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu < PLACEMENT_MAX_CPUS; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+                cpus[count++] = cpu;
+        }
+    }
+
+    cpu_set_t *sets = malloc(count * sizeof(cpu_set_t));
+    if (!sets)
+    {
+        free(cpus);
+        return MEMORY_ERROR;
+    }
+    for (unsigned int i = 0; i < count; i++)
+    {
+        CPU_ZERO(&sets[i]);
+        if (mode == THREAD_POOL_PLACEMENT_NODES)
+            add_node_cpus(cpus[i], &sets[i]);
+        else
+            CPU_SET(cpus[i], &sets[i]);
+        CPU_AND(&sets[i], &sets[i], &allowed);
+    }
+
+    placement->mode = mode;
+    placement->cpus = cpus;
+    placement->cpu_count = count;
+    placement->cpu_sets = sets;
+#else
+    // Validated above so a bad list fails the same everywhere
+    free(cpus);
+#endif
+    return 0;
+}
+
+void _destroy_placement(worker_placement_t *placement)
+{
+    free(placement->cpus);
+    free(placement->cpu_sets);
+    placement->cpus = NULL;
+    placement->cpu_sets = NULL;
+    placement->cpu_count = 0;
+}
+
+int _is_placed(const worker_placement_t *placement)
+{
+    return placement->cpu_count > 0;
+}
+
+#ifdef __linux__
+// Adds every CPU of the NUMA node cpu belongs to, just cpu if there is no
+// node information
+void add_node_cpus(int cpu, cpu_set_t *set)
+{
+    int node_cpus[PLACEMENT_MAX_CPUS];
+    char path[64];
+    char list[4096];
+    for (int node = 0, gap = 0; gap < MAX_NODE_GAP; node++)
+    {
+        snprintf(path, sizeof(path), NODE_CPULIST_PATH, node);
+        FILE *file = fopen(path, "r");
+        if (!file)
+        {
+            gap++;
+            continue;
+        }
+        gap = 0;
+        unsigned int count = 0;
+        int err = fgets(list, sizeof(list), file) ? _parse_cpu_list(list, node_cpus, PLACEMENT_MAX_CPUS, &count) : FATAL_ERROR;
+        fclose(file);
+        if (err)
+        {
+            continue;
+        }
+        for (unsigned int i = 0; i < count; i++)
+        {
+            if (node_cpus[i] == cpu)
+            {
+                for (unsigned int j = 0; j < count; j++)
+                {
+                    CPU_SET(node_cpus[j], set);
+                }
+                return;
+            }
+        }
+    }
+    CPU_SET(cpu, set);
+}
+#endif
+
+int _place_thread_attr(const worker_placement_t *placement, unsigned int slot, pthread_attr_t *attr)
+{
+#ifdef __linux__
+    if (_is_placed(placement))
+    {
+        cpu_set_t *set = (cpu_set_t *)placement->cpu_sets + slot % placement->cpu_count;
+        if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), set))
+        {
+            return FATAL_ERROR;
+        }
+    }
+#endif
+    return 0;
+}
+
+int _run_placed(const worker_placement_t *placement, unsigned int slot, void *(*func)(void *), void *arg)
+{
+    if (!_is_placed(placement))
+    {
+        func(arg);
+        return 0;
+    }
+
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr))
+    {
+        return FATAL_ERROR;
+    }
+    pthread_t thread;
+    int err = _place_thread_attr(placement, slot, &attr);
+    if (!err && pthread_create(&thread, &attr, func, arg))
+    {
+        err = FATAL_ERROR;
+    }
+    pthread_attr_destroy(&attr);
+    if (!err)
+    {
+        pthread_join(thread, NULL);
+    }
+    return err;
+}
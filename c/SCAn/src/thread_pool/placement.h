@@ -0,0 +1,33 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <pthread.h>
+
+#include "constants.h"
+#include "thread_pool.h"
+
+/*
+ * Where the workers of a pool run. Slot i is placed by cpus[i % cpu_count],
+ * either on that CPU alone or on every CPU of its NUMA node. Only Linux
+ * supports placement, elsewhere workers run wherever the scheduler puts them.
+ */
+typedef struct worker_placement_t
+{
+    thread_pool_placement_t mode;
+    int *cpus;
+    unsigned int cpu_count;
+    // cpu_set_t a worker on cpus[i] may run on, resolved once up front
+    void *cpu_sets;
+} worker_placement_t;
+
+// cpu_list like "0-7,16-23", NULL for every CPU the process may run on
+int _init_placement(worker_placement_t *placement, thread_pool_placement_t mode, const char *cpu_list);
+void _destroy_placement(worker_placement_t *placement);
+int _is_placed(const worker_placement_t *placement);
+// Threads created with attr start out placed like slot
+int _place_thread_attr(const worker_placement_t *placement, unsigned int slot, pthread_attr_t *attr);
+// Runs func(arg) on a short lived thread placed like slot and waits for it.
+// Memory the thread touches first ends up on the slot's NUMA node.
+int _run_placed(const worker_placement_t *placement, unsigned int slot, void *(*func)(void *), void *arg);
+
+#endif
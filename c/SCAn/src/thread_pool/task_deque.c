@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include "task_deque.h"
+
+task_deque_t *_create_task_deque();
+int _destroy_task_deque(task_deque_t *deque);
+int _push_task_deque(task_deque_t *deque, task_queue_entry_t *entry);
+int _push_tasks_deque(task_deque_t *deque, unsigned int n, task_queue_entry_t **entries);
+int _pop_task_deque(task_deque_t *deque, task_queue_entry_t **entry);
+int _steal_task_deque(task_deque_t *deque, task_queue_entry_t **entry);
+long _task_deque_size(task_deque_t *deque);
+
+task_deque_buffer_t *_create_task_deque_buffer(long capacity)
+{
+    task_deque_buffer_t *buffer = malloc(sizeof(task_deque_buffer_t) + capacity * sizeof(task_queue_entry_t *));
+    if (!buffer)
+    {
+        return NULL;
+    }
+    buffer->capacity = capacity;
+    buffer->previous = NULL;
+    return buffer;
+}
+
+task_deque_t *_create_task_deque()
+{
+    task_deque_t *deque = aligned_alloc(CACHE_LINE_SIZE, sizeof(task_deque_t));
+    if (!deque)
+    {
+        return NULL;
+    }
+    task_deque_buffer_t *buffer = _create_task_deque_buffer(TASK_DEQUE_INITIAL_CAPACITY);
+    if (!buffer)
+    {
+        free(deque);
+        return NULL;
+    }
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->buffer, buffer);
+    return deque;
+}
+
+int _destroy_task_deque(task_deque_t *deque)
+{
+    if (!deque)
+    {
+        return ILLEGAL_ARGS;
+    }
+    // Entries still queued belong to the pool's object allocator and go away
+    // with it. Buffers replaced by a resize are kept around until now, a
+    // thief may still have been reading from them.
+    task_deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    while (buffer)
+    {
+        task_deque_buffer_t *previous = buffer->previous;
+        free(buffer);
+        buffer = previous;
+    }
+    free(deque);
+    return 0;
+}
+
+task_deque_buffer_t *_grow_task_deque(task_deque_t *deque, task_deque_buffer_t *buffer, long top, long bottom)
+{
+    task_deque_buffer_t *grown = _create_task_deque_buffer(buffer->capacity * 2);
+    if (!grown)
+    {
+        return NULL;
+    }
+    for (long i = top; i < bottom; i++)
+    {
+        task_queue_entry_t *entry = atomic_load_explicit(&buffer->entries[i & (buffer->capacity - 1)], memory_order_relaxed);
+        atomic_store_explicit(&grown->entries[i & (grown->capacity - 1)], entry, memory_order_relaxed);
+    }
+    grown->previous = buffer;
+    atomic_store_explicit(&deque->buffer, grown, memory_order_release);
+    return grown;
+}
+
+int _push_task_deque(task_deque_t *deque, task_queue_entry_t *entry)
+{
+    if (!deque || !entry)
+        return ILLEGAL_ARGS;
+
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    task_deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+    if (bottom - top > buffer->capacity - 1)
+    {
+        buffer = _grow_task_deque(deque, buffer, top, bottom);
+        if (!buffer)
+        {
+            return MEMORY_ERROR;
+        }
+    }
+    atomic_store_explicit(&buffer->entries[bottom & (buffer->capacity - 1)], entry, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return 0;
+}
+
+int _push_tasks_deque(task_deque_t *deque, unsigned int n, task_queue_entry_t **entries)
+{
+    if (!deque || !entries)
+        return ILLEGAL_ARGS;
+
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    task_deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+
+    while (bottom - top + (long)n > buffer->capacity)
+    {
+        buffer = _grow_task_deque(deque, buffer, top, bottom);
+        if (!buffer)
+        {
+            return MEMORY_ERROR;
+        }
+    }
+    for (unsigned int i = 0; i < n; i++)
+    {
+        atomic_store_explicit(&buffer->entries[(bottom + i) & (buffer->capacity - 1)], entries[i], memory_order_relaxed);
+    }
+    // Thieves see the whole batch at once
+    atomic_store_explicit(&deque->bottom, bottom + n, memory_order_release);
+    return 0;
+}
+
+int _pop_task_deque(task_deque_t *deque, task_queue_entry_t **entry)
+{
+    if (!deque || !entry)
+        return ILLEGAL_ARGS;
+
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    task_deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return QUEUE_EMPTY;
+    }
+
+    *entry = atomic_load_explicit(&buffer->entries[bottom & (buffer->capacity - 1)], memory_order_relaxed);
+    if (top == bottom)
+    {
+        // Last entry, race against thieves for it
+        int won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        if (!won)
+        {
+            return QUEUE_EMPTY;
+        }
+    }
+    return 0;
+}
+
+int _steal_task_deque(task_deque_t *deque, task_queue_entry_t **entry)
+{
+    if (!deque || !entry)
+        return ILLEGAL_ARGS;
+
+    long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom)
+    {
+        return QUEUE_EMPTY;
+    }
+
+    task_deque_buffer_t *buffer = atomic_load_explicit(&deque->buffer, memory_order_acquire);
+    task_queue_entry_t *stolen = atomic_load_explicit(&buffer->entries[top & (buffer->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+        // Lost against the owner or another thief
+        return QUEUE_EMPTY;
+    }
+    *entry = stolen;
+    return 0;
+}
+
+long _task_deque_size(task_deque_t *deque)
+{
+    long bottom = atomic_load_explicit(&deque->bottom, memory_order_seq_cst);
+    long top = atomic_load_explicit(&deque->top, memory_order_seq_cst);
+    return bottom > top ? bottom - top : 0;
+}
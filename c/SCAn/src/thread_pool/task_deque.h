@@ -0,0 +1,43 @@
+#ifndef TASK_DEQUE_H
+#define TASK_DEQUE_H
+
+#include <stdatomic.h>
+
+#include "constants.h"
+#include "task_queue.h"
+
+#define TASK_DEQUE_INITIAL_CAPACITY 64
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+typedef struct task_deque_buffer_t task_deque_buffer_t;
+
+struct task_deque_buffer_t
+{
+    long capacity;
+    task_deque_buffer_t *previous;
+    _Atomic(task_queue_entry_t *) entries[];
+};
+
+/*
+ * Chase-Lev work-stealing deque. The owning worker pushes and pops at the
+ * bottom, every other worker steals from the top. Only the owner may call
+ * _push_task_deque and _pop_task_deque.
+ */
+typedef struct task_deque_t
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_long top;
+    _Alignas(CACHE_LINE_SIZE) atomic_long bottom;
+    _Atomic(task_deque_buffer_t *) buffer;
+} task_deque_t;
+
+task_deque_t *_create_task_deque();
+int _destroy_task_deque(task_deque_t *deque);
+int _push_task_deque(task_deque_t *deque, task_queue_entry_t *entry);
+int _push_tasks_deque(task_deque_t *deque, unsigned int n, task_queue_entry_t **entries);
+int _pop_task_deque(task_deque_t *deque, task_queue_entry_t **entry);
+int _steal_task_deque(task_deque_t *deque, task_queue_entry_t **entry);
+long _task_deque_size(task_deque_t *deque);
+
+#endif
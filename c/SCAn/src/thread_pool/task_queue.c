@@ -2,41 +2,78 @@
 #include <stdio.h>
 #include "task_queue.h"
 
-task_queue_t *_create_task_queue();
+task_queue_t *_create_task_queue(task_queue_backend_t backend, unsigned int capacity, object_pool_t *objects);
+task_queue_entry_t *_create_task_queue_entry(object_pool_t *objects, object_cache_t *cache, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+void _free_task_queue_entry(object_pool_t *objects, object_cache_t *cache, task_queue_entry_t *ent);
 int _stop_task_queue(task_queue_t *queue);
 int _destroy_task_queue(task_queue_t *queue);
-int _enqueue_task(task_queue_t *queue, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int _enqueue_task(task_queue_t *queue, unsigned int priority, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
 int _dequeue_task(task_queue_t *queue, int (**task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **arg);
 
 int stop_task_queue_locked(task_queue_t *queue);
-int _enqueue_task_locked(task_queue_t *queue, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int _enqueue_task_locked(task_queue_t *queue, unsigned int priority, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
 int _dequeue_task_locked(task_queue_t *queue, int (**task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **arg);
+int _enqueue_tasks_locked(task_queue_t *queue, unsigned int priority, unsigned int n, int (**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+unsigned int _task_queue_count_locked(task_queue_t *queue);
+void _destroy_task_rings(task_queue_t *queue);
 
-task_queue_t *_create_task_queue()
+task_queue_t *_create_task_queue(task_queue_backend_t backend, unsigned int capacity, object_pool_t *objects)
 {
     task_queue_t *queue = malloc(sizeof(task_queue_t));
     if (!queue)
     {
         return NULL;
     }
+    queue->objects = objects;
+    queue->backend = backend;
+    for (unsigned int i = 0; i < TASK_PRIORITIES; i++)
+    {
+        queue->heads[i] = NULL;
+        queue->tails[i] = NULL;
+        queue->rings[i] = NULL;
+    }
+    if (backend == TASK_QUEUE_LOCK_FREE)
+    {
+        for (unsigned int i = 0; i < TASK_PRIORITIES; i++)
+        {
+            queue->rings[i] = _create_task_ring(capacity ? capacity : DEFAULT_TASK_QUEUE_CAPACITY);
+            if (!queue->rings[i])
+            {
+                _destroy_task_rings(queue);
+                free(queue);
+                return NULL;
+            }
+        }
+    }
     queue->c_updated = malloc(sizeof(pthread_cond_t));
-    queue->m_lock = malloc(sizeof(pthread_mutex_t));
+    queue->m_lock = malloc(sizeof(profiled_mutex_t));
     if (pthread_cond_init(queue->c_updated, NULL) ||
-        pthread_mutex_init(queue->m_lock, NULL))
+        profiled_mutex_init(queue->m_lock, "task_queue"))
     {
         free(queue->c_updated);
         free(queue->m_lock);
+        _destroy_task_rings(queue);
         free(queue);
         return NULL;
     }
-    queue->head = NULL;
-    queue->tail = NULL;
     queue->count = 0;
-    queue->is_started = 0;
-    queue->is_stopped = 0;
+    atomic_init(&queue->is_started, 0);
+    atomic_init(&queue->is_stopped, 0);
     return queue;
 }
 
+void _destroy_task_rings(task_queue_t *queue)
+{
+    for (unsigned int i = 0; i < TASK_PRIORITIES; i++)
+    {
+        if (queue->rings[i])
+        {
+            _destroy_task_ring(queue->rings[i]);
+            queue->rings[i] = NULL;
+        }
+    }
+}
+
 int _stop_task_queue(task_queue_t *queue)
 {
     if (!queue)
@@ -53,56 +90,106 @@ int _destroy_task_queue(task_queue_t *queue)
     {
         return ILLEGAL_ARGS;
     }
-    task_queue_entry_t *current = queue->head;
-    while (current != NULL)
+    for (unsigned int i = 0; i < TASK_PRIORITIES; i++)
     {
-        task_queue_entry_t *next = current->next;
-        free(current);
-        current = next;
+        task_queue_entry_t *current = queue->heads[i];
+        while (current != NULL)
+        {
+            task_queue_entry_t *next = current->next;
+            _free_task_queue_entry(queue->objects, NULL, current);
+            current = next;
+        }
     }
+    _destroy_task_rings(queue);
 
     pthread_cond_destroy(queue->c_updated);
-    pthread_mutex_destroy(queue->m_lock);
+    profiled_mutex_destroy(queue->m_lock);
+    free(queue->c_updated);
+    free(queue->m_lock);
 
     free(queue);
     return 0;
 }
 
-int _enqueue_task(task_queue_t *queue, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+task_queue_entry_t *_create_task_queue_entry(object_pool_t *objects, object_cache_t *cache, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
 {
-    if (!queue || !task_func || !arg)
-        return ILLEGAL_ARGS;
-
-    if (queue->is_stopped)
-    {
-        return QUEUE_STOPPED;
-    }
-
-    task_queue_entry_t *ent = malloc(sizeof(task_queue_entry_t));
+    task_queue_entry_t *ent = _object_pool_alloc(objects, cache, sizeof(task_queue_entry_t));
     if (!ent)
     {
-        return MEMORY_ERROR;
+        return NULL;
     }
 
     ent->arg = arg;
     ent->task_func = task_func;
     ent->next = NULL;
+    ent->id = 0;
+    return ent;
+}
+
+void _free_task_queue_entry(object_pool_t *objects, object_cache_t *cache, task_queue_entry_t *ent)
+{
+    _object_pool_free(objects, cache, ent);
+}
+
+void _free_task_queue_chain(object_pool_t *objects, task_queue_entry_t *first)
+{
+    while (first)
+    {
+        task_queue_entry_t *next = first->next;
+        _free_task_queue_entry(objects, NULL, first);
+        first = next;
+    }
+}
 
+// Appends an already linked chain of n entries, ids are assigned here
+void _append_task_queue_chain(task_queue_t *queue, unsigned int priority, task_queue_entry_t *first, task_queue_entry_t *last, unsigned int n)
+{
     if (!queue->is_started)
         queue->is_started = 1;
-    if (!queue->head)
+
+    unsigned int id = queue->tails[priority] ? queue->tails[priority]->id + 1 : 0;
+    for (task_queue_entry_t *ent = first; ent; ent = ent->next)
+    {
+        ent->id = id++;
+    }
+
+    if (!queue->heads[priority])
     {
-        ent->id = 0;
-        queue->head = ent;
-        queue->tail = ent;
+        queue->heads[priority] = first;
     }
     else
     {
-        ent->id = queue->tail->id + 1;
-        queue->tail->next = ent;
-        queue->tail = ent;
+        queue->tails[priority]->next = first;
     }
-    queue->count++;
+    queue->tails[priority] = last;
+    queue->count += n;
+}
+
+int _enqueue_task(task_queue_t *queue, unsigned int priority, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!queue || !task_func || !arg || priority >= TASK_PRIORITIES)
+        return ILLEGAL_ARGS;
+
+    if (queue->is_stopped)
+    {
+        return QUEUE_STOPPED;
+    }
+
+    if (queue->backend == TASK_QUEUE_LOCK_FREE)
+    {
+        int err = _enqueue_task_ring(queue->rings[priority], task_func, arg);
+        if (err == 0 && !queue->is_started)
+            queue->is_started = 1;
+        return err;
+    }
+
+    task_queue_entry_t *ent = _create_task_queue_entry(queue->objects, NULL, task_func, arg);
+    if (!ent)
+    {
+        return MEMORY_ERROR;
+    }
+
+    _append_task_queue_chain(queue, priority, ent, ent, 1);
     return 0;
 }
 
@@ -110,20 +197,36 @@ int _dequeue_task(task_queue_t *queue, int (**task_func)(task_queue_entry_arg_t
 {
     if (!queue || !task_func || !arg)
         return ILLEGAL_ARGS;
+    if (queue->backend == TASK_QUEUE_LOCK_FREE)
+    {
+        if (queue->is_stopped)
+            return QUEUE_STOPPED;
+        for (int i = TASK_PRIORITY_HIGHEST; i >= 0; i--)
+        {
+            if (_dequeue_task_ring(queue->rings[i], task_func, arg) == 0)
+                return 0;
+        }
+        return QUEUE_EMPTY;
+    }
     if (queue->count == 0 || queue->is_stopped)
     {
         return (queue->count == 0) ? QUEUE_EMPTY : QUEUE_STOPPED;
     }
 
-    task_queue_entry_t *head = queue->head;
+    int priority = TASK_PRIORITY_HIGHEST;
+    while (!queue->heads[priority])
+    {
+        priority--;
+    }
+    task_queue_entry_t *head = queue->heads[priority];
     *task_func = head->task_func;
     *arg = head->arg;
 
-    queue->head = head->next;
-    free(head);
-    if (!queue->head)
+    queue->heads[priority] = head->next;
+    _free_task_queue_entry(queue->objects, NULL, head);
+    if (!queue->heads[priority])
     {
-        queue->tail = NULL;
+        queue->tails[priority] = NULL;
     }
     queue->count--;
     return 0;
@@ -135,28 +238,26 @@ int stop_task_queue_locked(task_queue_t *queue)
     {
         return ILLEGAL_ARGS;
     }
-    pthread_mutex_lock(queue->m_lock);
+    profiled_mutex_lock(queue->m_lock);
     int err = _stop_task_queue(queue);
     if (err == 0)
     {
         pthread_cond_broadcast(queue->c_updated);
     }
-    pthread_mutex_unlock(queue->m_lock);
+    profiled_mutex_unlock(queue->m_lock);
     return err;
 }
 
-int _enqueue_task_locked(task_queue_t *queue, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+int _enqueue_task_locked(task_queue_t *queue, unsigned int priority, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
 {
     if (!queue)
         return ILLEGAL_ARGS;
+    if (queue->backend == TASK_QUEUE_LOCK_FREE)
+        return _enqueue_task(queue, priority, task_func, arg);
 
-    pthread_mutex_lock(queue->m_lock);
-    int err = _enqueue_task(queue, task_func, arg);
-    if (err == 0)
-    {
-        pthread_cond_broadcast(queue->c_updated);
-    }
-    pthread_mutex_unlock(queue->m_lock);
+    profiled_mutex_lock(queue->m_lock);
+    int err = _enqueue_task(queue, priority, task_func, arg);
+    profiled_mutex_unlock(queue->m_lock);
     return err;
 }
 
@@ -164,13 +265,84 @@ int _dequeue_task_locked(task_queue_t *queue, int (**task_func)(task_queue_entry
 {
     if (!queue)
         return ILLEGAL_ARGS;
+    if (queue->backend == TASK_QUEUE_LOCK_FREE)
+        return _dequeue_task(queue, task_func, arg);
 
-    pthread_mutex_lock(queue->m_lock);
+    profiled_mutex_lock(queue->m_lock);
     int err = _dequeue_task(queue, task_func, arg);
+    profiled_mutex_unlock(queue->m_lock);
+    return err;
+}
+
+int _enqueue_tasks_locked(task_queue_t *queue, unsigned int priority, unsigned int n, int (**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+    if (!queue || !task_funcs || !args || priority >= TASK_PRIORITIES)
+        return ILLEGAL_ARGS;
+    if (n == 0)
+        return 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (!task_funcs[i] || !args[i])
+            return ILLEGAL_ARGS;
+    }
+    if (queue->is_stopped)
+        return QUEUE_STOPPED;
+
+    if (queue->backend == TASK_QUEUE_LOCK_FREE)
+    {
+        int err = _enqueue_tasks_ring(queue->rings[priority], n, task_funcs, args);
+        if (err == 0 && !queue->is_started)
+            queue->is_started = 1;
+        return err;
+    }
+
+    // Build the chain before taking the lock, only linking it in is serialized
+    task_queue_entry_t *first = NULL;
+    task_queue_entry_t *last = NULL;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        task_queue_entry_t *ent = _create_task_queue_entry(queue->objects, NULL, task_funcs[i], args[i]);
+        if (!ent)
+        {
+            _free_task_queue_chain(queue->objects, first);
+            return MEMORY_ERROR;
+        }
+        if (last)
+            last->next = ent;
+        else
+            first = ent;
+        last = ent;
+    }
+
+    profiled_mutex_lock(queue->m_lock);
+    int err = queue->is_stopped ? QUEUE_STOPPED : 0;
     if (err == 0)
     {
-        pthread_cond_broadcast(queue->c_updated);
+        _append_task_queue_chain(queue, priority, first, last, n);
+    }
+    profiled_mutex_unlock(queue->m_lock);
+
+    if (err)
+    {
+        _free_task_queue_chain(queue->objects, first);
     }
-    pthread_mutex_unlock(queue->m_lock);
     return err;
-}
\ No newline at end of file
+}
+
+unsigned int _task_queue_count_locked(task_queue_t *queue)
+{
+    if (!queue)
+        return 0;
+    if (queue->backend == TASK_QUEUE_LOCK_FREE)
+    {
+        size_t size = 0;
+        for (unsigned int i = 0; i < TASK_PRIORITIES; i++)
+            size += _task_ring_size(queue->rings[i]);
+        return size;
+    }
+
+    profiled_mutex_lock(queue->m_lock);
+    unsigned int count = queue->count;
+    profiled_mutex_unlock(queue->m_lock);
+    return count;
+}
@@ -2,9 +2,15 @@
 #define TASK_QUEUE_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "constants.h"
+#include "lock_profile.h"
 #include "task_queue_public.h"
+#include "task_ring.h"
+#include "object_pool.h"
+
+#define DEFAULT_TASK_QUEUE_CAPACITY 65536
 
 typedef struct task_queue_entry_t
 {
@@ -16,22 +22,38 @@ typedef struct task_queue_entry_t
 
 typedef struct task_queue_t
 {
-    pthread_mutex_t *m_lock;
+    task_queue_backend_t backend;
+
+    // TASK_QUEUE_LOCKED, one list per priority lane
+    profiled_mutex_t *m_lock;
+    // Only signalled on stop, the pool wakes its idle workers itself
     pthread_cond_t *c_updated;
-    task_queue_entry_t *head;
-    task_queue_entry_t *tail;
+    task_queue_entry_t *heads[TASK_PRIORITIES];
+    task_queue_entry_t *tails[TASK_PRIORITIES];
     unsigned int count;
-    unsigned short is_started;
-    unsigned short is_stopped;
+
+    // TASK_QUEUE_LOCK_FREE, one ring per priority lane
+    task_ring_t *rings[TASK_PRIORITIES];
+
+    // Allocator for entries, plain malloc if NULL
+    object_pool_t *objects;
+
+    atomic_ushort is_started;
+    atomic_ushort is_stopped;
 } task_queue_t;
 
-task_queue_t *_create_task_queue();
+task_queue_t *_create_task_queue(task_queue_backend_t backend, unsigned int capacity, object_pool_t *objects);
+task_queue_entry_t *_create_task_queue_entry(object_pool_t *objects, object_cache_t *cache, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+void _free_task_queue_entry(object_pool_t *objects, object_cache_t *cache, task_queue_entry_t *ent);
 int _stop_task_queue(task_queue_t *queue);
 int _destroy_task_queue(task_queue_t *queue);
-int _enqueue_task(task_queue_t *queue, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int _enqueue_task(task_queue_t *queue, unsigned int priority, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
 int _dequeue_task(task_queue_t *queue, int(* *task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **arg);
 
-int _enqueue_task_locked(task_queue_t *queue, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int _enqueue_task_locked(task_queue_t *queue, unsigned int priority, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
 int _dequeue_task_locked(task_queue_t *queue, int(* *task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **arg);
+int _enqueue_tasks_locked(task_queue_t *queue, unsigned int priority, unsigned int n, int(* *task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+int stop_task_queue_locked(task_queue_t *queue);
+unsigned int _task_queue_count_locked(task_queue_t *queue);
 
 #endif
\ No newline at end of file
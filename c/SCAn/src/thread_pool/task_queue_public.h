@@ -2,13 +2,44 @@
 #define TASK_QUEUE_PUBLIC_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 typedef struct task_queue_entry_t task_queue_entry_t;
 typedef struct task_queue_t task_queue_t;
+typedef struct cancel_token_t cancel_token_t;
 
-typedef struct task_queue_entry_arg_t {
+typedef enum {
+    TASK_QUEUE_LOCKED,
+    TASK_QUEUE_LOCK_FREE,
+} task_queue_backend_t;
+
+// Priority lanes, tasks of a higher lane run first
+#define TASK_PRIORITIES 4
+#define TASK_PRIORITY_DEFAULT 0
+#define TASK_PRIORITY_HIGHEST (TASK_PRIORITIES - 1)
+
+typedef struct task_queue_entry_arg_t task_queue_entry_arg_t;
+
+struct task_queue_entry_arg_t {
     pthread_t id;
     void *arg;
-} task_queue_entry_arg_t;
+
+    // Task tree, managed by the pool. parent is released once this task and
+    // its continuation, if any, have finished.
+    task_queue_entry_arg_t *parent;
+    int (*continuation)(task_queue_entry_arg_t *);
+    atomic_int pending;
+    // Set while the arg is queued for its continuation
+    unsigned short continuing;
+
+    // Job the task belongs to, children inherit it. NULL if not cancellable
+    cancel_token_t *token;
+    // Lane the task is queued in, set on enqueue
+    unsigned short priority;
+    // When it was queued if the task is traced or sampled, 0 otherwise
+    long enqueued_ns;
+    // Context of the worker running the task, NULL outside of the pool
+    void *context;
+};
 
 #endif
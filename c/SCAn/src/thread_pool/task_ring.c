@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "task_ring.h"
+
+task_ring_t *_create_task_ring(size_t capacity);
+int _destroy_task_ring(task_ring_t *ring);
+int _enqueue_task_ring(task_ring_t *ring, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int _dequeue_task_ring(task_ring_t *ring, int (**task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **arg);
+int _enqueue_tasks_ring(task_ring_t *ring, unsigned int n, int (**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+size_t _task_ring_size(task_ring_t *ring);
+
+task_ring_t *_create_task_ring(size_t capacity)
+{
+    if (capacity < 2)
+    {
+        capacity = 2;
+    }
+    // Round up so positions can be mapped to slots with a mask
+    size_t rounded = 1;
+    while (rounded < capacity)
+    {
+        rounded <<= 1;
+    }
+
+    task_ring_t *ring = aligned_alloc(CACHE_LINE_SIZE, sizeof(task_ring_t));
+    if (!ring)
+    {
+        return NULL;
+    }
+    ring->slots = malloc(rounded * sizeof(task_ring_slot_t));
+    if (!ring->slots)
+    {
+        free(ring);
+        return NULL;
+    }
+    for (size_t i = 0; i < rounded; i++)
+    {
+        atomic_init(&ring->slots[i].sequence, i);
+        ring->slots[i].task_func = NULL;
+        ring->slots[i].arg = NULL;
+    }
+    ring->mask = rounded - 1;
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    return ring;
+}
+
+int _destroy_task_ring(task_ring_t *ring)
+{
+    if (!ring)
+    {
+        return ILLEGAL_ARGS;
+    }
+    free(ring->slots);
+    free(ring);
+    return 0;
+}
+
+int _enqueue_task_ring(task_ring_t *ring, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!ring || !task_func || !arg)
+        return ILLEGAL_ARGS;
+
+    task_ring_slot_t *slot;
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &ring->slots[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // The consumer of the previous lap hasn't freed this slot yet
+            return QUEUE_FULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    slot->task_func = task_func;
+    slot->arg = arg;
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return 0;
+}
+
+int _enqueue_tasks_ring(task_ring_t *ring, unsigned int n, int (**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+    if (!ring || !task_funcs || !args)
+        return ILLEGAL_ARGS;
+    if (n > ring->mask + 1)
+        return QUEUE_FULL;
+
+    // Claim all n positions with a single CAS once every one of their slots
+    // has been released by the previous lap
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        unsigned int free_slots = 0;
+        intptr_t diff = 0;
+        while (free_slots < n)
+        {
+            task_ring_slot_t *slot = &ring->slots[(pos + free_slots) & ring->mask];
+            size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+            diff = (intptr_t)sequence - (intptr_t)(pos + free_slots);
+            if (diff != 0)
+                break;
+            free_slots++;
+        }
+
+        if (free_slots == n)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + n, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return QUEUE_FULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        task_ring_slot_t *slot = &ring->slots[(pos + i) & ring->mask];
+        slot->task_func = task_funcs[i];
+        slot->arg = args[i];
+        atomic_store_explicit(&slot->sequence, pos + i + 1, memory_order_release);
+    }
+    return 0;
+}
+
+int _dequeue_task_ring(task_ring_t *ring, int (**task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **arg)
+{
+    if (!ring || !task_func || !arg)
+        return ILLEGAL_ARGS;
+
+    task_ring_slot_t *slot;
+    size_t pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+    for (;;)
+    {
+        slot = &ring->slots[pos & ring->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+        {
+            return QUEUE_EMPTY;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+
+    *task_func = slot->task_func;
+    *arg = slot->arg;
+    // Hand the slot to the producer one lap ahead
+    atomic_store_explicit(&slot->sequence, pos + ring->mask + 1, memory_order_release);
+    return 0;
+}
+
+size_t _task_ring_size(task_ring_t *ring)
+{
+    size_t dequeue_pos = atomic_load_explicit(&ring->dequeue_pos, memory_order_seq_cst);
+    size_t enqueue_pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_seq_cst);
+    return enqueue_pos > dequeue_pos ? enqueue_pos - dequeue_pos : 0;
+}
@@ -0,0 +1,41 @@
+#ifndef TASK_RING_H
+#define TASK_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "constants.h"
+#include "task_queue_public.h"
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+typedef struct task_ring_slot_t
+{
+    atomic_size_t sequence;
+    int (*task_func)(task_queue_entry_arg_t *);
+    task_queue_entry_arg_t *arg;
+} task_ring_slot_t;
+
+/*
+ * Bounded multi-producer/multi-consumer ring buffer. Every slot carries a
+ * sequence number telling producers and consumers whose turn it is, so
+ * neither side needs a lock and no memory is allocated per task.
+ */
+typedef struct task_ring_t
+{
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+    _Alignas(CACHE_LINE_SIZE) size_t mask;
+    task_ring_slot_t *slots;
+} task_ring_t;
+
+task_ring_t *_create_task_ring(size_t capacity);
+int _destroy_task_ring(task_ring_t *ring);
+int _enqueue_task_ring(task_ring_t *ring, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int _dequeue_task_ring(task_ring_t *ring, int(* *task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **arg);
+int _enqueue_tasks_ring(task_ring_t *ring, unsigned int n, int(* *task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+size_t _task_ring_size(task_ring_t *ring);
+
+#endif
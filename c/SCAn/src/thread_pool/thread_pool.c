@@ -1,31 +1,225 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "logger.h"
 #include "thread_pool.h"
 #include "task_queue.h"
+#include "task_deque.h"
+#include "parker.h"
+#include "placement.h"
+#include "trace.h"
+#include "metrics.h"
+#include "timer.h"
+#include "lock_profile.h"
+
+#define DEFAULT_IDLE_TIMEOUT_MS 1000
+
+// Every n-th task of an elastic pool is timed to estimate how much of the
+// time workers spend blocked instead of on the CPU
+#define BLOCKED_SAMPLE_INTERVAL 8
+// Workers are only added while tasks queue up and at least this share of
+// task time is spent blocked, adding threads to CPU bound work doesn't help
+#define GROW_BLOCKED_PERMILLE 500
+// A new worker gets some time to drain the backlog before the next one
+#define GROW_INTERVAL_NS 1000000L
+
+// Before parking a worker polls for new tasks this many times, with a short
+// pause between attempts. Tasks spawned in bursts usually show up within that.
+#define SPIN_ATTEMPTS 32
+#define SPIN_PAUSES 16
+
+// Returned by wait_for_tasks when the worker should exit after being idle
+#define WORKER_RETIRED 1
+
+typedef struct worker_thread_entry_arg_t worker_thread_entry_arg_t;
+
+typedef enum {
+    WORKER_SLOT_EMPTY,
+    WORKER_SLOT_RUNNING,
+    // Thread has exited, but was not joined yet
+    WORKER_SLOT_EXITED,
+} worker_slot_state_t;
 
 typedef struct worker_pool_t {
     task_queue_t *task_queue;
+    object_pool_t *objects;
+
+    // Tasks enqueued but not yet finished, join wakes up when it hits 0
+    atomic_long outstanding;
+    pthread_cond_t *c_done;
+    profiled_mutex_t *m_done;
+
+    // Parked workers, the most recently parked on top. Producers wake from
+    // the top, its caches are the most likely to still be warm.
+    pthread_mutex_t *m_idle;
+    worker_thread_entry_arg_t **idle_stack;
+    unsigned int idle_count;
+    atomic_int idle_workers;
 
-    busy_threads_t *busy_threads;
-    pthread_cond_t *c_busy_threads;
-    pthread_mutex_t *m_busy_threads;
+    // One slot per possible worker, slots above the running ones stay empty
+    // until the pool grows into them
+    worker_thread_entry_arg_t *workers;
+    unsigned int worker_count;
 
-    pthread_t **worker_threads;
-    unsigned short worker_count;
+    // Elastic sizing, slot states and the counters below are guarded by m_resize
+    pthread_mutex_t *m_resize;
+    unsigned int min_workers;
+    long idle_timeout_ns;
+    atomic_uint active_workers;
+    atomic_long last_grow_ns;
+    atomic_uint blocked_permille;
+    unsigned int peak_workers;
+    unsigned long grow_events;
+    unsigned long shrink_events;
+
+    worker_placement_t placement;
+
+    // Lanes that ever had a task, steals skip the others
+    atomic_uint used_lanes;
+
+    // Bound on outstanding tasks, 0 for none. Outside submitters that hit it
+    // wait on c_space, which is only signalled while someone waits.
+    unsigned long max_pending;
+    thread_pool_full_policy_t full_policy;
+    pthread_cond_t *c_space;
+    atomic_int space_waiters;
+
+    // Spans of every task run, NULL unless tracing. Written on shutdown.
+    trace_t *trace;
+    char *trace_path;
+
+    // Workers record into their own metrics, every other thread into these
+    worker_metrics_t *outside_metrics;
+
+    void *(*worker_init)(unsigned int slot, void *user_data);
+    void (*worker_teardown)(unsigned int slot, void *context, void *user_data);
+    void *worker_user_data;
+
+    // Delayed and periodic tasks, everything below is guarded by m_timers.
+    // timer_wake_tick is the tick the service thread sleeps until, -1 while
+    // it waits for a timer to be added.
+    timer_wheel_t *wheel;
+    thread_pool_timer_t *timers;
+    pthread_mutex_t *m_timers;
+    pthread_cond_t *c_timers;
+    pthread_t timer_thread;
+    unsigned short timer_thread_started;
+    unsigned short timers_stopped;
+    long timer_wake_tick;
 } worker_pool_t;
 
 typedef struct thread_pool_t {
     worker_pool_t *worker_pool;
-    pthread_t *watcher_thread;
-    unsigned short thread_count;
+    unsigned int thread_count;
 } thread_pool_t;
 
+typedef struct thread_pool_timer_t {
+    // First, the wheel hands back its own part
+    wheel_timer_t wheel;
+    worker_pool_t *worker_pool;
+    int (*task_func)(task_queue_entry_arg_t *);
+    task_queue_entry_arg_t *arg;
+    // 0 for a one shot timer
+    unsigned int period_ms;
+    // Periodic timers run through their own arg, so the caller's is never
+    // queued twice
+    task_queue_entry_arg_t run_arg;
+    unsigned short running;
+    unsigned short cancelled;
+    // Every timer of the pool, freed with it
+    thread_pool_timer_t *live_next;
+    thread_pool_timer_t *live_prev;
+    // Due timers collected by the service thread
+    thread_pool_timer_t *due_next;
+} thread_pool_timer_t;
+
+typedef struct cancel_token_t {
+    atomic_int cancelled;
+    // CLOCK_MONOTONIC, 0 for none
+    long deadline_ns;
+    void (*on_drop)(task_queue_entry_arg_t *);
+    atomic_ulong dropped;
+} cancel_token_t;
+
+typedef struct worker_thread_entry_arg_t
+{
+    unsigned int id;
+    worker_pool_t *worker_pool;
+    // One per priority lane
+    task_deque_t *deques[TASK_PRIORITIES];
+    object_cache_t *cache;
+    worker_metrics_t *metrics;
+    // From worker_init, only set while the thread runs
+    void *context;
+    pthread_t thread;
+    worker_slot_state_t state;
+
+    parker_t parker;
+    // Position in idle_stack, -1 while not parked. Guarded by m_idle
+    int idle_index;
+} worker_thread_entry_arg_t;
+
+// The worker the calling thread belongs to, NULL outside of the pool
+static __thread worker_thread_entry_arg_t *current_worker = NULL;
+// Whether the task running on this thread called set_continuation
+static __thread int continuation_set = 0;
+// Span of the task running on this thread, NULL unless the pool traces
+static __thread trace_span_t *current_span = NULL;
+// Tasks submitted from this thread, every THREAD_POOL_METRICS_INTERVAL-th is timed
+static __thread unsigned int submitted_tasks = 0;
 
-thread_pool_t *create_thread_pool(unsigned short thread_count, thread_pool_creation_status_t *status);
+thread_pool_t *create_thread_pool(unsigned int thread_count, thread_pool_creation_status_t *status);
+thread_pool_t *create_thread_pool_with_options(const thread_pool_options_t *options, thread_pool_creation_status_t *status);
 void free_pool(thread_pool_t *pool);
+int thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats);
+int wait_idle(thread_pool_t *pool);
+int shutdown_pool(thread_pool_t *pool);
+unsigned int thread_pool_slots(thread_pool_t *pool);
+unsigned int thread_pool_current_slot(thread_pool_t *pool);
+void *thread_pool_worker_context(thread_pool_t *pool);
+int run_pending_task(thread_pool_t *pool);
+int set_continuation(thread_pool_t *pool, task_queue_entry_arg_t *arg, int(*continuation)(task_queue_entry_arg_t *));
+int enqueue_child_task(thread_pool_t *pool, task_queue_entry_arg_t *parent, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int enqueue_child_tasks(thread_pool_t *pool, task_queue_entry_arg_t *parent, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+int enqueue_task_with_priority(thread_pool_t *pool, unsigned int priority, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int set_task_label(thread_pool_t *pool, const char *label);
+int enqueue_child_tasks_with_priority(thread_pool_t *pool, task_queue_entry_arg_t *parent, unsigned int priority, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+cancel_token_t *create_cancel_token(unsigned int timeout_ms, void (*on_drop)(task_queue_entry_arg_t *));
+void destroy_cancel_token(cancel_token_t *token);
+void cancel(cancel_token_t *token);
+int is_cancelled(cancel_token_t *token);
+unsigned long cancel_token_dropped(cancel_token_t *token);
+int enqueue_cancellable_task(thread_pool_t *pool, cancel_token_t *token, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+void *get_tasks(void *arg);
+void *create_worker_memory(void *arg);
+int has_deques(worker_thread_entry_arg_t *worker);
+void wake_all_workers(worker_pool_t *worker_pool);
+int run_task(worker_pool_t *worker_pool, unsigned int id, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int submit_task(worker_pool_t *worker_pool, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int submit_tasks(worker_pool_t *worker_pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+int submit_bounded(worker_pool_t *worker_pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+void run_inline(worker_pool_t *worker_pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+void wait_for_room(worker_pool_t *worker_pool, long seen);
+void init_root_arg(task_queue_entry_arg_t *arg, unsigned int priority, cancel_token_t *token);
+void mark_lane_used(worker_pool_t *worker_pool, unsigned int priority);
+worker_metrics_t *slot_metrics(worker_pool_t *worker_pool, unsigned int id);
+long enqueue_stamp(worker_pool_t *worker_pool);
+int enqueue_task_after(thread_pool_t *pool, unsigned int delay_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+thread_pool_timer_t *enqueue_periodic_task(thread_pool_t *pool, unsigned int period_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int cancel_periodic_task(thread_pool_t *pool, thread_pool_timer_t *timer);
+void *service_timers(void *arg);
+void stop_timers(worker_pool_t *worker_pool);
+void fire_timer(worker_pool_t *worker_pool, thread_pool_timer_t *timer);
+void unlink_timer(worker_pool_t *worker_pool, thread_pool_timer_t *timer);
+int run_periodic_task(task_queue_entry_arg_t *task_arg);
+int add_pool_timer(worker_pool_t *worker_pool, thread_pool_timer_t *timer, unsigned int delay_ms);
+thread_pool_timer_t *create_pool_timer(worker_pool_t *worker_pool, unsigned int period_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+void log_latency(const char *name, const thread_pool_latency_t *latency);
 
 void free_pool(thread_pool_t *pool)
 {
@@ -34,284 +228,1741 @@ void free_pool(thread_pool_t *pool)
         return;
     }
 
-    // Worker Pool
-    free(pool->worker_pool->busy_threads);
-    free(pool->worker_pool->c_busy_threads);
-    free(pool->worker_pool->m_busy_threads);
-
-    for (int i = 0; i < pool->worker_pool->worker_count; i++)
+    // Worker Pool. Workers still running, only possible if creation failed
+    // half way, are stopped like on shutdown instead of being cancelled
+    // somewhere inside a task
+    int started = 0;
+    for (unsigned int i = 0; i < pool->worker_pool->worker_count; i++)
     {
-        if (!pool->worker_pool->worker_threads[i])
+        started |= pool->worker_pool->workers[i].state != WORKER_SLOT_EMPTY;
+    }
+    if (started)
+    {
+        stop_task_queue_locked(pool->worker_pool->task_queue);
+        wake_all_workers(pool->worker_pool);
+        for (unsigned int i = 0; i < pool->worker_pool->worker_count; i++)
         {
-            continue;
+            worker_thread_entry_arg_t *worker = &pool->worker_pool->workers[i];
+            if (worker->state != WORKER_SLOT_EMPTY)
+            {
+                pthread_join(worker->thread, NULL);
+            }
+            worker->state = WORKER_SLOT_EMPTY;
         }
-        pthread_cancel(*(pool->worker_pool->worker_threads[i]));
-        free(pool->worker_pool->worker_threads[i]);
     }
-    free(pool->worker_pool->worker_threads);
+
+    stop_timers(pool->worker_pool);
+    thread_pool_timer_t *timer = pool->worker_pool->timers;
+    while (timer)
+    {
+        thread_pool_timer_t *next = timer->live_next;
+        free(timer);
+        timer = next;
+    }
+    free(pool->worker_pool->m_timers);
+    free(pool->worker_pool->c_timers);
+    free(pool->worker_pool->wheel);
+
+    free(pool->worker_pool->c_done);
+    free(pool->worker_pool->m_done);
+    free(pool->worker_pool->idle_stack);
+    free(pool->worker_pool->m_idle);
+    free(pool->worker_pool->m_resize);
+    free(pool->worker_pool->c_space);
+    _destroy_trace(pool->worker_pool->trace);
+    free(pool->worker_pool->trace_path);
+    _destroy_metrics(pool->worker_pool->outside_metrics);
+
     _destroy_task_queue(pool->worker_pool->task_queue);
+    for (unsigned int i = 0; i < pool->worker_pool->worker_count; i++)
+    {
+        _destroy_parker(&pool->worker_pool->workers[i].parker);
+        for (unsigned int lane = 0; lane < TASK_PRIORITIES; lane++)
+            _destroy_task_deque(pool->worker_pool->workers[i].deques[lane]);
+        _destroy_object_cache(pool->worker_pool->objects, pool->worker_pool->workers[i].cache);
+        _destroy_metrics(pool->worker_pool->workers[i].metrics);
+    }
+    free(pool->worker_pool->workers);
+    _destroy_object_pool(pool->worker_pool->objects);
+    _destroy_placement(&pool->worker_pool->placement);
     free(pool->worker_pool);
 
-    // Others
-    pthread_cancel(*(pool->watcher_thread));
-    free(pool->watcher_thread);
-
     free(pool);
 }
 
-typedef struct
+long monotonic_ns()
 {
-    int id;
-    worker_pool_t *worker_pool;
-} worker_thread_entry_arg_t;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
 
-void *get_tasks(void *arg)
+long thread_cpu_ns()
 {
-    worker_thread_entry_arg_t *thread_entry_arg = (worker_thread_entry_arg_t *)arg;
-    worker_pool_t *worker_pool = thread_entry_arg->worker_pool;
-    task_queue_t *task_queue = worker_pool->task_queue;
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
 
-    int id = thread_entry_arg->id;
+int is_elastic(worker_pool_t *worker_pool)
+{
+    return worker_pool->min_workers < worker_pool->worker_count;
+}
 
-    for (;;)
+// Has to happen before the tasks become visible to workers, so the counter
+// can't drop to 0 while some of them are still queued
+void tasks_submitted(worker_pool_t *worker_pool, unsigned int n)
+{
+    atomic_fetch_add(&worker_pool->outstanding, n);
+}
+
+void tasks_finished(worker_pool_t *worker_pool, unsigned int n)
+{
+    long left = atomic_fetch_sub(&worker_pool->outstanding, n) - n;
+    if (atomic_load(&worker_pool->space_waiters) > 0)
     {
-        pthread_mutex_lock(task_queue->m_lock);
-        while (!task_queue->is_stopped && task_queue->count == 0)
-        {
-            pthread_cond_wait(task_queue->c_updated, task_queue->m_lock);
-        }
+        profiled_mutex_lock(worker_pool->m_done);
+        pthread_cond_broadcast(worker_pool->c_space);
+        profiled_mutex_unlock(worker_pool->m_done);
+    }
+    if (left != 0)
+    {
+        return;
+    }
+    profiled_mutex_lock(worker_pool->m_done);
+    pthread_cond_broadcast(worker_pool->c_done);
+    profiled_mutex_unlock(worker_pool->m_done);
+}
 
-        if (task_queue->is_stopped)
+int has_pending_tasks(worker_pool_t *worker_pool)
+{
+    for (unsigned int i = 0; i < worker_pool->worker_count; i++)
+    {
+        for (unsigned int lane = 0; lane < TASK_PRIORITIES; lane++)
         {
-            pthread_mutex_unlock(task_queue->m_lock);
-            break;
+            if (_task_deque_size(worker_pool->workers[i].deques[lane]) > 0)
+            {
+                return 1;
+            }
         }
+    }
+    return _task_queue_count_locked(worker_pool->task_queue) > 0;
+}
 
-        int (*task_func)(task_queue_entry_arg_t *);
-        task_queue_entry_arg_t *task_arg;
+int is_stopped(worker_pool_t *worker_pool)
+{
+    return worker_pool->task_queue->is_stopped;
+}
+
+// m_resize has to be held
+int spawn_worker(worker_pool_t *worker_pool, worker_thread_entry_arg_t *worker)
+{
+    if (worker->state == WORKER_SLOT_EXITED)
+    {
+        pthread_join(worker->thread, NULL);
+        worker->state = WORKER_SLOT_EMPTY;
+    }
+    // Placed before it starts, so even its stack is on the right node
+    pthread_attr_t attr;
+    if (pthread_attr_init(&attr))
+    {
+        return FATAL_ERROR;
+    }
+    int err = _place_thread_attr(&worker_pool->placement, worker->id, &attr);
+    worker->state = WORKER_SLOT_RUNNING;
+    if (err || pthread_create(&worker->thread, &attr, get_tasks, worker))
+    {
+        worker->state = WORKER_SLOT_EMPTY;
+        err = FATAL_ERROR;
+    }
+    pthread_attr_destroy(&attr);
+    return err;
+}
 
-        pthread_mutex_lock(worker_pool->m_busy_threads);
-        *worker_pool->busy_threads |= (1 << id);
-        pthread_cond_broadcast(worker_pool->c_busy_threads);
-        pthread_mutex_unlock(worker_pool->m_busy_threads);
+// Folds the time a task spent off the CPU into the pool wide estimate
+void sample_blocked_time(worker_pool_t *worker_pool, long wall_ns, long cpu_ns)
+{
+    if (wall_ns <= 0)
+    {
+        return;
+    }
+    long blocked = wall_ns > cpu_ns ? (wall_ns - cpu_ns) * 1000 / wall_ns : 0;
+    unsigned int previous = atomic_load_explicit(&worker_pool->blocked_permille, memory_order_relaxed);
+    // Lost updates between racing workers don't matter for an estimate
+    atomic_store_explicit(&worker_pool->blocked_permille, (previous * 7 + blocked) / 8, memory_order_relaxed);
+}
 
-        int err = _dequeue_task(task_queue, &task_func, &task_arg);
-        pthread_mutex_unlock(task_queue->m_lock);
+// Called when no worker is idle. Adds a worker if tasks are backing up while
+// the running ones are mostly blocked.
+void grow_workers(worker_pool_t *worker_pool)
+{
+    if (!is_elastic(worker_pool) ||
+        atomic_load_explicit(&worker_pool->active_workers, memory_order_relaxed) >= worker_pool->worker_count)
+    {
+        return;
+    }
 
-        if (err != 0)
-        {
-            pthread_mutex_unlock(worker_pool->m_busy_threads);
-            log_error("Thread %d: Failed to dequeue task: %d\n", id, err);
-            break;
-        }
-        if (task_func && task_arg)
-        {
-            task_arg->id = id;
+    long now = monotonic_ns();
+    long last = atomic_load_explicit(&worker_pool->last_grow_ns, memory_order_relaxed);
+    if (now - last < GROW_INTERVAL_NS ||
+        !atomic_compare_exchange_strong(&worker_pool->last_grow_ns, &last, now))
+    {
+        return;
+    }
 
-            int err = task_func(task_arg);
-            if (err)
+    unsigned int active = atomic_load(&worker_pool->active_workers);
+    long backlog = atomic_load(&worker_pool->outstanding) - active;
+    if (backlog <= (long)active ||
+        atomic_load_explicit(&worker_pool->blocked_permille, memory_order_relaxed) < GROW_BLOCKED_PERMILLE)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(worker_pool->m_resize);
+    if (!is_stopped(worker_pool) && atomic_load(&worker_pool->active_workers) < worker_pool->worker_count)
+    {
+        for (unsigned int i = 0; i < worker_pool->worker_count; i++)
+        {
+            worker_thread_entry_arg_t *worker = &worker_pool->workers[i];
+            if (worker->state == WORKER_SLOT_RUNNING)
             {
-                log_error("Thread %d: Task function failed with error: %d\n", id, err);
-                break;
+                continue;
+            }
+            if (spawn_worker(worker_pool, worker) == 0)
+            {
+                unsigned int workers = atomic_fetch_add(&worker_pool->active_workers, 1) + 1;
+                if (workers > worker_pool->peak_workers)
+                {
+                    worker_pool->peak_workers = workers;
+                }
+                worker_pool->grow_events++;
+                log_info("Thread %u added, %u workers for a backlog of %ld tasks\n", i, workers, backlog);
             }
+            break;
         }
-        pthread_mutex_lock(worker_pool->m_busy_threads);
-        *worker_pool->busy_threads ^= (1 << id);
-        pthread_cond_broadcast(worker_pool->c_busy_threads);
-        pthread_mutex_unlock(worker_pool->m_busy_threads);
     }
-    log_info("Thread %d finished\n", id);
+    pthread_mutex_unlock(worker_pool->m_resize);
 }
 
-void *watch_threads(void *arg)
+// An idle worker may leave as long as the pool stays at its minimum
+int release_worker(worker_pool_t *worker_pool)
 {
-    thread_pool_t *pool = (thread_pool_t *)arg;
-    worker_pool_t *worker_pool = pool->worker_pool;
-    task_queue_t *task_queue = worker_pool->task_queue;
-
-    int busy_threads_count;
-    log_info("Watcher Thread started...\n");
-    // printf("%s Busy Threads: 0\n%s Open Tasks: \033[s0", DEBUG, DEBUG);
-    for (;;)
+    unsigned int active = atomic_load(&worker_pool->active_workers);
+    while (active > worker_pool->min_workers)
     {
-        pthread_mutex_lock(worker_pool->m_busy_threads);
-        while(*worker_pool->busy_threads)
+        if (atomic_compare_exchange_weak(&worker_pool->active_workers, &active, active - 1))
         {
-            pthread_cond_wait(worker_pool->c_busy_threads, worker_pool->m_busy_threads);
+            return 1;
         }
-        pthread_mutex_unlock(worker_pool->m_busy_threads);
+    }
+    return 0;
+}
 
-        pthread_mutex_lock(task_queue->m_lock);
-        if (!task_queue->is_started || task_queue->count)
-        {
-            pthread_mutex_unlock(task_queue->m_lock);
-            continue;
-        }
+// m_idle has to be held
+void push_idle_worker(worker_pool_t *worker_pool, worker_thread_entry_arg_t *worker)
+{
+    worker->idle_index = worker_pool->idle_count;
+    worker_pool->idle_stack[worker_pool->idle_count++] = worker;
+    atomic_fetch_add(&worker_pool->idle_workers, 1);
+}
 
-        log_info("All tasks completed, stopping task queue...\n");
+// m_idle has to be held
+void remove_idle_worker(worker_pool_t *worker_pool, worker_thread_entry_arg_t *worker)
+{
+    // Timeouts are rare, keep the order of the others intact
+    for (unsigned int i = worker->idle_index; i + 1 < worker_pool->idle_count; i++)
+    {
+        worker_pool->idle_stack[i] = worker_pool->idle_stack[i + 1];
+        worker_pool->idle_stack[i]->idle_index = i;
+    }
+    worker_pool->idle_count--;
+    worker->idle_index = -1;
+    atomic_fetch_sub(&worker_pool->idle_workers, 1);
+}
 
-        int err = _stop_task_queue(task_queue);
-        if (err)
-        {
-            log_info("Failed to stop task queue: %d\n", err);
-        }
+// m_idle has to be held
+void unpark_idle_worker(worker_pool_t *worker_pool)
+{
+    worker_thread_entry_arg_t *worker = worker_pool->idle_stack[worker_pool->idle_count - 1];
+    remove_idle_worker(worker_pool, worker);
+    _unpark(&worker->parker);
+}
 
-        pthread_cond_broadcast(task_queue->c_updated);
-        pthread_mutex_unlock(task_queue->m_lock);
-        break;
+// Wakes exactly one parked worker per new task, never more than are parked
+void wake_workers(worker_pool_t *worker_pool, unsigned int n)
+{
+    // Pairs with the increment in wait_for_tasks, either the sleeper sees the
+    // new task or we see the sleeper
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&worker_pool->idle_workers) == 0)
+    {
+        grow_workers(worker_pool);
+        return;
     }
-    log_info("Waiting for worker threads to finish...\n");
-    for (int i = 0; i < worker_pool->worker_count; i++)
+    pthread_mutex_lock(worker_pool->m_idle);
+    for (unsigned int i = 0; i < n && worker_pool->idle_count > 0; i++)
     {
-        pthread_join(*(worker_pool->worker_threads[i]), NULL);
+        unpark_idle_worker(worker_pool);
     }
-    _destroy_task_queue(task_queue);
-    worker_pool->task_queue = NULL;
-    log_info("Watcher Thread exiting...\n");
+    pthread_mutex_unlock(worker_pool->m_idle);
 }
 
-thread_pool_t *create_thread_pool(unsigned short thread_count, thread_pool_creation_status_t *status)
+void wake_all_workers(worker_pool_t *worker_pool)
 {
-    *status = MAX_THREAD_AMOUNT_EXCEEDED;
-    if (thread_count <= 0 || thread_count >= sizeof(unsigned int) * 8)
+    pthread_mutex_lock(worker_pool->m_idle);
+    while (worker_pool->idle_count > 0)
     {
-        return NULL;
+        unpark_idle_worker(worker_pool);
     }
+    pthread_mutex_unlock(worker_pool->m_idle);
+}
 
-    // --
-    // -- MALLOC
-    // --
+// idle_since is when the worker last ran out of tasks, elastic pools retire
+// it once it has been idle for longer than the timeout
+int wait_for_tasks(worker_thread_entry_arg_t *self, long *idle_since)
+{
+    worker_pool_t *worker_pool = self->worker_pool;
 
-    *status = OUT_OF_MEMORY;
-    task_queue_t *task_queue = _create_task_queue();
-    if (!task_queue)
+    _arm_parker(&self->parker);
+    pthread_mutex_lock(worker_pool->m_idle);
+    push_idle_worker(worker_pool, self);
+    if (is_stopped(worker_pool) || has_pending_tasks(worker_pool))
     {
-        return NULL;
+        remove_idle_worker(worker_pool, self);
+        pthread_mutex_unlock(worker_pool->m_idle);
+        return is_stopped(worker_pool) ? QUEUE_STOPPED : 0;
     }
+    pthread_mutex_unlock(worker_pool->m_idle);
 
-    pthread_t **worker_threads = malloc(thread_count * sizeof(pthread_t *));
-    if (!worker_threads)
+    long deadline = is_elastic(worker_pool) ? *idle_since + worker_pool->idle_timeout_ns : 0;
+    if (_park(&self->parker, deadline) == PARKER_TIMED_OUT)
     {
-        _destroy_task_queue(task_queue);
-        return NULL;
+        // Whoever unparks a worker takes it off the stack, after a timeout
+        // it may still be on there
+        int timed_out = 0;
+        pthread_mutex_lock(worker_pool->m_idle);
+        if (self->idle_index >= 0)
+        {
+            remove_idle_worker(worker_pool, self);
+            timed_out = 1;
+        }
+        pthread_mutex_unlock(worker_pool->m_idle);
+
+        if (timed_out && !is_stopped(worker_pool) && !has_pending_tasks(worker_pool))
+        {
+            if (release_worker(worker_pool))
+            {
+                return WORKER_RETIRED;
+            }
+            // At the minimum already, start over with a fresh timeout
+            *idle_since = monotonic_ns();
+        }
     }
+    return is_stopped(worker_pool) ? QUEUE_STOPPED : 0;
+}
 
-    thread_pool_t *pool = malloc(sizeof(thread_pool_t));
-    worker_pool_t *worker_pool = malloc(sizeof(worker_pool_t));
-    pthread_t *watcher_thread = malloc(sizeof(pthread_t));
-    pthread_cond_t *c_busy_threads = malloc(sizeof(pthread_cond_t));
-    pthread_mutex_t *m_busy_threads = malloc(sizeof(pthread_mutex_t));
-    unsigned int *busy_threads = malloc(sizeof(unsigned int));
+// self is NULL for threads outside of the pool, those have no deque of their own
+int find_task(worker_pool_t *worker_pool, worker_thread_entry_arg_t *self, unsigned int *seed, int (**task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **task_arg)
+{
+    task_queue_entry_t *entry = NULL;
 
-    unsigned short all_workers_mallocd = 1;
-    for (int i = 0; i < thread_count; i++)
+    // Priorities order the tasks within each source, a worker still prefers
+    // its own tasks over the shared queue and both over stealing
+    unsigned int used_lanes = atomic_load_explicit(&worker_pool->used_lanes, memory_order_relaxed);
+
+    // Newest local task first, its data is most likely still in cache
+    int err = QUEUE_EMPTY;
+    for (int lane = TASK_PRIORITY_HIGHEST; self && err != 0 && lane >= 0; lane--)
+    {
+        if (used_lanes & (1u << lane))
+            err = _pop_task_deque(self->deques[lane], &entry);
+    }
+    if (err != 0)
     {
-        worker_threads[i] = malloc(sizeof(pthread_t));
-        if (!worker_threads[i])
+        err = _dequeue_task_locked(worker_pool->task_queue, task_func, task_arg);
+        if (err == 0)
         {
-            all_workers_mallocd = 0;
-            break;
+            return 0;
         }
     }
 
-    if (
-        !pool ||
-        !worker_pool ||
-        !watcher_thread ||
-        !c_busy_threads ||
-        !m_busy_threads ||
-        !busy_threads ||
-        !all_workers_mallocd)
+    // Oldest task of a random victim, those tend to spawn the most work
+    unsigned int start = rand_r(seed) % worker_pool->worker_count;
+    for (int lane = TASK_PRIORITY_HIGHEST; err != 0 && lane >= 0; lane--)
     {
-        _destroy_task_queue(task_queue);
-        if (pool)
-            free(pool);
-        if (worker_pool)
-            free(worker_pool);
-        if (watcher_thread)
-            free(watcher_thread);
-        if (c_busy_threads)
-            free(c_busy_threads);
-        if (m_busy_threads)
-            free(m_busy_threads);
-        if (busy_threads)
-            free(busy_threads);
-        for (int i = 0; i < thread_count; i++)
-        {
-            if (worker_threads[i])
-                free(worker_threads[i]);
+        if (!(used_lanes & (1u << lane)))
+            continue;
+        for (unsigned int i = 0; err != 0 && i < worker_pool->worker_count; i++)
+        {
+            worker_thread_entry_arg_t *victim = &worker_pool->workers[(start + i) % worker_pool->worker_count];
+            if (victim == self)
+            {
+                continue;
+            }
+            err = _steal_task_deque(victim->deques[lane], &entry);
+            if (err == 0)
+            {
+                worker_metrics_t *metrics = self ? self->metrics : worker_pool->outside_metrics;
+                _count_metric(metrics, &metrics->steals, 1);
+            }
         }
-        return NULL;
     }
-    *busy_threads = 0;
-
-    pool->thread_count = thread_count + 2;
-    pool->watcher_thread = watcher_thread;
-    pool->worker_pool = worker_pool;
-
-    worker_pool->busy_threads = busy_threads;
-    worker_pool->c_busy_threads = c_busy_threads;
-    worker_pool->m_busy_threads = m_busy_threads;
-    worker_pool->task_queue = task_queue;
-    worker_pool->worker_count = thread_count;
-    worker_pool->worker_threads = worker_threads;
 
-    // --
-    // -- CREATE THREADS
-    // --
-    *status = THREAD_CREATION_FAILED;
+    if (err != 0)
+    {
+        return QUEUE_EMPTY;
+    }
+    *task_func = entry->task_func;
+    *task_arg = entry->arg;
+    _free_task_queue_entry(worker_pool->objects, self ? self->cache : NULL, entry);
+    return 0;
+}
 
-    if (
-        pthread_cond_init(c_busy_threads, NULL) ||
-        pthread_mutex_init(m_busy_threads, NULL))
+// Drops one pending count of arg, the last one schedules its continuation
+void release_task(worker_pool_t *worker_pool, task_queue_entry_arg_t *arg)
+{
+    if (atomic_fetch_sub(&arg->pending, 1) != 1)
     {
-        free_pool(pool);
-        return NULL;
+        return;
     }
+    int (*continuation)(task_queue_entry_arg_t *) = arg->continuation;
+    arg->continuation = NULL;
+    arg->continuing = 1;
+    // Finishing a subtree frees its memory, that goes before new work
+    arg->priority = TASK_PRIORITY_HIGHEST;
+    if (submit_task(worker_pool, continuation, arg))
+    {
+        // Queue is full or stopped, the subtree still has to be completed
+        tasks_submitted(worker_pool, 1);
+        int own = current_worker && current_worker->worker_pool == worker_pool;
+        run_task(worker_pool, own ? current_worker->id : worker_pool->worker_count, continuation, arg);
+        tasks_finished(worker_pool, 1);
+    }
+}
+
+// Runs a task and settles its place in the task tree. A task that set a
+// continuation is done once that has run, anything else when it returns.
+int run_task(worker_pool_t *worker_pool, unsigned int id, int (*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    // Read up front, a task without continuation may free its arg
+    task_queue_entry_arg_t *parent = arg->parent;
+    arg->id = id;
+    arg->context = id < worker_pool->worker_count ? worker_pool->workers[id].context : NULL;
 
-    for (int i = 0; i < thread_count; i++)
+    // Continuations always run, they release what the subtree held
+    if (!arg->continuing && is_cancelled(arg->token))
     {
-        worker_thread_entry_arg_t *thread_entry_arg = malloc(sizeof(worker_thread_entry_arg_t));
-        if (!thread_entry_arg)
+        cancel_token_t *token = arg->token;
+        atomic_fetch_add_explicit(&token->dropped, 1, memory_order_relaxed);
+        if (token->on_drop)
         {
-            *status = OUT_OF_MEMORY;
-            free_pool(pool);
-            return NULL;
+            token->on_drop(arg);
         }
-        thread_entry_arg->worker_pool = worker_pool;
-        thread_entry_arg->id = i;
-        if (pthread_create(worker_threads[i], NULL, get_tasks, thread_entry_arg))
+        if (parent)
         {
-            free_pool(pool);
-            return NULL;
+            release_task(worker_pool, parent);
         }
+        return 0;
     }
+    int continuing = arg->continuing;
+    arg->continuing = 0;
 
-    if (pthread_create(watcher_thread, NULL, watch_threads, pool))
+    // Only sampled tasks carry an enqueue time
+    worker_metrics_t *metrics = slot_metrics(worker_pool, id);
+    long enqueued_ns = arg->enqueued_ns;
+    long start_ns = enqueued_ns || worker_pool->trace ? monotonic_ns() : 0;
+    if (enqueued_ns)
     {
-        free_pool(pool);
-        return NULL;
+        _record_histogram(metrics, &metrics->queue_wait, start_ns - enqueued_ns);
     }
 
-    *status = CREATED;
+    trace_span_t *outer_span = current_span;
+    current_span = NULL;
+    if (worker_pool->trace)
+    {
+        current_span = _trace_begin(worker_pool->trace, id, enqueued_ns, start_ns);
+        if (current_span && continuing)
+        {
+            _trace_label(current_span, "continuation");
+        }
+    }
 
-    log_info("Thread Pool created with %hu threads\n", thread_count);
+    int outer_continuation_set = continuation_set;
+    continuation_set = 0;
+    int err = task_func(arg);
+    int continued = continuation_set;
+    continuation_set = outer_continuation_set;
 
-    return pool;
+    long end_ns = start_ns ? monotonic_ns() : 0;
+    if (enqueued_ns)
+    {
+        _record_histogram(metrics, &metrics->run_time, end_ns - start_ns);
+    }
+    _count_metric(metrics, &metrics->tasks_run, 1);
+    if (current_span)
+    {
+        current_span->end_ns = end_ns;
+    }
+    current_span = outer_span;
+
+    if (continued)
+    {
+        release_task(worker_pool, arg);
+    }
+    else if (parent)
+    {
+        release_task(worker_pool, parent);
+    }
+    return err;
 }
 
-int enqueue_task(thread_pool_t *pool, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg) {
-    if (!pool || !pool->worker_pool)
-        return ILLEGAL_ARGS;
-    return _enqueue_task_locked(pool->worker_pool->task_queue, task_func, arg);
+int spin_for_task(worker_thread_entry_arg_t *self, unsigned int *seed, int (**task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t **task_arg)
+{
+    for (int i = 0; i < SPIN_ATTEMPTS; i++)
+    {
+        for (int j = 0; j < SPIN_PAUSES; j++)
+        {
+            _cpu_relax();
+        }
+        if (is_stopped(self->worker_pool))
+        {
+            break;
+        }
+        if (find_task(self->worker_pool, self, seed, task_func, task_arg) == 0)
+        {
+            return 0;
+        }
+    }
+    return QUEUE_EMPTY;
 }
 
-int join(thread_pool_t *pool) {
-    if (!pool || !pool->worker_pool)
-        return ILLEGAL_ARGS;
-    int result = pthread_join(*(pool->watcher_thread), NULL);
-    if (result)
-        return result;
-    free_pool(pool);
-    return 0;
-}
\ No newline at end of file
+void *get_tasks(void *arg)
+{
+    worker_thread_entry_arg_t *thread_entry_arg = (worker_thread_entry_arg_t *)arg;
+    worker_pool_t *worker_pool = thread_entry_arg->worker_pool;
+
+    unsigned int id = thread_entry_arg->id;
+    unsigned int seed = id * 2654435761u + 1;
+    current_worker = thread_entry_arg;
+    if (worker_pool->worker_init)
+    {
+        thread_entry_arg->context = worker_pool->worker_init(id, worker_pool->worker_user_data);
+    }
+
+    int elastic = is_elastic(worker_pool);
+    unsigned int tasks_run = 0;
+    long idle_since = 0;
+    // idle_since restarts with every timeout, this marks the whole idle period
+    long idle_begin = 0;
+    int retired = 0;
+    for (;;)
+    {
+        int (*task_func)(task_queue_entry_arg_t *);
+        task_queue_entry_arg_t *task_arg;
+
+        if (find_task(worker_pool, thread_entry_arg, &seed, &task_func, &task_arg) != 0 &&
+            spin_for_task(thread_entry_arg, &seed, &task_func, &task_arg) != 0)
+        {
+            if (!idle_since)
+            {
+                idle_since = monotonic_ns();
+                idle_begin = idle_since;
+            }
+            int err = wait_for_tasks(thread_entry_arg, &idle_since);
+            if (err == QUEUE_STOPPED)
+            {
+                break;
+            }
+            if (err == WORKER_RETIRED)
+            {
+                retired = 1;
+                break;
+            }
+            continue;
+        }
+        if (idle_begin)
+        {
+            _count_metric(thread_entry_arg->metrics, &thread_entry_arg->metrics->idle_ns, monotonic_ns() - idle_begin);
+            idle_begin = 0;
+        }
+        idle_since = 0;
+
+        if (task_func && task_arg)
+        {
+            int sample = elastic && ++tasks_run % BLOCKED_SAMPLE_INTERVAL == 0;
+            long wall_begin = 0, cpu_begin = 0;
+            if (sample)
+            {
+                wall_begin = monotonic_ns();
+                cpu_begin = thread_cpu_ns();
+            }
+
+            int err = run_task(worker_pool, id, task_func, task_arg);
+
+            if (sample)
+            {
+                sample_blocked_time(worker_pool, monotonic_ns() - wall_begin, thread_cpu_ns() - cpu_begin);
+                // A backlog that was queued up front produces no new enqueues
+                // to trigger growth, so the workers draining it check as well
+                if (atomic_load(&worker_pool->idle_workers) == 0)
+                {
+                    grow_workers(worker_pool);
+                }
+            }
+            if (err)
+            {
+                log_error("Thread %u: Task function failed with error: %d\n", id, err);
+            }
+        }
+        tasks_finished(worker_pool, 1);
+    }
+    if (worker_pool->worker_teardown)
+    {
+        worker_pool->worker_teardown(id, thread_entry_arg->context, worker_pool->worker_user_data);
+    }
+    thread_entry_arg->context = NULL;
+    current_worker = NULL;
+    if (idle_begin)
+    {
+        _count_metric(thread_entry_arg->metrics, &thread_entry_arg->metrics->idle_ns, monotonic_ns() - idle_begin);
+    }
+
+    if (retired)
+    {
+        // The slot keeps its deque and cache for the next worker using it
+        pthread_mutex_lock(worker_pool->m_resize);
+        thread_entry_arg->state = WORKER_SLOT_EXITED;
+        worker_pool->shrink_events++;
+        pthread_mutex_unlock(worker_pool->m_resize);
+        log_info("Thread %u retired after being idle\n", id);
+        return NULL;
+    }
+    log_info("Thread %u finished\n", id);
+    return NULL;
+}
+
+int has_deques(worker_thread_entry_arg_t *worker)
+{
+    for (unsigned int lane = 0; lane < TASK_PRIORITIES; lane++)
+    {
+        if (!worker->deques[lane])
+            return 0;
+    }
+    return 1;
+}
+
+// Runs on the node a slot is placed on, the allocator hands a new thread
+// fresh pages that it then touches first
+void *create_worker_memory(void *arg)
+{
+    worker_thread_entry_arg_t *worker = (worker_thread_entry_arg_t *)arg;
+    for (unsigned int lane = 0; lane < TASK_PRIORITIES; lane++)
+        worker->deques[lane] = _create_task_deque();
+    worker->cache = _create_object_cache();
+    worker->metrics = _create_metrics(0);
+    return NULL;
+}
+
+thread_pool_t *create_thread_pool(unsigned int thread_count, thread_pool_creation_status_t *status)
+{
+    thread_pool_options_t options = {
+        .thread_count = thread_count,
+        .queue_backend = TASK_QUEUE_LOCKED,
+        .queue_capacity = 0,
+    };
+    return create_thread_pool_with_options(&options, status);
+}
+
+thread_pool_t *create_thread_pool_with_options(const thread_pool_options_t *options, thread_pool_creation_status_t *status)
+{
+    *status = INVALID_OPTIONS;
+    if (!options || (options->queue_backend != TASK_QUEUE_LOCKED && options->queue_backend != TASK_QUEUE_LOCK_FREE))
+    {
+        return NULL;
+    }
+    unsigned int thread_count = options->thread_count;
+    unsigned int min_threads = options->min_threads ? options->min_threads : thread_count;
+    unsigned int max_threads = options->max_threads ? options->max_threads : thread_count;
+
+    *status = MAX_THREAD_AMOUNT_EXCEEDED;
+    if (thread_count == 0)
+    {
+        return NULL;
+    }
+    *status = INVALID_OPTIONS;
+    if (min_threads > thread_count || thread_count > max_threads)
+    {
+        return NULL;
+    }
+    if (options->full_policy != THREAD_POOL_FULL_FAIL &&
+        options->full_policy != THREAD_POOL_FULL_BLOCK &&
+        options->full_policy != THREAD_POOL_FULL_RUN_INLINE)
+    {
+        return NULL;
+    }
+
+    // --
+    // -- MALLOC
+    // --
+
+    worker_placement_t placement;
+    int err = _init_placement(&placement, options->placement, options->cpu_list);
+    if (err == ILLEGAL_ARGS)
+    {
+        return NULL;
+    }
+    *status = OUT_OF_MEMORY;
+    if (err)
+    {
+        return NULL;
+    }
+
+    object_pool_t *objects = _create_object_pool();
+    if (!objects)
+    {
+        _destroy_placement(&placement);
+        return NULL;
+    }
+
+    task_queue_t *task_queue = _create_task_queue(options->queue_backend, options->queue_capacity, objects);
+    if (!task_queue)
+    {
+        _destroy_object_pool(objects);
+        _destroy_placement(&placement);
+        return NULL;
+    }
+
+    worker_thread_entry_arg_t *workers = calloc(max_threads, sizeof(worker_thread_entry_arg_t));
+    if (!workers)
+    {
+        _destroy_task_queue(task_queue);
+        _destroy_object_pool(objects);
+        _destroy_placement(&placement);
+        return NULL;
+    }
+
+    thread_pool_t *pool = malloc(sizeof(thread_pool_t));
+    worker_pool_t *worker_pool = malloc(sizeof(worker_pool_t));
+    pthread_cond_t *c_done = malloc(sizeof(pthread_cond_t));
+    profiled_mutex_t *m_done = malloc(sizeof(profiled_mutex_t));
+    worker_thread_entry_arg_t **idle_stack = calloc(max_threads, sizeof(worker_thread_entry_arg_t *));
+    pthread_mutex_t *m_idle = malloc(sizeof(pthread_mutex_t));
+    pthread_mutex_t *m_resize = malloc(sizeof(pthread_mutex_t));
+    pthread_cond_t *c_space = malloc(sizeof(pthread_cond_t));
+    timer_wheel_t *wheel = malloc(sizeof(timer_wheel_t));
+    pthread_mutex_t *m_timers = malloc(sizeof(pthread_mutex_t));
+    pthread_cond_t *c_timers = malloc(sizeof(pthread_cond_t));
+    trace_t *trace = NULL;
+    char *trace_path = NULL;
+    unsigned short trace_mallocd = 1;
+    worker_metrics_t *outside_metrics = _create_metrics(1);
+    if (options->trace_path)
+    {
+        trace = _create_trace(max_threads, monotonic_ns());
+        trace_path = strdup(options->trace_path);
+        trace_mallocd = trace && trace_path;
+    }
+
+    unsigned short all_workers_mallocd = 1;
+    unsigned int parkers = 0;
+    for (unsigned int i = 0; i < max_threads; i++)
+    {
+        workers[i].id = i;
+        if (_run_placed(&placement, i, create_worker_memory, &workers[i]) ||
+            !has_deques(&workers[i]) || !workers[i].cache || !workers[i].metrics || _init_parker(&workers[i].parker))
+        {
+            all_workers_mallocd = 0;
+            break;
+        }
+        parkers++;
+    }
+
+    if (
+        !pool ||
+        !worker_pool ||
+        !c_done ||
+        !m_done ||
+        !idle_stack ||
+        !m_idle ||
+        !m_resize ||
+        !c_space ||
+        !wheel ||
+        !m_timers ||
+        !c_timers ||
+        !trace_mallocd ||
+        !outside_metrics ||
+        !all_workers_mallocd)
+    {
+        _destroy_task_queue(task_queue);
+        if (pool)
+            free(pool);
+        if (worker_pool)
+            free(worker_pool);
+        if (c_done)
+            free(c_done);
+        if (m_done)
+            free(m_done);
+        if (idle_stack)
+            free(idle_stack);
+        if (m_idle)
+            free(m_idle);
+        if (m_resize)
+            free(m_resize);
+        if (c_space)
+            free(c_space);
+        free(wheel);
+        free(m_timers);
+        free(c_timers);
+        _destroy_trace(trace);
+        free(trace_path);
+        _destroy_metrics(outside_metrics);
+        for (unsigned int i = 0; i < max_threads; i++)
+        {
+            if (i < parkers)
+                _destroy_parker(&workers[i].parker);
+            for (unsigned int lane = 0; lane < TASK_PRIORITIES; lane++)
+            {
+                if (workers[i].deques[lane])
+                    _destroy_task_deque(workers[i].deques[lane]);
+            }
+            if (workers[i].cache)
+                _destroy_object_cache(objects, workers[i].cache);
+            _destroy_metrics(workers[i].metrics);
+        }
+        free(workers);
+        _destroy_object_pool(objects);
+        _destroy_placement(&placement);
+        return NULL;
+    }
+
+    pool->thread_count = thread_count;
+    pool->worker_pool = worker_pool;
+
+    atomic_init(&worker_pool->outstanding, 0);
+    worker_pool->c_done = c_done;
+    worker_pool->m_done = m_done;
+    worker_pool->idle_stack = idle_stack;
+    worker_pool->idle_count = 0;
+    worker_pool->m_idle = m_idle;
+    atomic_init(&worker_pool->idle_workers, 0);
+    worker_pool->task_queue = task_queue;
+    worker_pool->objects = objects;
+    worker_pool->worker_count = max_threads;
+    worker_pool->workers = workers;
+
+    worker_pool->m_resize = m_resize;
+    worker_pool->min_workers = min_threads;
+    worker_pool->idle_timeout_ns = (long)(options->idle_timeout_ms ? options->idle_timeout_ms : DEFAULT_IDLE_TIMEOUT_MS) * 1000000L;
+    atomic_init(&worker_pool->active_workers, 0);
+    atomic_init(&worker_pool->last_grow_ns, 0);
+    atomic_init(&worker_pool->blocked_permille, 0);
+    worker_pool->peak_workers = thread_count;
+    worker_pool->grow_events = 0;
+    worker_pool->shrink_events = 0;
+    worker_pool->placement = placement;
+    atomic_init(&worker_pool->used_lanes, 0);
+    worker_pool->max_pending = options->max_pending;
+    worker_pool->full_policy = options->full_policy;
+    worker_pool->c_space = c_space;
+    atomic_init(&worker_pool->space_waiters, 0);
+    worker_pool->trace = trace;
+    worker_pool->trace_path = trace_path;
+    worker_pool->outside_metrics = outside_metrics;
+    worker_pool->worker_init = options->worker_init;
+    worker_pool->worker_teardown = options->worker_teardown;
+    worker_pool->worker_user_data = options->worker_user_data;
+    _init_timer_wheel(wheel, monotonic_ns());
+    worker_pool->wheel = wheel;
+    worker_pool->timers = NULL;
+    worker_pool->m_timers = m_timers;
+    worker_pool->c_timers = c_timers;
+    worker_pool->timer_thread_started = 0;
+    worker_pool->timers_stopped = 0;
+    worker_pool->timer_wake_tick = -1;
+
+    for (unsigned int i = 0; i < max_threads; i++)
+    {
+        workers[i].worker_pool = worker_pool;
+        workers[i].id = i;
+        workers[i].state = WORKER_SLOT_EMPTY;
+        workers[i].idle_index = -1;
+    }
+
+    // --
+    // -- CREATE THREADS
+    // --
+    *status = THREAD_CREATION_FAILED;
+
+    if (
+        pthread_cond_init(c_done, NULL) ||
+        profiled_mutex_init(m_done, "pool_done") ||
+        pthread_mutex_init(m_idle, NULL) ||
+        pthread_mutex_init(m_resize, NULL) ||
+        pthread_cond_init(c_space, NULL) ||
+        pthread_mutex_init(m_timers, NULL) ||
+        _init_monotonic_cond(c_timers))
+    {
+        free_pool(pool);
+        return NULL;
+    }
+
+    pthread_mutex_lock(m_resize);
+    for (unsigned int i = 0; i < thread_count; i++)
+    {
+        if (spawn_worker(worker_pool, &workers[i]))
+        {
+            pthread_mutex_unlock(m_resize);
+            free_pool(pool);
+            return NULL;
+        }
+        atomic_fetch_add(&worker_pool->active_workers, 1);
+    }
+    pthread_mutex_unlock(m_resize);
+
+    *status = CREATED;
+
+    if (_is_placed(&placement))
+        log_info("Workers are placed on %u CPUs%s\n", placement.cpu_count, placement.mode == THREAD_POOL_PLACEMENT_NODES ? " by NUMA node" : "");
+    if (is_elastic(worker_pool))
+        log_info("Thread Pool created with %u threads, elastic between %u and %u\n", thread_count, min_threads, max_threads);
+    else
+        log_info("Thread Pool created with %u threads\n", thread_count);
+
+    return pool;
+}
+
+worker_metrics_t *slot_metrics(worker_pool_t *worker_pool, unsigned int id)
+{
+    return id < worker_pool->worker_count ? worker_pool->workers[id].metrics : worker_pool->outside_metrics;
+}
+
+// Enqueue time for a task that is traced or sampled, 0 for the others
+long enqueue_stamp(worker_pool_t *worker_pool)
+{
+    if (submitted_tasks++ % THREAD_POOL_METRICS_INTERVAL == 0 || worker_pool->trace)
+    {
+        return monotonic_ns();
+    }
+    return 0;
+}
+
+void mark_lane_used(worker_pool_t *worker_pool, unsigned int priority)
+{
+    unsigned int lane = 1u << priority;
+    if (!(atomic_load_explicit(&worker_pool->used_lanes, memory_order_relaxed) & lane))
+    {
+        atomic_fetch_or(&worker_pool->used_lanes, lane);
+    }
+}
+
+// The task goes into the lane of arg->priority
+int submit_task(worker_pool_t *worker_pool, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!arg || arg->priority >= TASK_PRIORITIES)
+        return ILLEGAL_ARGS;
+    unsigned int priority = arg->priority;
+    mark_lane_used(worker_pool, priority);
+    arg->enqueued_ns = enqueue_stamp(worker_pool);
+
+    // Tasks spawned by a task stay with the worker running it, everything
+    // else goes through the shared queue
+    if (!current_worker || current_worker->worker_pool != worker_pool)
+    {
+        tasks_submitted(worker_pool, 1);
+        int err = _enqueue_task_locked(worker_pool->task_queue, priority, task_func, arg);
+        if (err)
+        {
+            tasks_finished(worker_pool, 1);
+            return err;
+        }
+        wake_workers(worker_pool, 1);
+        return 0;
+    }
+
+    if (!task_func || !arg)
+        return ILLEGAL_ARGS;
+    task_queue_entry_t *entry = _create_task_queue_entry(worker_pool->objects, current_worker->cache, task_func, arg);
+    if (!entry)
+        return MEMORY_ERROR;
+    tasks_submitted(worker_pool, 1);
+    int err = _push_task_deque(current_worker->deques[priority], entry);
+    if (err)
+    {
+        tasks_finished(worker_pool, 1);
+        _free_task_queue_entry(worker_pool->objects, current_worker->cache, entry);
+        return err;
+    }
+    wake_workers(worker_pool, 1);
+    return 0;
+}
+
+// All n tasks go into the lane of args[0]->priority
+int submit_tasks(worker_pool_t *worker_pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+    if (!args[0] || args[0]->priority >= TASK_PRIORITIES)
+        return ILLEGAL_ARGS;
+    unsigned int priority = args[0]->priority;
+    mark_lane_used(worker_pool, priority);
+    long enqueued_ns = enqueue_stamp(worker_pool);
+    for (unsigned int i = 0; i < n; i++)
+        args[i]->enqueued_ns = enqueued_ns;
+
+    if (!current_worker || current_worker->worker_pool != worker_pool)
+    {
+        tasks_submitted(worker_pool, n);
+        int err = _enqueue_tasks_locked(worker_pool->task_queue, priority, n, task_funcs, args);
+        if (err)
+        {
+            tasks_finished(worker_pool, n);
+            return err;
+        }
+        wake_workers(worker_pool, n);
+        return 0;
+    }
+
+    object_cache_t *cache = current_worker->cache;
+    task_queue_entry_t **entries = _object_pool_alloc(worker_pool->objects, cache, n * sizeof(task_queue_entry_t *));
+    if (!entries)
+        return MEMORY_ERROR;
+
+    int err = 0;
+    unsigned int created = 0;
+    for (; created < n; created++)
+    {
+        if (!task_funcs[created] || !args[created])
+        {
+            err = ILLEGAL_ARGS;
+            break;
+        }
+        entries[created] = _create_task_queue_entry(worker_pool->objects, cache, task_funcs[created], args[created]);
+        if (!entries[created])
+        {
+            err = MEMORY_ERROR;
+            break;
+        }
+    }
+    if (err == 0)
+    {
+        tasks_submitted(worker_pool, n);
+        err = _push_tasks_deque(current_worker->deques[priority], n, entries);
+        if (err)
+        {
+            tasks_finished(worker_pool, n);
+        }
+    }
+    if (err)
+    {
+        for (unsigned int i = 0; i < created; i++)
+        {
+            _free_task_queue_entry(worker_pool->objects, cache, entries[i]);
+        }
+    }
+    _object_pool_free(worker_pool->objects, cache, entries);
+    if (err)
+        return err;
+
+    wake_workers(worker_pool, n);
+    return 0;
+}
+
+// Runs tasks on the calling thread instead of queueing them, for a full pool
+void run_inline(worker_pool_t *worker_pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+    int own = current_worker && current_worker->worker_pool == worker_pool;
+    unsigned int id = own ? current_worker->id : worker_pool->worker_count;
+    // Counted like queued ones, wait_idle must not return while they run
+    tasks_submitted(worker_pool, n);
+    for (unsigned int i = 0; i < n; i++)
+    {
+        // Never queued, the span starts when it runs
+        args[i]->enqueued_ns = 0;
+        int err = run_task(worker_pool, id, task_funcs[i], args[i]);
+        if (err)
+        {
+            log_error("Thread %u: Task function failed with error: %d\n", id, err);
+        }
+        tasks_finished(worker_pool, 1);
+    }
+}
+
+// Blocks an outside submitter until fewer than seen tasks are outstanding
+void wait_for_room(worker_pool_t *worker_pool, long seen)
+{
+    profiled_mutex_lock(worker_pool->m_done);
+    atomic_fetch_add(&worker_pool->space_waiters, 1);
+    while (atomic_load(&worker_pool->outstanding) >= seen && !is_stopped(worker_pool))
+    {
+        profiled_cond_wait(worker_pool->c_space, worker_pool->m_done);
+    }
+    atomic_fetch_sub(&worker_pool->space_waiters, 1);
+    profiled_mutex_unlock(worker_pool->m_done);
+}
+
+// Submits new tasks, applying the full policy once max_pending tasks are
+// outstanding or the lock-free ring is out of slots. Continuations bypass
+// this, a subtree that is done has to be able to finish.
+int submit_bounded(worker_pool_t *worker_pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (!task_funcs[i] || !args[i])
+            return ILLEGAL_ARGS;
+    }
+    for (;;)
+    {
+        // Checked before submitting, concurrent submitters may overshoot
+        // the bound by their own batch. The count is signed, so it is only
+        // compared with the bound once it is known to be positive.
+        long pending = atomic_load(&worker_pool->outstanding);
+        int err = QUEUE_FULL;
+        if (!worker_pool->max_pending || pending <= 0 || (unsigned long)pending + n <= worker_pool->max_pending)
+        {
+            err = n == 1 ? submit_task(worker_pool, task_funcs[0], args[0]) : submit_tasks(worker_pool, n, task_funcs, args);
+        }
+        if (err != QUEUE_FULL)
+        {
+            return err;
+        }
+
+        // A worker waiting for room may be the one that would make it
+        thread_pool_full_policy_t policy = worker_pool->full_policy;
+        if (policy == THREAD_POOL_FULL_BLOCK && current_worker && current_worker->worker_pool == worker_pool)
+        {
+            policy = THREAD_POOL_FULL_RUN_INLINE;
+        }
+        switch (policy)
+        {
+        case THREAD_POOL_FULL_RUN_INLINE:
+            run_inline(worker_pool, n, task_funcs, args);
+            return 0;
+        case THREAD_POOL_FULL_BLOCK:
+            wait_for_room(worker_pool, pending > 0 ? pending : 1);
+            if (is_stopped(worker_pool))
+            {
+                return QUEUE_STOPPED;
+            }
+            break;
+        default:
+            return QUEUE_FULL;
+        }
+    }
+}
+
+// Resets the task tree fields of a new root task
+void init_root_arg(task_queue_entry_arg_t *arg, unsigned int priority, cancel_token_t *token)
+{
+    arg->parent = NULL;
+    arg->continuation = NULL;
+    arg->continuing = 0;
+    arg->token = token;
+    arg->priority = priority;
+}
+
+int enqueue_task(thread_pool_t *pool, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg) {
+    return enqueue_task_with_priority(pool, TASK_PRIORITY_DEFAULT, task_func, arg);
+}
+
+int enqueue_task_with_priority(thread_pool_t *pool, unsigned int priority, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!pool || !pool->worker_pool || !arg || priority >= TASK_PRIORITIES)
+        return ILLEGAL_ARGS;
+    init_root_arg(arg, priority, NULL);
+    return submit_bounded(pool->worker_pool, 1, &task_func, &arg);
+}
+
+int enqueue_cancellable_task(thread_pool_t *pool, cancel_token_t *token, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!pool || !pool->worker_pool || !arg)
+        return ILLEGAL_ARGS;
+    init_root_arg(arg, TASK_PRIORITY_DEFAULT, token);
+    return submit_bounded(pool->worker_pool, 1, &task_func, &arg);
+}
+
+int enqueue_tasks(thread_pool_t *pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args) {
+    if (!pool || !pool->worker_pool || !task_funcs || !args)
+        return ILLEGAL_ARGS;
+    if (n == 0)
+        return 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (!args[i])
+            return ILLEGAL_ARGS;
+        init_root_arg(args[i], TASK_PRIORITY_DEFAULT, NULL);
+    }
+    return submit_bounded(pool->worker_pool, n, task_funcs, args);
+}
+
+int set_task_label(thread_pool_t *pool, const char *label)
+{
+    if (!pool || !pool->worker_pool || !label)
+        return ILLEGAL_ARGS;
+    if (pool->worker_pool->trace && current_span)
+    {
+        _trace_label(current_span, label);
+    }
+    return 0;
+}
+
+int set_continuation(thread_pool_t *pool, task_queue_entry_arg_t *arg, int(*continuation)(task_queue_entry_arg_t *))
+{
+    if (!pool || !arg || !continuation)
+        return ILLEGAL_ARGS;
+    arg->continuation = continuation;
+    // The running task holds one count itself until it returns
+    atomic_store(&arg->pending, 1);
+    continuation_set = 1;
+    return 0;
+}
+
+int enqueue_child_task(thread_pool_t *pool, task_queue_entry_arg_t *parent, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!parent)
+        return ILLEGAL_ARGS;
+    return enqueue_child_tasks_with_priority(pool, parent, parent->priority, 1, &task_func, &arg);
+}
+
+int enqueue_child_tasks(thread_pool_t *pool, task_queue_entry_arg_t *parent, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+    if (!parent)
+        return ILLEGAL_ARGS;
+    return enqueue_child_tasks_with_priority(pool, parent, parent->priority, n, task_funcs, args);
+}
+
+int enqueue_child_tasks_with_priority(thread_pool_t *pool, task_queue_entry_arg_t *parent, unsigned int priority, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args)
+{
+    if (!pool || !pool->worker_pool || !parent || !parent->continuation || !task_funcs || !args || priority >= TASK_PRIORITIES)
+        return ILLEGAL_ARGS;
+    if (n == 0)
+        return 0;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (!args[i])
+            return ILLEGAL_ARGS;
+        args[i]->parent = parent;
+        args[i]->continuation = NULL;
+        args[i]->continuing = 0;
+        args[i]->token = parent->token;
+        args[i]->priority = priority;
+    }
+    atomic_fetch_add(&parent->pending, n);
+    int err = submit_bounded(pool->worker_pool, n, task_funcs, args);
+    if (err)
+    {
+        // The parent's own hold keeps this from reaching 0
+        atomic_fetch_sub(&parent->pending, n);
+    }
+    return err;
+}
+
+cancel_token_t *create_cancel_token(unsigned int timeout_ms, void (*on_drop)(task_queue_entry_arg_t *))
+{
+    cancel_token_t *token = malloc(sizeof(cancel_token_t));
+    if (!token)
+        return NULL;
+    atomic_init(&token->cancelled, 0);
+    token->deadline_ns = timeout_ms ? monotonic_ns() + (long)timeout_ms * 1000000L : 0;
+    token->on_drop = on_drop;
+    atomic_init(&token->dropped, 0);
+    return token;
+}
+
+void destroy_cancel_token(cancel_token_t *token)
+{
+    free(token);
+}
+
+void cancel(cancel_token_t *token)
+{
+    if (token)
+        atomic_store_explicit(&token->cancelled, 1, memory_order_release);
+}
+
+int is_cancelled(cancel_token_t *token)
+{
+    if (!token)
+        return 0;
+    if (atomic_load_explicit(&token->cancelled, memory_order_acquire))
+        return 1;
+    if (token->deadline_ns && monotonic_ns() >= token->deadline_ns)
+    {
+        cancel(token);
+        return 1;
+    }
+    return 0;
+}
+
+unsigned long cancel_token_dropped(cancel_token_t *token)
+{
+    return token ? atomic_load(&token->dropped) : 0;
+}
+
+// Enqueues a due timer. Never waits for room, the service thread has to get
+// back to the wheel.
+void fire_timer(worker_pool_t *worker_pool, thread_pool_timer_t *timer)
+{
+    int (*task_func)(task_queue_entry_arg_t *) = timer->task_func;
+    task_queue_entry_arg_t *arg = timer->arg;
+    if (timer->period_ms)
+    {
+        task_func = run_periodic_task;
+        arg = &timer->run_arg;
+    }
+    init_root_arg(arg, TASK_PRIORITY_DEFAULT, NULL);
+    int err = submit_task(worker_pool, task_func, arg);
+    if (err == QUEUE_FULL)
+    {
+        run_inline(worker_pool, 1, &task_func, &arg);
+    }
+    else if (err && !is_stopped(worker_pool))
+    {
+        log_error("Failed to enqueue timer task: %d\n", err);
+    }
+    if (!timer->period_ms)
+    {
+        free(timer);
+    }
+}
+
+// m_timers has to be held
+void unlink_timer(worker_pool_t *worker_pool, thread_pool_timer_t *timer)
+{
+    _remove_timer(worker_pool->wheel, &timer->wheel);
+    if (timer->live_prev)
+        timer->live_prev->live_next = timer->live_next;
+    else
+        worker_pool->timers = timer->live_next;
+    if (timer->live_next)
+        timer->live_next->live_prev = timer->live_prev;
+}
+
+void *service_timers(void *arg)
+{
+    worker_pool_t *worker_pool = (worker_pool_t *)arg;
+    timer_wheel_t *wheel = worker_pool->wheel;
+
+    pthread_mutex_lock(worker_pool->m_timers);
+    while (!worker_pool->timers_stopped)
+    {
+        long now = _timer_tick(wheel, monotonic_ns());
+        thread_pool_timer_t *due = NULL;
+        wheel_timer_t *expired = _advance_timer_wheel(wheel, now);
+        while (expired)
+        {
+            thread_pool_timer_t *timer = (thread_pool_timer_t *)expired;
+            expired = expired->next;
+            if (timer->period_ms)
+            {
+                // Missed periods are skipped rather than run back to back
+                timer->wheel.expiry += timer->period_ms;
+                if (timer->wheel.expiry <= now)
+                {
+                    timer->wheel.expiry = now + timer->period_ms;
+                }
+                _add_timer(wheel, &timer->wheel);
+                if (timer->running)
+                {
+                    continue;
+                }
+                timer->running = 1;
+            }
+            else
+            {
+                unlink_timer(worker_pool, timer);
+            }
+            timer->due_next = due;
+            due = timer;
+        }
+
+        if (due)
+        {
+            pthread_mutex_unlock(worker_pool->m_timers);
+            while (due)
+            {
+                thread_pool_timer_t *next = due->due_next;
+                fire_timer(worker_pool, due);
+                due = next;
+            }
+            pthread_mutex_lock(worker_pool->m_timers);
+            continue;
+        }
+
+        // Asleep until the next timer is due, or a sooner one is added
+        worker_pool->timer_wake_tick = _next_timer_event(wheel);
+        if (worker_pool->timer_wake_tick < 0)
+        {
+            pthread_cond_wait(worker_pool->c_timers, worker_pool->m_timers);
+        }
+        else
+        {
+            _monotonic_timedwait(worker_pool->c_timers, worker_pool->m_timers, _timer_tick_ns(wheel, worker_pool->timer_wake_tick));
+        }
+    }
+    pthread_mutex_unlock(worker_pool->m_timers);
+    return NULL;
+}
+
+void stop_timers(worker_pool_t *worker_pool)
+{
+    // Without a service thread nothing else touches the timers
+    if (!worker_pool->timer_thread_started)
+    {
+        return;
+    }
+    pthread_mutex_lock(worker_pool->m_timers);
+    worker_pool->timers_stopped = 1;
+    pthread_cond_signal(worker_pool->c_timers);
+    pthread_mutex_unlock(worker_pool->m_timers);
+    pthread_join(worker_pool->timer_thread, NULL);
+    worker_pool->timer_thread_started = 0;
+}
+
+int run_periodic_task(task_queue_entry_arg_t *task_arg)
+{
+    thread_pool_timer_t *timer = task_arg->arg;
+    worker_pool_t *worker_pool = timer->worker_pool;
+    // The caller's arg sees the run like a task of its own
+    timer->arg->id = task_arg->id;
+    timer->arg->context = task_arg->context;
+    int err = timer->task_func(timer->arg);
+
+    pthread_mutex_lock(worker_pool->m_timers);
+    timer->running = 0;
+    if (timer->cancelled)
+    {
+        unlink_timer(worker_pool, timer);
+        free(timer);
+    }
+    pthread_mutex_unlock(worker_pool->m_timers);
+    return err;
+}
+
+int add_pool_timer(worker_pool_t *worker_pool, thread_pool_timer_t *timer, unsigned int delay_ms)
+{
+    pthread_mutex_lock(worker_pool->m_timers);
+    if (worker_pool->timers_stopped || is_stopped(worker_pool))
+    {
+        pthread_mutex_unlock(worker_pool->m_timers);
+        return QUEUE_STOPPED;
+    }
+    if (!worker_pool->timer_thread_started)
+    {
+        if (pthread_create(&worker_pool->timer_thread, NULL, service_timers, worker_pool))
+        {
+            pthread_mutex_unlock(worker_pool->m_timers);
+            return FATAL_ERROR;
+        }
+        worker_pool->timer_thread_started = 1;
+    }
+
+    timer->wheel.expiry = _timer_tick(worker_pool->wheel, monotonic_ns()) + delay_ms;
+    _add_timer(worker_pool->wheel, &timer->wheel);
+    timer->live_prev = NULL;
+    timer->live_next = worker_pool->timers;
+    if (worker_pool->timers)
+        worker_pool->timers->live_prev = timer;
+    worker_pool->timers = timer;
+
+    if (worker_pool->timer_wake_tick < 0 || timer->wheel.expiry < worker_pool->timer_wake_tick)
+    {
+        pthread_cond_signal(worker_pool->c_timers);
+    }
+    pthread_mutex_unlock(worker_pool->m_timers);
+    return 0;
+}
+
+thread_pool_timer_t *create_pool_timer(worker_pool_t *worker_pool, unsigned int period_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    thread_pool_timer_t *timer = calloc(1, sizeof(thread_pool_timer_t));
+    if (!timer)
+        return NULL;
+    timer->worker_pool = worker_pool;
+    timer->task_func = task_func;
+    timer->arg = arg;
+    timer->period_ms = period_ms;
+    timer->run_arg.arg = timer;
+    return timer;
+}
+
+int enqueue_task_after(thread_pool_t *pool, unsigned int delay_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!pool || !pool->worker_pool || !task_func || !arg)
+        return ILLEGAL_ARGS;
+    if (delay_ms == 0)
+        return enqueue_task(pool, task_func, arg);
+    thread_pool_timer_t *timer = create_pool_timer(pool->worker_pool, 0, task_func, arg);
+    if (!timer)
+        return MEMORY_ERROR;
+    int err = add_pool_timer(pool->worker_pool, timer, delay_ms);
+    if (err)
+        free(timer);
+    return err;
+}
+
+thread_pool_timer_t *enqueue_periodic_task(thread_pool_t *pool, unsigned int period_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg)
+{
+    if (!pool || !pool->worker_pool || !task_func || !arg || period_ms == 0)
+        return NULL;
+    thread_pool_timer_t *timer = create_pool_timer(pool->worker_pool, period_ms, task_func, arg);
+    if (!timer)
+        return NULL;
+    if (add_pool_timer(pool->worker_pool, timer, period_ms))
+    {
+        free(timer);
+        return NULL;
+    }
+    return timer;
+}
+
+int cancel_periodic_task(thread_pool_t *pool, thread_pool_timer_t *timer)
+{
+    if (!pool || !pool->worker_pool || !timer || timer->worker_pool != pool->worker_pool || !timer->period_ms)
+        return ILLEGAL_ARGS;
+    worker_pool_t *worker_pool = pool->worker_pool;
+
+    pthread_mutex_lock(worker_pool->m_timers);
+    if (timer->running)
+    {
+        // The run frees it once it is done
+        _remove_timer(worker_pool->wheel, &timer->wheel);
+        timer->cancelled = 1;
+    }
+    else
+    {
+        unlink_timer(worker_pool, timer);
+        free(timer);
+    }
+    pthread_mutex_unlock(worker_pool->m_timers);
+    return 0;
+}
+
+// Cache of the calling worker, outside of the pool the shared depots are used
+object_cache_t *current_cache(worker_pool_t *worker_pool)
+{
+    if (!current_worker || current_worker->worker_pool != worker_pool)
+        return NULL;
+    return current_worker->cache;
+}
+
+void *thread_pool_alloc(thread_pool_t *pool, size_t size)
+{
+    if (!pool || !pool->worker_pool)
+        return NULL;
+    return _object_pool_alloc(pool->worker_pool->objects, current_cache(pool->worker_pool), size);
+}
+
+void thread_pool_free(thread_pool_t *pool, void *ptr)
+{
+    if (!pool || !pool->worker_pool)
+        return;
+    _object_pool_free(pool->worker_pool->objects, current_cache(pool->worker_pool), ptr);
+}
+
+task_queue_entry_arg_t *alloc_task_arg(thread_pool_t *pool, size_t payload_size)
+{
+    task_queue_entry_arg_t *arg = thread_pool_alloc(pool, sizeof(task_queue_entry_arg_t) + payload_size);
+    if (!arg)
+        return NULL;
+    arg->arg = payload_size ? (void *)(arg + 1) : NULL;
+    arg->parent = NULL;
+    arg->continuation = NULL;
+    arg->continuing = 0;
+    arg->token = NULL;
+    arg->context = NULL;
+    return arg;
+}
+
+void free_task_arg(thread_pool_t *pool, task_queue_entry_arg_t *arg)
+{
+    thread_pool_free(pool, arg);
+}
+
+int thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats)
+{
+    if (!pool || !pool->worker_pool || !stats)
+        return ILLEGAL_ARGS;
+    worker_pool_t *worker_pool = pool->worker_pool;
+
+    pthread_mutex_lock(worker_pool->m_resize);
+    stats->workers = atomic_load(&worker_pool->active_workers);
+    stats->peak_workers = worker_pool->peak_workers;
+    stats->min_workers = worker_pool->min_workers;
+    stats->max_workers = worker_pool->worker_count;
+    stats->grow_events = worker_pool->grow_events;
+    stats->shrink_events = worker_pool->shrink_events;
+    stats->blocked_permille = atomic_load_explicit(&worker_pool->blocked_permille, memory_order_relaxed);
+    pthread_mutex_unlock(worker_pool->m_resize);
+
+    histogram_t queue_wait = {0};
+    histogram_t run_time = {0};
+    stats->tasks_run = 0;
+    stats->steals = 0;
+    stats->idle_ns = 0;
+    for (unsigned int i = 0; i <= worker_pool->worker_count; i++)
+    {
+        worker_metrics_t *metrics = slot_metrics(worker_pool, i);
+        stats->tasks_run += atomic_load_explicit(&metrics->tasks_run, memory_order_relaxed);
+        stats->steals += atomic_load_explicit(&metrics->steals, memory_order_relaxed);
+        stats->idle_ns += atomic_load_explicit(&metrics->idle_ns, memory_order_relaxed);
+        _merge_histogram(&queue_wait, &metrics->queue_wait);
+        _merge_histogram(&run_time, &metrics->run_time);
+    }
+    _summarize_histogram(&queue_wait, &stats->queue_wait);
+    _summarize_histogram(&run_time, &stats->run_time);
+    return 0;
+}
+
+unsigned int thread_pool_slots(thread_pool_t *pool)
+{
+    if (!pool || !pool->worker_pool)
+        return 0;
+    return pool->worker_pool->worker_count + 1;
+}
+
+unsigned int thread_pool_current_slot(thread_pool_t *pool)
+{
+    if (!pool || !pool->worker_pool)
+        return 0;
+    if (current_worker && current_worker->worker_pool == pool->worker_pool)
+        return current_worker->id;
+    return pool->worker_pool->worker_count;
+}
+
+void *thread_pool_worker_context(thread_pool_t *pool)
+{
+    if (!pool || !pool->worker_pool || !current_worker || current_worker->worker_pool != pool->worker_pool)
+        return NULL;
+    return current_worker->context;
+}
+
+int run_pending_task(thread_pool_t *pool)
+{
+    if (!pool || !pool->worker_pool)
+        return ILLEGAL_ARGS;
+    worker_pool_t *worker_pool = pool->worker_pool;
+
+    worker_thread_entry_arg_t *self = current_worker && current_worker->worker_pool == worker_pool ? current_worker : NULL;
+    unsigned int id = thread_pool_current_slot(pool);
+    unsigned int seed = (unsigned int)monotonic_ns();
+
+    int (*task_func)(task_queue_entry_arg_t *);
+    task_queue_entry_arg_t *task_arg;
+    if (find_task(worker_pool, self, &seed, &task_func, &task_arg) != 0)
+        return QUEUE_EMPTY;
+
+    if (task_func && task_arg)
+    {
+        int err = run_task(worker_pool, id, task_func, task_arg);
+        if (err)
+        {
+            log_error("Thread %u: Task function failed with error: %d\n", id, err);
+        }
+    }
+    tasks_finished(worker_pool, 1);
+    return 0;
+}
+
+int wait_idle(thread_pool_t *pool)
+{
+    if (!pool || !pool->worker_pool)
+        return ILLEGAL_ARGS;
+    worker_pool_t *worker_pool = pool->worker_pool;
+
+    profiled_mutex_lock(worker_pool->m_done);
+    while (atomic_load(&worker_pool->outstanding) > 0)
+    {
+        profiled_cond_wait(worker_pool->c_done, worker_pool->m_done);
+    }
+    profiled_mutex_unlock(worker_pool->m_done);
+    return 0;
+}
+
+int shutdown_pool(thread_pool_t *pool)
+{
+    if (!pool || !pool->worker_pool)
+        return ILLEGAL_ARGS;
+    worker_pool_t *worker_pool = pool->worker_pool;
+
+    // Nothing that comes due from here on would run anyway
+    stop_timers(worker_pool);
+    log_info("Stopping task queue...\n");
+    int err = stop_task_queue_locked(worker_pool->task_queue);
+    if (err)
+    {
+        log_info("Failed to stop task queue: %d\n", err);
+    }
+    wake_all_workers(worker_pool);
+    profiled_mutex_lock(worker_pool->m_done);
+    pthread_cond_broadcast(worker_pool->c_space);
+    profiled_mutex_unlock(worker_pool->m_done);
+
+    // The queue is stopped, no slot gets a new thread from here on
+    log_info("Waiting for worker threads to finish...\n");
+    for (unsigned int i = 0; i < worker_pool->worker_count; i++)
+    {
+        worker_thread_entry_arg_t *worker = &worker_pool->workers[i];
+        pthread_mutex_lock(worker_pool->m_resize);
+        int joinable = worker->state != WORKER_SLOT_EMPTY;
+        pthread_mutex_unlock(worker_pool->m_resize);
+        if (!joinable)
+        {
+            continue;
+        }
+        pthread_join(worker->thread, NULL);
+        pthread_mutex_lock(worker_pool->m_resize);
+        worker->state = WORKER_SLOT_EMPTY;
+        pthread_mutex_unlock(worker_pool->m_resize);
+    }
+
+    for (unsigned int i = 0; i < worker_pool->worker_count; i++)
+    {
+        worker_metrics_t *metrics = worker_pool->workers[i].metrics;
+        unsigned long tasks_run = atomic_load(&metrics->tasks_run);
+        if (tasks_run)
+        {
+            thread_pool_latency_t run_time;
+            _summarize_histogram(&metrics->run_time, &run_time);
+            log_debug("Thread %u ran %lu tasks, stole %lu, was idle for %.1fms, run time p99 %.1fus\n",
+                      i, tasks_run, atomic_load(&metrics->steals), atomic_load(&metrics->idle_ns) / 1e6, run_time.p99_ns / 1e3);
+        }
+    }
+    thread_pool_stats_t stats;
+    thread_pool_stats(pool, &stats);
+    log_info("Pool ran %lu tasks, %lu of them stolen, workers were idle for %.1fms in total\n",
+             stats.tasks_run, stats.steals, stats.idle_ns / 1e6);
+    log_latency("Queue wait", &stats.queue_wait);
+    log_latency("Run time", &stats.run_time);
+
+    if (is_elastic(worker_pool))
+    {
+        log_info("Pool grew %lu times and shrank %lu times, peak of %u workers\n",
+                 worker_pool->grow_events, worker_pool->shrink_events, worker_pool->peak_workers);
+    }
+    if (worker_pool->trace)
+    {
+        if (_write_trace(worker_pool->trace, worker_pool->trace_path))
+            log_error("Failed to write trace to %s\n", worker_pool->trace_path);
+        else
+            log_info("Wrote trace to %s\n", worker_pool->trace_path);
+    }
+    free_pool(pool);
+    return 0;
+}
+
+void log_latency(const char *name, const thread_pool_latency_t *latency)
+{
+    if (!latency->samples)
+    {
+        return;
+    }
+    log_info("%s of %lu sampled tasks: mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, max %.1fus\n",
+             name, latency->samples, latency->mean_ns / 1e3, latency->p50_ns / 1e3,
+             latency->p90_ns / 1e3, latency->p99_ns / 1e3, latency->max_ns / 1e3);
+}
+
+int join(thread_pool_t *pool) {
+    int err = wait_idle(pool);
+    if (err)
+        return err;
+    log_info("All tasks completed\n");
+    return shutdown_pool(pool);
+}
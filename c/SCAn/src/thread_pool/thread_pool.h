@@ -2,23 +2,200 @@
 #define THREAD_POOL_H
 
 #include <pthread.h>
+#include <stddef.h>
 
 #include "task_queue_public.h"
 
-typedef unsigned int busy_threads_t;
+// Tasks are timed one in this many, reading the clock for every one of them
+// would cost about as much as running a small task
+#define THREAD_POOL_METRICS_INTERVAL 16
+
 typedef struct worker_pool_t worker_pool_t;
 typedef struct thread_pool_t thread_pool_t;
+typedef struct thread_pool_timer_t thread_pool_timer_t;
 
 typedef enum {
     CREATED,
     MAX_THREAD_AMOUNT_EXCEEDED,
     OUT_OF_MEMORY,
     THREAD_CREATION_FAILED,
+    INVALID_OPTIONS,
 } thread_pool_creation_status_t;
 
-thread_pool_t *create_thread_pool(unsigned short thread_count, thread_pool_creation_status_t *status);
+typedef enum {
+    // Workers run wherever the scheduler puts them
+    THREAD_POOL_PLACEMENT_NONE,
+    // Each worker is pinned to one CPU of cpu_list
+    THREAD_POOL_PLACEMENT_CORES,
+    // Each worker may run on the whole NUMA node its CPU of cpu_list is on
+    THREAD_POOL_PLACEMENT_NODES,
+} thread_pool_placement_t;
+
+// What enqueueing does once a bounded pool is full
+typedef enum {
+    // Return QUEUE_FULL
+    THREAD_POOL_FULL_FAIL,
+    // Wait for room. Tasks submitting from a worker run inline instead, the
+    // worker could be the one that would make room.
+    THREAD_POOL_FULL_BLOCK,
+    // Run the tasks on the submitting thread right away
+    THREAD_POOL_FULL_RUN_INLINE,
+} thread_pool_full_policy_t;
+
+typedef struct thread_pool_options_t {
+    unsigned int thread_count;
+    // Backend of the queue for tasks submitted from outside the pool
+    task_queue_backend_t queue_backend;
+    // Slots of each priority lane of the TASK_QUEUE_LOCK_FREE ring, 0 picks
+    // the default. A full ring is handled by full_policy.
+    unsigned int queue_capacity;
+    // Bound on tasks queued or running, 0 for none. Continuations are
+    // always accepted, so a finished subtree can still settle.
+    unsigned long max_pending;
+    thread_pool_full_policy_t full_policy;
+    // Elastic sizing. The pool starts with thread_count workers and adds more,
+    // up to max_threads, while tasks back up behind workers that are blocked.
+    // Workers idle for idle_timeout_ms retire down to min_threads. 0 for
+    // either bound keeps the pool at thread_count.
+    unsigned int min_threads;
+    unsigned int max_threads;
+    unsigned int idle_timeout_ms;
+    // Worker placement, Linux only. Worker i gets the i-th CPU of cpu_list,
+    // wrapping around, and its deque and object cache are allocated on that
+    // CPU's node. A NULL cpu_list uses every CPU the process may run on.
+    thread_pool_placement_t placement;
+    const char *cpu_list;
+    // Records one span per task run and writes them to this file as Chrome
+    // trace event JSON on shutdown_pool. NULL to not trace.
+    const char *trace_path;
+    // Per worker context. worker_init runs on each worker thread before its
+    // first task, tasks see what it returns as arg->context. worker_teardown
+    // gets it back when the thread exits, including workers retired after
+    // idling. Either may be NULL. Threads outside of the pool run tasks with
+    // a NULL context, so tasks have to handle that too.
+    void *(*worker_init)(unsigned int slot, void *user_data);
+    void (*worker_teardown)(unsigned int slot, void *context, void *user_data);
+    void *worker_user_data;
+} thread_pool_options_t;
+
+// Nanoseconds, percentiles are bucket bounds within 1/16 of the real value
+typedef struct thread_pool_latency_t {
+    unsigned long samples;
+    unsigned long mean_ns;
+    unsigned long p50_ns;
+    unsigned long p90_ns;
+    unsigned long p99_ns;
+    unsigned long max_ns;
+} thread_pool_latency_t;
+
+typedef struct thread_pool_stats_t {
+    // Running workers and the most that ever ran at once
+    unsigned int workers;
+    unsigned int peak_workers;
+    unsigned int min_workers;
+    unsigned int max_workers;
+    // Workers added for a backlog and workers retired after idling
+    unsigned long grow_events;
+    unsigned long shrink_events;
+    // Estimated share of task time spent blocked instead of on the CPU
+    unsigned int blocked_permille;
+    // Summed over every worker and the threads outside of the pool. Idle is
+    // the time workers waited for a task after spinning, up to their last wakeup.
+    unsigned long tasks_run;
+    unsigned long steals;
+    unsigned long idle_ns;
+    // From enqueue to start and from start to return, for every
+    // THREAD_POOL_METRICS_INTERVAL-th task submitted by each thread
+    thread_pool_latency_t queue_wait;
+    thread_pool_latency_t run_time;
+} thread_pool_stats_t;
+
+thread_pool_t *create_thread_pool(unsigned int thread_count, thread_pool_creation_status_t *status);
+thread_pool_t *create_thread_pool_with_options(const thread_pool_options_t *options, thread_pool_creation_status_t *status);
 void free_pool(thread_pool_t *pool);
 int enqueue_task(thread_pool_t *pool, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+// priority below TASK_PRIORITIES, higher lanes run first. Plain enqueues
+// use TASK_PRIORITY_DEFAULT, continuations TASK_PRIORITY_HIGHEST.
+int enqueue_task_with_priority(thread_pool_t *pool, unsigned int priority, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+// Enqueues task_funcs[i](args[i]) for all n tasks at once, either all or none
+int enqueue_tasks(thread_pool_t *pool, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+// Blocks until every submitted task, including the ones those spawned, has
+// finished. The workers stay alive and the pool takes new tasks afterwards.
+int wait_idle(thread_pool_t *pool);
+// Stops the queue, joins the workers and frees the pool. Outside threads
+// can't submit anymore, but workers empty their own deques before they
+// exit, running whatever those tasks spawn as well. Tasks still waiting in
+// the shared queue are discarded without running and their args are not
+// released. Call wait_idle first to finish everything.
+int shutdown_pool(thread_pool_t *pool);
+// wait_idle followed by shutdown_pool
 int join(thread_pool_t *pool);
+// Names the span of the calling task in the trace, the end of the label is
+// kept if it is too long. Does nothing unless the pool traces.
+int set_task_label(thread_pool_t *pool, const char *label);
+
+/*
+ * Timers. One thread per pool, started with the first timer, sleeps until
+ * the next one is due and enqueues it. Tasks only count for wait_idle once
+ * they are due, timers still pending at shutdown are dropped.
+ */
+int enqueue_task_after(thread_pool_t *pool, unsigned int delay_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+// Runs task_func(arg) every period_ms, the first time one period from now.
+// A period that comes up while the last run is still going is skipped.
+thread_pool_timer_t *enqueue_periodic_task(thread_pool_t *pool, unsigned int period_ms, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+// A run already started still finishes, wait_idle before freeing its arg
+int cancel_periodic_task(thread_pool_t *pool, thread_pool_timer_t *timer);
+
+/*
+ * Continuations. A running task calls set_continuation on its own arg, then
+ * enqueues children with enqueue_child_task. Once the task has returned and
+ * every child has finished, continuation(arg) is enqueued with the same arg.
+ * Nobody blocks while the children run. A child that sets a continuation
+ * itself only counts as finished after that continuation has run, so a
+ * continuation sees its whole subtree completed.
+ * A task that set a continuation must leave freeing its arg to it.
+ */
+int set_continuation(thread_pool_t *pool, task_queue_entry_arg_t *arg, int(*continuation)(task_queue_entry_arg_t *));
+int enqueue_child_task(thread_pool_t *pool, task_queue_entry_arg_t *parent, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int enqueue_child_tasks(thread_pool_t *pool, task_queue_entry_arg_t *parent, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+// Children take the parent's priority unless given one
+int enqueue_child_tasks_with_priority(thread_pool_t *pool, task_queue_entry_arg_t *parent, unsigned int priority, unsigned int n, int(**task_funcs)(task_queue_entry_arg_t *), task_queue_entry_arg_t **args);
+
+/*
+ * Cancellation. Tasks enqueued with a token, and all their children, form a
+ * job. Cancelling it, or passing its deadline, is a single flag. Queued tasks
+ * of the job are dropped as workers reach them, on_drop gets their arg to
+ * release it. Continuations still run so the subtree can clean up. Running
+ * tasks poll is_cancelled(arg->token) and stop early.
+ * A token has to outlive every task of its job, wait_idle before destroying.
+ */
+// timeout_ms 0 means no deadline, on_drop may be NULL
+cancel_token_t *create_cancel_token(unsigned int timeout_ms, void (*on_drop)(task_queue_entry_arg_t *));
+void destroy_cancel_token(cancel_token_t *token);
+void cancel(cancel_token_t *token);
+// 0 for a NULL token
+int is_cancelled(cancel_token_t *token);
+// Tasks of the job that were dropped without running
+unsigned long cancel_token_dropped(cancel_token_t *token);
+int enqueue_cancellable_task(thread_pool_t *pool, cancel_token_t *token, int(*task_func)(task_queue_entry_arg_t *), task_queue_entry_arg_t *arg);
+int thread_pool_stats(thread_pool_t *pool, thread_pool_stats_t *stats);
+// Tasks see arg->id below this, one id per worker slot plus one shared by
+// all threads outside of the pool
+unsigned int thread_pool_slots(thread_pool_t *pool);
+// The id a task run by the calling thread would see
+unsigned int thread_pool_current_slot(thread_pool_t *pool);
+// Context of the calling worker, NULL outside of the pool
+void *thread_pool_worker_context(thread_pool_t *pool);
+// Runs one queued task on the calling thread, QUEUE_EMPTY if there is none.
+// Lets a thread that waits on tasks help instead of blocking a worker.
+int run_pending_task(thread_pool_t *pool);
+
+// Small fixed size objects from per-worker freelists. Everything handed out
+// here is released together with the pool.
+void *thread_pool_alloc(thread_pool_t *pool, size_t size);
+void thread_pool_free(thread_pool_t *pool, void *ptr);
+// A task arg with payload_size bytes for arg->arg in the same block
+task_queue_entry_arg_t *alloc_task_arg(thread_pool_t *pool, size_t payload_size);
+void free_task_arg(thread_pool_t *pool, task_queue_entry_arg_t *arg);
 
 #endif
\ No newline at end of file
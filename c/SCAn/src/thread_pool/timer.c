@@ -0,0 +1,167 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+// Ticks a timer may be ahead of the wheel and still be placed exactly
+#define TIMER_WHEEL_RANGE (1L << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS))
+
+void _init_timer_wheel(timer_wheel_t *wheel, long origin_ns);
+long _timer_tick(const timer_wheel_t *wheel, long time_ns);
+long _timer_tick_ns(const timer_wheel_t *wheel, long tick);
+void _add_timer(timer_wheel_t *wheel, wheel_timer_t *timer);
+void _remove_timer(timer_wheel_t *wheel, wheel_timer_t *timer);
+long _next_timer_event(const timer_wheel_t *wheel);
+wheel_timer_t *_advance_timer_wheel(timer_wheel_t *wheel, long tick);
+wheel_timer_t *_process_timer_slot(timer_wheel_t *wheel, unsigned int level, unsigned int slot, wheel_timer_t *expired);
+
+void _init_timer_wheel(timer_wheel_t *wheel, long origin_ns)
+{
+    wheel->origin_ns = origin_ns;
+    wheel->now = 0;
+    for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        wheel->occupied[level] = 0;
+        for (unsigned int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
+        {
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+        }
+    }
+}
+
+long _timer_tick(const timer_wheel_t *wheel, long time_ns)
+{
+    return time_ns > wheel->origin_ns ? (time_ns - wheel->origin_ns) / TIMER_TICK_NS : 0;
+}
+
+long _timer_tick_ns(const timer_wheel_t *wheel, long tick)
+{
+    return wheel->origin_ns + tick * TIMER_TICK_NS;
+}
+
+void _add_timer(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    // Placed by when it is due, clamped to what the wheel can reach. A slot
+    // of level l is visited when its window starts, which is always after
+    // the current one.
+    long place = timer->expiry > wheel->now ? timer->expiry : wheel->now + 1;
+    if (place - wheel->now >= TIMER_WHEEL_RANGE)
+    {
+        place = wheel->now + TIMER_WHEEL_RANGE - 1;
+    }
+    unsigned int level = 0;
+    while ((place - wheel->now) >> ((level + 1) * TIMER_WHEEL_SLOT_BITS))
+    {
+        level++;
+    }
+    unsigned int slot = (place >> (level * TIMER_WHEEL_SLOT_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+
+    wheel_timer_t *head = &wheel->slots[level][slot];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->level = level;
+    timer->slot = slot;
+    timer->linked = 1;
+    wheel->occupied[level] |= 1ull << slot;
+}
+
+void _remove_timer(timer_wheel_t *wheel, wheel_timer_t *timer)
+{
+    if (!timer->linked)
+    {
+        return;
+    }
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->linked = 0;
+    wheel_timer_t *head = &wheel->slots[timer->level][timer->slot];
+    if (head->next == head)
+    {
+        wheel->occupied[timer->level] &= ~(1ull << timer->slot);
+    }
+}
+
+long _next_timer_event(const timer_wheel_t *wheel)
+{
+    long next = -1;
+    for (unsigned int level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        unsigned long long occupied = wheel->occupied[level];
+        if (!occupied)
+        {
+            continue;
+        }
+        // Slots hold the 64 windows after the current one, the first set
+        // bit after the current slot is the next window to visit
+        unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+        long window = wheel->now >> shift;
+        unsigned int current = window & (TIMER_WHEEL_SLOTS - 1);
+        unsigned long long rotated = current == TIMER_WHEEL_SLOTS - 1 ? occupied : (occupied >> (current + 1)) | (occupied << (TIMER_WHEEL_SLOTS - 1 - current));
+        long tick = (window + 1 + __builtin_ctzll(rotated)) << shift;
+        if (next < 0 || tick < next)
+        {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+// Takes every timer out of a slot, the due ones are added to expired and
+// the others placed again further down
+wheel_timer_t *_process_timer_slot(timer_wheel_t *wheel, unsigned int level, unsigned int slot, wheel_timer_t *expired)
+{
+    wheel_timer_t *head = &wheel->slots[level][slot];
+    wheel_timer_t *timer = head->next;
+    head->next = head;
+    head->prev = head;
+    wheel->occupied[level] &= ~(1ull << slot);
+
+    while (timer != head)
+    {
+        wheel_timer_t *next = timer->next;
+        timer->linked = 0;
+        if (timer->expiry <= wheel->now)
+        {
+            timer->next = expired;
+            timer->prev = NULL;
+            expired = timer;
+        }
+        else
+        {
+            _add_timer(wheel, timer);
+        }
+        timer = next;
+    }
+    return expired;
+}
+
+wheel_timer_t *_advance_timer_wheel(timer_wheel_t *wheel, long tick)
+{
+    wheel_timer_t *expired = NULL;
+    long next;
+    while ((next = _next_timer_event(wheel)) >= 0 && next <= tick)
+    {
+        wheel->now = next;
+        // Higher levels first, what they hand down may be due right away
+        for (int level = TIMER_WHEEL_LEVELS - 1; level >= 0; level--)
+        {
+            unsigned int shift = level * TIMER_WHEEL_SLOT_BITS;
+            if (next & ((1L << shift) - 1))
+            {
+                continue;
+            }
+            unsigned int slot = (next >> shift) & (TIMER_WHEEL_SLOTS - 1);
+            if (wheel->occupied[level] & (1ull << slot))
+            {
+                expired = _process_timer_slot(wheel, level, slot, expired);
+            }
+        }
+    }
+    if (tick > wheel->now)
+    {
+        wheel->now = tick;
+    }
+    return expired;
+}
@@ -0,0 +1,50 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "constants.h"
+
+// Hierarchical wheel of 1ms ticks. Level l has 64 slots of 64^l ticks each,
+// four levels reach about 4.6 hours ahead. Timers further out wait in the
+// top level and are placed again once it comes around.
+#define TIMER_TICK_NS 1000000L
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct wheel_timer_t wheel_timer_t;
+typedef struct wheel_timer_t
+{
+    wheel_timer_t *next;
+    wheel_timer_t *prev;
+    // Tick the timer is due at
+    long expiry;
+    unsigned short level;
+    unsigned short slot;
+    unsigned short linked;
+} wheel_timer_t;
+
+typedef struct timer_wheel_t
+{
+    long origin_ns;
+    // Last tick advanced to
+    long now;
+    // Bit i of occupied[l] is set while slots[l][i] holds timers
+    unsigned long long occupied[TIMER_WHEEL_LEVELS];
+    // List heads, empty ones point at themselves
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel_t;
+
+void _init_timer_wheel(timer_wheel_t *wheel, long origin_ns);
+// Tick that contains time_ns, and the time a tick starts at
+long _timer_tick(const timer_wheel_t *wheel, long time_ns);
+long _timer_tick_ns(const timer_wheel_t *wheel, long tick);
+// timer->expiry has to be set, timers already due fire on the next tick
+void _add_timer(timer_wheel_t *wheel, wheel_timer_t *timer);
+void _remove_timer(timer_wheel_t *wheel, wheel_timer_t *timer);
+// Next tick the wheel has something to do at, -1 while it is empty
+long _next_timer_event(const timer_wheel_t *wheel);
+// Moves the wheel on to tick. Returns the timers that came due on the way,
+// taken out of the wheel and chained through next.
+wheel_timer_t *_advance_timer_wheel(timer_wheel_t *wheel, long tick);
+
+#endif
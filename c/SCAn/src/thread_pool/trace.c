@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+trace_t *_create_trace(unsigned int slots, long origin_ns);
+void _destroy_trace(trace_t *trace);
+trace_span_t *_trace_begin(trace_t *trace, unsigned int slot, long enqueued_ns, long start_ns);
+void _trace_label(trace_span_t *span, const char *label);
+int _write_trace(trace_t *trace, const char *path);
+trace_span_t *_append_span(trace_buffer_t *buffer);
+void _write_json_string(FILE *file, const char *string);
+
+trace_t *_create_trace(unsigned int slots, long origin_ns)
+{
+    trace_t *trace = malloc(sizeof(trace_t));
+    if (!trace)
+    {
+        return NULL;
+    }
+    trace->buffers = calloc(slots + 1, sizeof(trace_buffer_t));
+    if (!trace->buffers || pthread_mutex_init(&trace->m_outside, NULL))
+    {
+        free(trace->buffers);
+        free(trace);
+        return NULL;
+    }
+    trace->buffer_count = slots + 1;
+    trace->origin_ns = origin_ns;
+    return trace;
+}
+
+void _destroy_trace(trace_t *trace)
+{
+    if (!trace)
+    {
+        return;
+    }
+    for (unsigned int i = 0; i < trace->buffer_count; i++)
+    {
+        trace_chunk_t *chunk = trace->buffers[i].first;
+        while (chunk)
+        {
+            trace_chunk_t *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+    }
+    pthread_mutex_destroy(&trace->m_outside);
+    free(trace->buffers);
+    free(trace);
+}
+
+trace_span_t *_append_span(trace_buffer_t *buffer)
+{
+    if (!buffer->last || buffer->last->count == TRACE_CHUNK_SPANS)
+    {
+        trace_chunk_t *chunk = malloc(sizeof(trace_chunk_t));
+        if (!chunk)
+        {
+            return NULL;
+        }
+        chunk->next = NULL;
+        chunk->count = 0;
+        if (buffer->last)
+            buffer->last->next = chunk;
+        else
+            buffer->first = chunk;
+        buffer->last = chunk;
+    }
+    return &buffer->last->spans[buffer->last->count++];
+}
+
+trace_span_t *_trace_begin(trace_t *trace, unsigned int slot, long enqueued_ns, long start_ns)
+{
+    trace_span_t *span;
+    if (slot + 1 >= trace->buffer_count)
+    {
+        pthread_mutex_lock(&trace->m_outside);
+        span = _append_span(&trace->buffers[trace->buffer_count - 1]);
+        pthread_mutex_unlock(&trace->m_outside);
+    }
+    else
+    {
+        span = _append_span(&trace->buffers[slot]);
+    }
+    if (span)
+    {
+        span->enqueued_ns = enqueued_ns ? enqueued_ns : start_ns;
+        span->start_ns = start_ns;
+        span->end_ns = start_ns;
+        span->label[0] = '\0';
+    }
+    return span;
+}
+
+// Keeps the end of labels that don't fit, for paths that's the interesting part
+void _trace_label(trace_span_t *span, const char *label)
+{
+    size_t length = strlen(label);
+    if (length >= TRACE_LABEL_LEN)
+    {
+        label += length - (TRACE_LABEL_LEN - 1);
+        length = TRACE_LABEL_LEN - 1;
+    }
+    memcpy(span->label, label, length + 1);
+}
+
+void _write_json_string(FILE *file, const char *string)
+{
+    fputc('"', file);
+    for (const unsigned char *cur = (const unsigned char *)string; *cur; cur++)
+    {
+        if (*cur == '"' || *cur == '\\')
+            fprintf(file, "\\%c", *cur);
+        else if (*cur < 0x20)
+            fprintf(file, "\\u%04x", *cur);
+        else
+            fputc(*cur, file);
+    }
+    fputc('"', file);
+}
+
+int _write_trace(trace_t *trace, const char *path)
+{
+    if (!trace || !path)
+    {
+        return ILLEGAL_ARGS;
+    }
+    FILE *file = fopen(path, "w");
+    if (!file)
+    {
+        return FATAL_ERROR;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    const char *separator = "";
+    for (unsigned int i = 0; i < trace->buffer_count; i++)
+    {
+        if (!trace->buffers[i].first)
+        {
+            continue;
+        }
+        // One track per worker slot
+        if (i + 1 < trace->buffer_count)
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"worker %u\"}}", separator, i, i);
+        else
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"outside the pool\"}}", separator, i);
+        separator = ",\n";
+
+        for (trace_chunk_t *chunk = trace->buffers[i].first; chunk; chunk = chunk->next)
+        {
+            for (unsigned int j = 0; j < chunk->count; j++)
+            {
+                trace_span_t *span = &chunk->spans[j];
+                fprintf(file, "%s{\"name\":", separator);
+                _write_json_string(file, span->label[0] ? span->label : "task");
+                fprintf(file, ",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"queued_us\":%.3f}}",
+                        i,
+                        (span->start_ns - trace->origin_ns) / 1000.0,
+                        (span->end_ns - span->start_ns) / 1000.0,
+                        (span->start_ns - span->enqueued_ns) / 1000.0);
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    int err = ferror(file) ? FATAL_ERROR : 0;
+    if (fclose(file))
+    {
+        err = FATAL_ERROR;
+    }
+    return err;
+}
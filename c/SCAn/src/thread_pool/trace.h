@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+
+#include "constants.h"
+
+#define TRACE_LABEL_LEN 64
+#define TRACE_CHUNK_SPANS 4096
+
+// One run of a task, times in CLOCK_MONOTONIC nanoseconds
+typedef struct trace_span_t
+{
+    long enqueued_ns;
+    long start_ns;
+    long end_ns;
+    char label[TRACE_LABEL_LEN];
+} trace_span_t;
+
+typedef struct trace_chunk_t trace_chunk_t;
+typedef struct trace_chunk_t
+{
+    trace_chunk_t *next;
+    unsigned int count;
+    trace_span_t spans[TRACE_CHUNK_SPANS];
+} trace_chunk_t;
+
+typedef struct trace_buffer_t
+{
+    trace_chunk_t *first;
+    trace_chunk_t *last;
+} trace_buffer_t;
+
+/*
+ * Spans of every task a pool ran. Each worker slot appends to its own
+ * buffer without locking, threads outside of the pool share the last one
+ * under m_outside. Spans never move once handed out.
+ */
+typedef struct trace_t
+{
+    long origin_ns;
+    // Worker slots plus one for outside threads
+    unsigned int buffer_count;
+    trace_buffer_t *buffers;
+    pthread_mutex_t m_outside;
+} trace_t;
+
+trace_t *_create_trace(unsigned int slots, long origin_ns);
+void _destroy_trace(trace_t *trace);
+// NULL if out of memory, the task then just isn't traced
+trace_span_t *_trace_begin(trace_t *trace, unsigned int slot, long enqueued_ns, long start_ns);
+void _trace_label(trace_span_t *span, const char *label);
+// Chrome trace event JSON, loads in chrome://tracing and Perfetto
+int _write_trace(trace_t *trace, const char *path);
+
+#endif
@@ -0,0 +1,307 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "stat_ring.h"
+
+// No liburing needed, the ring is set up and driven with the raw syscalls
+#if defined(__linux__) && defined(STATX_TYPE) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define STAT_RING_SUPPORTED
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+stat_ring_t *create_stat_ring(unsigned int depth);
+void destroy_stat_ring(stat_ring_t *ring);
+int stat_entries_at(stat_ring_t *ring, int dir_fd, stat_request_t *requests, unsigned int n);
+
+#ifdef STAT_RING_SUPPORTED
+
+entry_kind_t _kind_of_mode(unsigned int mode);
+unsigned int _statx_mask(unsigned int fields);
+
+struct stat_ring_t
+{
+    int fd;
+    unsigned int depth;
+    int broken;
+
+    // Submission queue, the kernel moves head and we move tail
+    void *sq_map;
+    size_t sq_map_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    // Entries filled in but not yet taken by the kernel
+    unsigned int unsubmitted;
+
+    // Completion queue, the other way around
+    void *cq_map;
+    size_t cq_map_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // One buffer per request in flight, free_slots holds the unused ones
+    struct statx *buffers;
+    unsigned int *free_slots;
+    unsigned int free_count;
+};
+
+int _io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int _io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// IORING_OP_STATX came with 5.6 like the probe. Older kernels set up the
+// ring just fine but fail every statx on it with EINVAL.
+int _supports_statx(int fd)
+{
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (!probe)
+    {
+        return 0;
+    }
+    int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                    probe->last_op >= IORING_OP_STATX &&
+                    (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+stat_ring_t *create_stat_ring(unsigned int depth)
+{
+    stat_ring_t *ring = calloc(1, sizeof(stat_ring_t));
+    if (!ring)
+    {
+        return NULL;
+    }
+    ring->fd = -1;
+    ring->sq_map = MAP_FAILED;
+    ring->cq_map = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Fails with ENOSYS on old kernels and EPERM where it is switched off
+    ring->fd = _io_uring_setup(depth ? depth : STAT_RING_DEPTH, &params);
+    if (ring->fd < 0 || !_supports_statx(ring->fd))
+    {
+        destroy_stat_ring(ring);
+        return NULL;
+    }
+    // The kernel rounds up to a power of two, the completion queue has at
+    // least as many entries so it can't overflow
+    ring->depth = params.sq_entries;
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_map_size > ring->sq_map_size)
+            ring->sq_map_size = ring->cq_map_size;
+        ring->cq_map_size = ring->sq_map_size;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        destroy_stat_ring(ring);
+        return NULL;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_map = ring->sq_map;
+    }
+    else
+    {
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED)
+        {
+            destroy_stat_ring(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        destroy_stat_ring(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_map;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    char *cq = ring->cq_map;
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    ring->buffers = malloc(ring->depth * sizeof(struct statx));
+    ring->free_slots = malloc(ring->depth * sizeof(unsigned int));
+    if (!ring->buffers || !ring->free_slots)
+    {
+        destroy_stat_ring(ring);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < ring->depth; i++)
+    {
+        ring->free_slots[i] = i;
+    }
+    ring->free_count = ring->depth;
+    return ring;
+}
+
+void destroy_stat_ring(stat_ring_t *ring)
+{
+    if (!ring)
+    {
+        return;
+    }
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_map_size);
+    // Closing waits for whatever is still in flight
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring->buffers);
+    free(ring->free_slots);
+    free(ring);
+}
+
+void _prepare_statx(stat_ring_t *ring, int dir_fd, stat_request_t *request, unsigned int index)
+{
+    unsigned int slot = ring->free_slots[--ring->free_count];
+    unsigned int tail = *ring->sq_tail;
+    unsigned int at = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[at];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = dir_fd;
+    sqe->addr = (unsigned long)request->name;
+    sqe->len = _statx_mask(request->fields);
+    sqe->addr2 = (unsigned long)&ring->buffers[slot];
+    // Network filesystems may answer from their cache instead of asking
+    sqe->statx_flags = AT_STATX_DONT_SYNC;
+    sqe->user_data = ((unsigned long long)index << 32) | slot;
+    ring->sq_array[at] = at;
+    // The entry has to be complete before the kernel sees the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+}
+
+// Fills in the requests of every completion there is, returns how many
+unsigned int _reap_statx(stat_ring_t *ring, stat_request_t *requests)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned int reaped = 0;
+    for (; head != tail; head++, reaped++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        stat_request_t *request = &requests[cqe->user_data >> 32];
+        unsigned int slot = cqe->user_data & 0xffffffffu;
+        if (cqe->res < 0)
+        {
+            request->result = FATAL_ERROR;
+        }
+        else
+        {
+            struct statx *buffer = &ring->buffers[slot];
+            if (request->fields & WALK_TYPE)
+                request->stat.kind = _kind_of_mode(buffer->stx_mode);
+            if (request->fields & WALK_SIZE)
+                request->stat.size = buffer->stx_size;
+            if (request->fields & WALK_MTIME)
+                request->stat.mtime = buffer->stx_mtime.tv_sec;
+            request->result = 0;
+        }
+        ring->free_slots[ring->free_count++] = slot;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+int stat_entries_at(stat_ring_t *ring, int dir_fd, stat_request_t *requests, unsigned int n)
+{
+    if (!ring || (!requests && n))
+    {
+        return ILLEGAL_ARGS;
+    }
+    if (ring->broken)
+    {
+        return FATAL_ERROR;
+    }
+
+    unsigned int prepared = 0;
+    unsigned int completed = 0;
+    while (completed < n)
+    {
+        // Tops the ring up as completions free slots
+        while (prepared < n && ring->free_count)
+        {
+            _prepare_statx(ring, dir_fd, &requests[prepared], prepared);
+            prepared++;
+        }
+        int submitted = _io_uring_enter(ring->fd, ring->unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (submitted < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                completed += _reap_statx(ring, requests);
+                continue;
+            }
+            ring->broken = 1;
+            return FATAL_ERROR;
+        }
+        ring->unsubmitted -= submitted;
+        completed += _reap_statx(ring, requests);
+    }
+    return 0;
+}
+
+#else
+
+stat_ring_t *create_stat_ring(unsigned int depth)
+{
+    (void)depth;
+    return NULL;
+}
+
+void destroy_stat_ring(stat_ring_t *ring)
+{
+    (void)ring;
+}
+
+int stat_entries_at(stat_ring_t *ring, int dir_fd, stat_request_t *requests, unsigned int n)
+{
+    (void)ring;
+    (void)dir_fd;
+    (void)requests;
+    (void)n;
+    return FATAL_ERROR;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef STAT_RING_H
+#define STAT_RING_H
+
+#include "walk.h"
+
+// Requests a ring keeps in flight by default
+#define STAT_RING_DEPTH 256
+
+typedef struct stat_request_t
+{
+    // Relative to the dir_fd the batch is run on, has to stay valid until
+    // stat_entries_at returns
+    const char *name;
+    unsigned int fields;
+    // Filled in for the fields asked for if result is 0
+    entry_stat_t stat;
+    // 0 or FATAL_ERROR if the entry could not be stat'ed
+    int result;
+} stat_request_t;
+
+/*
+ * Stats whole batches of entries through io_uring, keeping up to depth
+ * statx calls in flight at once instead of one per thread. The kernel hands
+ * them to its own workers, so a few threads keep a slow device busy.
+ * Owned by one thread at a time.
+ */
+typedef struct stat_ring_t stat_ring_t;
+
+// NULL if io_uring or its statx are not available here, callers stat one
+// by one then.
+// depth of 0 picks STAT_RING_DEPTH.
+stat_ring_t *create_stat_ring(unsigned int depth);
+void destroy_stat_ring(stat_ring_t *ring);
+// Stats every request relative to dir_fd, AT_FDCWD for paths. FATAL_ERROR
+// if the ring itself failed, which leaves the results undefined and the
+// ring unusable from then on.
+int stat_entries_at(stat_ring_t *ring, int dir_fd, stat_request_t *requests, unsigned int n);
+
+#endif
@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "walk.h"
+
+#ifdef __linux__
+// Record layout getdents64 fills the buffer with
+typedef struct linux_dirent64_t
+{
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} linux_dirent64_t;
+#endif
+
+int open_directory_at(int dir_fd, const char *name);
+int init_dir_reader(dir_reader_t *reader, size_t buffer_size);
+void destroy_dir_reader(dir_reader_t *reader);
+int start_dir_reader(dir_reader_t *reader, int fd);
+const dir_entry_t *read_dir_entry(dir_reader_t *reader);
+void finish_dir_reader(dir_reader_t *reader);
+int stat_entry_at(int dir_fd, const char *name, unsigned int fields, entry_stat_t *stat);
+
+entry_kind_t _kind_of_mode(unsigned int mode)
+{
+    if (S_ISDIR(mode))
+        return ENTRY_DIRECTORY;
+    if (S_ISREG(mode))
+        return ENTRY_FILE;
+    return ENTRY_OTHER;
+}
+
+entry_kind_t _kind_of_type(unsigned char type)
+{
+    switch (type)
+    {
+    case DT_DIR:
+        return ENTRY_DIRECTORY;
+    case DT_REG:
+        return ENTRY_FILE;
+    case DT_UNKNOWN:
+    case DT_LNK:
+        return ENTRY_UNKNOWN;
+    default:
+        return ENTRY_OTHER;
+    }
+}
+
+int _is_dot_entry(const char *name)
+{
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+int open_directory_at(int dir_fd, const char *name)
+{
+    return openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+int init_dir_reader(dir_reader_t *reader, size_t buffer_size)
+{
+    if (!reader)
+    {
+        return ILLEGAL_ARGS;
+    }
+    memset(reader, 0, sizeof(dir_reader_t));
+    reader->fd = -1;
+#ifdef __linux__
+    reader->buffer_size = buffer_size ? buffer_size : DIR_READER_BUFFER_SIZE;
+    reader->buffer = malloc(reader->buffer_size);
+    if (!reader->buffer)
+    {
+        return MEMORY_ERROR;
+    }
+#else
+    // readdir brings its own buffer
+    (void)buffer_size;
+#endif
+    return 0;
+}
+
+void destroy_dir_reader(dir_reader_t *reader)
+{
+    if (!reader)
+    {
+        return;
+    }
+    finish_dir_reader(reader);
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+int start_dir_reader(dir_reader_t *reader, int fd)
+{
+    if (!reader || fd < 0)
+    {
+        return ILLEGAL_ARGS;
+    }
+    finish_dir_reader(reader);
+#ifdef __linux__
+    if (!reader->buffer)
+    {
+        return ILLEGAL_ARGS;
+    }
+#else
+    // readdir takes over the descriptor it reads from, it gets a copy
+    int copy = dup(fd);
+    reader->dir = copy < 0 ? NULL : fdopendir(copy);
+    if (!reader->dir)
+    {
+        if (copy >= 0)
+            close(copy);
+        return FATAL_ERROR;
+    }
+#endif
+    reader->fd = fd;
+    reader->offset = 0;
+    reader->filled = 0;
+    reader->error = 0;
+    return 0;
+}
+
+const dir_entry_t *read_dir_entry(dir_reader_t *reader)
+{
+    if (!reader || reader->fd < 0)
+    {
+        return NULL;
+    }
+#ifdef __linux__
+    for (;;)
+    {
+        if (reader->offset >= reader->filled)
+        {
+            long filled = syscall(SYS_getdents64, reader->fd, reader->buffer, reader->buffer_size);
+            if (filled <= 0)
+            {
+                if (filled < 0)
+                    reader->error = errno;
+                return NULL;
+            }
+            reader->reads++;
+            reader->filled = filled;
+            reader->offset = 0;
+        }
+        linux_dirent64_t *record = (linux_dirent64_t *)(reader->buffer + reader->offset);
+        reader->offset += record->d_reclen;
+        if (_is_dot_entry(record->d_name))
+        {
+            continue;
+        }
+        reader->entry.name = record->d_name;
+        reader->entry.name_len = strlen(record->d_name);
+        reader->entry.kind = _kind_of_type(record->d_type);
+        return &reader->entry;
+    }
+#else
+    struct dirent *entry;
+    // readdir only tells an error from the end through errno
+    errno = 0;
+    while ((entry = readdir(reader->dir)) != NULL)
+    {
+        if (_is_dot_entry(entry->d_name))
+        {
+            continue;
+        }
+        reader->entry.name = entry->d_name;
+        reader->entry.name_len = strlen(entry->d_name);
+        reader->entry.kind = _kind_of_type(entry->d_type);
+        return &reader->entry;
+    }
+    reader->error = errno;
+    return NULL;
+#endif
+}
+
+void finish_dir_reader(dir_reader_t *reader)
+{
+    if (!reader)
+    {
+        return;
+    }
+    if (reader->dir)
+    {
+        closedir(reader->dir);
+        reader->dir = NULL;
+    }
+    reader->fd = -1;
+    reader->offset = 0;
+    reader->filled = 0;
+}
+
+#if defined(__linux__) && defined(STATX_TYPE)
+unsigned int _statx_mask(unsigned int fields)
+{
+    unsigned int mask = 0;
+    if (fields & WALK_TYPE)
+        mask |= STATX_TYPE;
+    if (fields & WALK_SIZE)
+        mask |= STATX_SIZE;
+    if (fields & WALK_MTIME)
+        mask |= STATX_MTIME;
+    return mask;
+}
+#endif
+
+int stat_entry_at(int dir_fd, const char *name, unsigned int fields, entry_stat_t *stat)
+{
+    if (!name || !stat)
+    {
+        return ILLEGAL_ARGS;
+    }
+
+#if defined(__linux__) && defined(STATX_TYPE)
+    unsigned int mask = _statx_mask(fields);
+
+    // Network filesystems may answer from their cache instead of asking
+    struct statx buffer;
+    if (statx(dir_fd, name, AT_STATX_DONT_SYNC, mask, &buffer) != 0)
+    {
+        return FATAL_ERROR;
+    }
+    if (fields & WALK_TYPE)
+        stat->kind = _kind_of_mode(buffer.stx_mode);
+    if (fields & WALK_SIZE)
+        stat->size = buffer.stx_size;
+    if (fields & WALK_MTIME)
+        stat->mtime = buffer.stx_mtime.tv_sec;
+#else
+    struct stat buffer;
+    if (fstatat(dir_fd, name, &buffer, 0) != 0)
+    {
+        return FATAL_ERROR;
+    }
+    if (fields & WALK_TYPE)
+        stat->kind = _kind_of_mode(buffer.st_mode);
+    if (fields & WALK_SIZE)
+        stat->size = buffer.st_size;
+    if (fields & WALK_MTIME)
+        stat->mtime = buffer.st_mtime;
+#endif
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include <dirent.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "constants.h"
+
+// Metadata stat_entry_at can be asked for, each one left out is less work
+// for the filesystem
+#define WALK_TYPE  0x1u
+#define WALK_SIZE  0x2u
+#define WALK_MTIME 0x4u
+
+typedef enum {
+    ENTRY_UNKNOWN,
+    ENTRY_DIRECTORY,
+    ENTRY_FILE,
+    // Anything else, like sockets and devices
+    ENTRY_OTHER,
+} entry_kind_t;
+
+typedef struct entry_stat_t
+{
+    // Only filled in for the fields asked for
+    entry_kind_t kind;
+    unsigned long long size;
+    time_t mtime;
+} entry_stat_t;
+
+// Default buffer of a dir_reader_t, room for a few thousand entries per call
+#define DIR_READER_BUFFER_SIZE (128 * 1024)
+
+typedef struct dir_entry_t
+{
+    const char *name;
+    unsigned int name_len;
+    // As far as the directory knows it. Symlinks are followed like stat
+    // does, so those come back as ENTRY_UNKNOWN just like entries of
+    // filesystems without d_type.
+    entry_kind_t kind;
+} dir_entry_t;
+
+/*
+ * Reads directories in bulk. On Linux getdents64 fills the whole buffer at
+ * once and the records are walked in place, libc's DIR only asks for a few
+ * KiB at a time. Elsewhere it falls back to readdir. One reader is meant to
+ * be kept per thread and reused for every directory.
+ */
+typedef struct dir_reader_t
+{
+    int fd;
+    char *buffer;
+    size_t buffer_size;
+    size_t offset;
+    size_t filled;
+    // Calls that filled the buffer since the reader was created
+    unsigned long reads;
+    // errno of a read that failed part way, 0 while the listing is whole
+    int error;
+    DIR *dir;
+    dir_entry_t entry;
+} dir_reader_t;
+
+// Opens the directory name relative to dir_fd, AT_FDCWD for paths relative
+// to the working directory or absolute ones. -1 with errno set on failure.
+int open_directory_at(int dir_fd, const char *name);
+
+// buffer_size of 0 picks DIR_READER_BUFFER_SIZE
+int init_dir_reader(dir_reader_t *reader, size_t buffer_size);
+void destroy_dir_reader(dir_reader_t *reader);
+// Starts reading the directory fd, which stays the caller's to close
+int start_dir_reader(dir_reader_t *reader, int fd);
+// Next entry other than . and .., NULL once the directory is done or could
+// not be read further, error tells the two apart. The entry is valid until
+// the next call.
+const dir_entry_t *read_dir_entry(dir_reader_t *reader);
+void finish_dir_reader(dir_reader_t *reader);
+// Fetches only the requested fields of name relative to dir_fd, following
+// symlinks. Uses statx where available, fstatat otherwise.
+int stat_entry_at(int dir_fd, const char *name, unsigned int fields, entry_stat_t *stat);
+
+#endif
@@ -0,0 +1,297 @@
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "watch.h"
+
+// Room for a few hundred events per read
+#define WATCH_EVENT_BUFFER (64 * 1024)
+#define WATCH_MIN_PATHS 1024
+
+watcher_t *create_watcher();
+void destroy_watcher(watcher_t *watcher);
+int watch_directory(watcher_t *watcher, const char *path);
+void unwatch_subtree(watcher_t *watcher, const char *path, unsigned int path_len);
+void unwatch_matching(watcher_t *watcher, int (*match)(const char *path, void *user_data), void *user_data);
+unsigned long watched_directories(watcher_t *watcher);
+int read_watch_events(watcher_t *watcher, int timeout_ms, watch_handler_t handler, void *user_data);
+
+#ifdef __linux__
+
+// Changes of the entries only, a directory's own delete or move is
+// reported by its parent
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+watcher_t *create_watcher()
+{
+    watcher_t *watcher = calloc(1, sizeof(watcher_t));
+    if (!watcher)
+    {
+        return NULL;
+    }
+    watcher->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    watcher->events = malloc(WATCH_EVENT_BUFFER);
+    watcher->path = malloc(PATH_MAX);
+    if (watcher->fd < 0 || !watcher->events || !watcher->path || pthread_mutex_init(&watcher->m_paths, NULL))
+    {
+        if (watcher->fd >= 0)
+            close(watcher->fd);
+        free(watcher->events);
+        free(watcher->path);
+        free(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+void destroy_watcher(watcher_t *watcher)
+{
+    if (!watcher)
+    {
+        return;
+    }
+    // Closing drops every watch at once
+    close(watcher->fd);
+    for (int i = 0; i < watcher->path_capacity; i++)
+    {
+        free(watcher->paths[i]);
+    }
+    free(watcher->paths);
+    free(watcher->events);
+    free(watcher->path);
+    pthread_mutex_destroy(&watcher->m_paths);
+    free(watcher);
+}
+
+int watch_directory(watcher_t *watcher, const char *path)
+{
+    if (!watcher || !path)
+    {
+        return ILLEGAL_ARGS;
+    }
+    char *copy = strdup(path);
+    if (!copy)
+    {
+        return MEMORY_ERROR;
+    }
+
+    pthread_mutex_lock(&watcher->m_paths);
+    int wd = inotify_add_watch(watcher->fd, path, WATCH_MASK);
+    if (wd < 0)
+    {
+        pthread_mutex_unlock(&watcher->m_paths);
+        free(copy);
+        return errno == ENOSPC ? QUEUE_FULL : FATAL_ERROR;
+    }
+    // Descriptors are handed out counting up, so they index the paths
+    if (wd >= watcher->path_capacity)
+    {
+        int capacity = watcher->path_capacity ? watcher->path_capacity : WATCH_MIN_PATHS;
+        while (capacity <= wd)
+            capacity *= 2;
+        char **paths = realloc(watcher->paths, capacity * sizeof(char *));
+        if (!paths)
+        {
+            inotify_rm_watch(watcher->fd, wd);
+            pthread_mutex_unlock(&watcher->m_paths);
+            free(copy);
+            return MEMORY_ERROR;
+        }
+        memset(paths + watcher->path_capacity, 0, (capacity - watcher->path_capacity) * sizeof(char *));
+        watcher->paths = paths;
+        watcher->path_capacity = capacity;
+    }
+    // The same directory seen again, under its newest path
+    if (watcher->paths[wd])
+        free(watcher->paths[wd]);
+    else
+        watcher->watched++;
+    watcher->paths[wd] = copy;
+    pthread_mutex_unlock(&watcher->m_paths);
+    return 0;
+}
+
+void _forget_watch(watcher_t *watcher, int wd)
+{
+    free(watcher->paths[wd]);
+    watcher->paths[wd] = NULL;
+    watcher->watched--;
+}
+
+void unwatch_subtree(watcher_t *watcher, const char *path, unsigned int path_len)
+{
+    if (!watcher || !path)
+    {
+        return;
+    }
+    pthread_mutex_lock(&watcher->m_paths);
+    for (int wd = 0; wd < watcher->path_capacity; wd++)
+    {
+        const char *watched = watcher->paths[wd];
+        if (watched && !strncmp(watched, path, path_len) && (watched[path_len] == '\0' || watched[path_len] == '/'))
+        {
+            // Already gone if the directory was deleted
+            inotify_rm_watch(watcher->fd, wd);
+            _forget_watch(watcher, wd);
+        }
+    }
+    pthread_mutex_unlock(&watcher->m_paths);
+}
+
+void unwatch_matching(watcher_t *watcher, int (*match)(const char *path, void *user_data), void *user_data)
+{
+    if (!watcher || !match)
+    {
+        return;
+    }
+    pthread_mutex_lock(&watcher->m_paths);
+    for (int wd = 0; wd < watcher->path_capacity; wd++)
+    {
+        if (watcher->paths[wd] && match(watcher->paths[wd], user_data))
+        {
+            inotify_rm_watch(watcher->fd, wd);
+            _forget_watch(watcher, wd);
+        }
+    }
+    pthread_mutex_unlock(&watcher->m_paths);
+}
+
+unsigned long watched_directories(watcher_t *watcher)
+{
+    if (!watcher)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&watcher->m_paths);
+    unsigned long watched = watcher->watched;
+    pthread_mutex_unlock(&watcher->m_paths);
+    return watched;
+}
+
+int read_watch_events(watcher_t *watcher, int timeout_ms, watch_handler_t handler, void *user_data)
+{
+    if (!watcher || !handler)
+    {
+        return ILLEGAL_ARGS;
+    }
+    struct pollfd ready = {.fd = watcher->fd, .events = POLLIN};
+    int polled = poll(&ready, 1, timeout_ms);
+    if (polled <= 0)
+    {
+        return polled < 0 && errno != EINTR ? FATAL_ERROR : 0;
+    }
+
+    int handled = 0;
+    for (;;)
+    {
+        ssize_t length = read(watcher->fd, watcher->events, WATCH_EVENT_BUFFER);
+        if (length <= 0)
+        {
+            // Drained
+            return handled;
+        }
+        for (char *at = watcher->events; at < watcher->events + length;)
+        {
+            struct inotify_event *raw = (struct inotify_event *)at;
+            at += sizeof(struct inotify_event) + raw->len;
+
+            watch_event_t event;
+            event.is_dir = (raw->mask & IN_ISDIR) != 0;
+            event.path = "";
+            event.path_len = 0;
+            if (raw->mask & IN_Q_OVERFLOW)
+            {
+                event.kind = WATCH_OVERFLOW;
+                handler(&event, user_data);
+                handled++;
+                continue;
+            }
+            pthread_mutex_lock(&watcher->m_paths);
+            const char *directory = raw->wd < watcher->path_capacity ? watcher->paths[raw->wd] : NULL;
+            if (raw->mask & IN_IGNORED)
+            {
+                // Deleted, unmounted or removed by unwatch_subtree before
+                if (directory)
+                    _forget_watch(watcher, raw->wd);
+                pthread_mutex_unlock(&watcher->m_paths);
+                continue;
+            }
+            int written = directory && raw->len ? snprintf(watcher->path, PATH_MAX, "%s/%s", directory, raw->name) : -1;
+            pthread_mutex_unlock(&watcher->m_paths);
+            if (written < 0 || written >= PATH_MAX)
+            {
+                continue;
+            }
+            event.path = watcher->path;
+            event.path_len = written;
+
+            if (raw->mask & (IN_CREATE | IN_MOVED_TO))
+                event.kind = WATCH_CREATED;
+            else if (raw->mask & (IN_DELETE | IN_MOVED_FROM))
+                event.kind = WATCH_DELETED;
+            else if (raw->mask & IN_CLOSE_WRITE)
+                event.kind = WATCH_CHANGED;
+            else
+                continue;
+            handler(&event, user_data);
+            handled++;
+        }
+    }
+}
+
+#else
+
+watcher_t *create_watcher()
+{
+    return NULL;
+}
+
+void destroy_watcher(watcher_t *watcher)
+{
+    (void)watcher;
+}
+
+int watch_directory(watcher_t *watcher, const char *path)
+{
+    (void)watcher;
+    (void)path;
+    return FATAL_ERROR;
+}
+
+void unwatch_subtree(watcher_t *watcher, const char *path, unsigned int path_len)
+{
+    (void)watcher;
+    (void)path;
+    (void)path_len;
+}
+
+void unwatch_matching(watcher_t *watcher, int (*match)(const char *path, void *user_data), void *user_data)
+{
+    (void)watcher;
+    (void)match;
+    (void)user_data;
+}
+
+unsigned long watched_directories(watcher_t *watcher)
+{
+    (void)watcher;
+    return 0;
+}
+
+int read_watch_events(watcher_t *watcher, int timeout_ms, watch_handler_t handler, void *user_data)
+{
+    (void)watcher;
+    (void)timeout_ms;
+    (void)handler;
+    (void)user_data;
+    return FATAL_ERROR;
+}
+
+#endif
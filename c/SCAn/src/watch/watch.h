@@ -0,0 +1,63 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <pthread.h>
+
+#include "constants.h"
+
+typedef enum {
+    // Created or moved into a watched directory
+    WATCH_CREATED,
+    // Deleted or moved out of one
+    WATCH_DELETED,
+    // A file was written and closed
+    WATCH_CHANGED,
+    // The kernel dropped events, everything has to be looked at again
+    WATCH_OVERFLOW,
+} watch_event_kind_t;
+
+typedef struct watch_event_t
+{
+    watch_event_kind_t kind;
+    int is_dir;
+    // Watched directory and name joined, empty for WATCH_OVERFLOW. Only
+    // valid during the handler.
+    const char *path;
+    unsigned int path_len;
+} watch_event_t;
+
+typedef void (*watch_handler_t)(const watch_event_t *event, void *user_data);
+
+/*
+ * inotify watches on a set of directories, each one reporting changes of
+ * its own entries. Moves come in as a delete and a create, so a renamed
+ * directory is taken for a new one. Directories can be added from any
+ * thread, events are read by one.
+ */
+typedef struct watcher_t
+{
+    int fd;
+    pthread_mutex_t m_paths;
+    // Path of every watch descriptor, NULL for unused ones
+    char **paths;
+    int path_capacity;
+    unsigned long watched;
+    char *events;
+    char *path;
+} watcher_t;
+
+// NULL if inotify is not available
+watcher_t *create_watcher();
+void destroy_watcher(watcher_t *watcher);
+// QUEUE_FULL once the user is out of watches, see fs.inotify.max_user_watches
+int watch_directory(watcher_t *watcher, const char *path);
+// Stops watching path and every directory below it
+void unwatch_subtree(watcher_t *watcher, const char *path, unsigned int path_len);
+// Stops watching every directory match returns non-zero for, in one pass
+void unwatch_matching(watcher_t *watcher, int (*match)(const char *path, void *user_data), void *user_data);
+unsigned long watched_directories(watcher_t *watcher);
+// Waits up to timeout_ms and hands every event that arrived to handler.
+// The number of events, 0 after a timeout or signal.
+int read_watch_events(watcher_t *watcher, int timeout_ms, watch_handler_t handler, void *user_data);
+
+#endif